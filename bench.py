@@ -0,0 +1,136 @@
+import asyncio
+import concurrent.futures
+import configparser
+import csv
+import io
+import json
+import os
+import sys
+import time
+import parseutils as pu
+
+# python bench.py [threads] [dump] [loop]
+#
+# threads: thread scaling of the parsers, every thread parsing its own
+# copy of the input. On a free-threaded build (python3.13t) throughput
+# should grow with the threads up to the core count; with the GIL it
+# stays flat.
+#
+# dump: the serializers against the stdlib writers, and the round trip
+# through the matching parser.
+#
+# loop: the longest stall of an asyncio event loop while a large CSV is
+# parsed in it, and while pu.submit() parses it on a worker thread.
+
+csv_src = 'id,name,score,ts\n' + ''.join(
+	'%d,"name %d",%d.5,2024-01-02T03:04:05+01:00\n' % (k, k, k) for k in range(20000))
+ini_src = ''.join('[section%d]\nkey = value %d\nquoted = "a \\"b\\" c"\n' % (k, k) for k in range(5000))
+tags_src = '<div class="row" id="r1"><a href="/x">x</a><br/></div>\n' * 10000
+dicts = ['{"a": %d, "b": [1, 2.5, "x"], "c": {"d": "e"}}' % k for k in range(20000)]
+
+def best(func, n=5):
+	times = []
+	for _ in range(n):
+		t = time.perf_counter()
+		func()
+		times.append(time.perf_counter() - t)
+	return min(times)
+
+def run(job, threads, rounds=4):
+	with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+		t = time.perf_counter()
+		for f in [pool.submit(job) for _ in range(threads * rounds)]:
+			f.result()
+		return threads * rounds / (time.perf_counter() - t)
+
+def bench_threads():
+	jobs = {
+		'parse_csv_records': lambda: pu.parse_csv_records(csv_src),
+		'parse_ini': lambda: pu.parse_ini(ini_src),
+		'parse_tags': lambda: pu.parse_tags(tags_src),
+		'parse_dict_many': lambda: pu.parse_dict_many(dicts),
+	}
+	gil = getattr(sys, '_is_gil_enabled', lambda: True)()
+	print('python %s, gil %s, %d cores' % (sys.version.split()[0], 'on' if gil else 'off', os.cpu_count()))
+	counts = sorted({1, 2, 4, os.cpu_count() or 1})
+	for name, job in jobs.items():
+		base = run(job, 1)
+		print('%-18s' % name + ''.join('  %dT %5.2fx' % (n, run(job, n) / base) for n in counts))
+
+def csv_writer(rows):
+	out = io.StringIO()
+	csv.writer(out, lineterminator='\n').writerows(rows)
+	return out.getvalue()
+
+def ini_writer(sections):
+	parser = configparser.ConfigParser()
+	parser.read_dict(sections)
+	out = io.StringIO()
+	parser.write(out)
+	return out.getvalue()
+
+def bench_dump():
+	rows = [[k, 'name %d' % k, k + 0.5, 'a,b' if k % 7 == 0 else 'x'] for k in range(100000)]
+	obj = {'k%d' % k: [k, k + 0.25, 'v%d' % k, {'n': 'x y'}] for k in range(20000)}
+	sections = {'s%d' % k: {'key': 'value %d' % k, 'port': str(k)} for k in range(20000)}
+
+	pu_src = pu.dump_dict(obj)
+	pu_ini = pu.dump_ini(sections)
+	cases = [
+		('csv', lambda: pu.dump_csv(rows), lambda: csv_writer(rows)),
+		('dict', lambda: pu.dump_dict(obj), lambda: json.dumps(obj)),
+		('ini', lambda: pu.dump_ini(sections), lambda: ini_writer(sections)),
+		('csv round trip', lambda: pu.parse_csv_rows(pu.dump_csv(rows)),
+			lambda: list(csv.reader(io.StringIO(csv_writer(rows))))),
+		('dict round trip', lambda: pu.parse_dict(0, pu.dump_dict(obj), len(pu_src)),
+			lambda: json.loads(json.dumps(obj))),
+		('ini round trip', lambda: pu.parse_ini(pu.dump_ini(sections)),
+			lambda: configparser.ConfigParser().read_string(ini_writer(sections))),
+	]
+	for name, fast, std in cases:
+		a, b = best(fast), best(std)
+		print('%-16s pu %7.1f ms  stdlib %7.1f ms  %5.2fx' % (name, a * 1e3, b * 1e3, b / a))
+	assert pu.parse_ini(pu_ini) == sections
+
+async def loop_stall(parse):
+	stall = 0
+	done = False
+
+	async def tick():
+		nonlocal stall
+		while not done:
+			t = time.perf_counter()
+			await asyncio.sleep(0.001)
+			stall = max(stall, time.perf_counter() - t)
+
+	ticker = asyncio.create_task(tick())
+	await asyncio.sleep(0.01)
+	t = time.perf_counter()
+	await parse()
+	elapsed = time.perf_counter() - t
+	done = True
+	await ticker
+	return elapsed, stall
+
+def bench_loop():
+	src = csv_src * 10
+
+	async def inline():
+		pu.parse_csv_records(src)
+
+	async def submitted():
+		await asyncio.wrap_future(pu.submit(pu.parse_csv_records, src))
+
+	print('%.1f MB of CSV' % (len(src) / 1e6))
+	for name, parse in [('in the loop', inline), ('pu.submit', submitted)]:
+		elapsed, stall = asyncio.run(loop_stall(parse))
+		print('%-12s parse %6.1f ms  longest loop stall %6.1f ms' % (name, elapsed * 1e3, stall * 1e3))
+
+if __name__ == '__main__':
+	which = sys.argv[1:] or ['threads', 'dump', 'loop']
+	if 'threads' in which:
+		bench_threads()
+	if 'dump' in which:
+		bench_dump()
+	if 'loop' in which:
+		bench_loop()
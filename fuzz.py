@@ -0,0 +1,329 @@
+import os
+import random
+import sys
+import tempfile
+import time
+import parseutils as pu
+
+# python fuzz.py [seconds] [seed]
+#
+# Feeds random and adversarial text to every parser. Each input has to
+# parse or raise ValueError (ParseError is one), or RecursionError for
+# nesting past the recursion limit; anything else, or a crash, is a bug.
+# Results are checked against the other paths to the same answer:
+# offsets=True, on_error='raise'/'skip'/'collect', the serializers and
+# IniDocument/CssDocument.edit() against a fresh parse.
+#
+# Then every parser gets adversarial inputs of n and 8n characters (runs
+# of brackets, quotes, '<' and broken lines). Time may grow at most
+# GROWTH times; on a PU_STATS build the characters scanned per input
+# character are bounded too. Failing inputs are written to fuzz-*.txt.
+
+GROWTH = 20
+SCANNED_PER_CHAR = 4
+
+ALPHABET = '[]{}<>()"\'\\/=:;,!?-#*@ \t\r\n' + 'abcxyz019.e+' + '\xe9あ\U0001f600'
+SEEDS = [
+	'{"a": 1, "b": [1, 2.5, "x y"], "c": {"d": "e\\"f"}}',
+	'[1, "2", [3, {"k": "v"}], 4.5,]',
+	'[s]\nkey = value\nquoted = "a \\"b\\" c"\n; comment\n[t]\nx: y\n',
+	'id,name,score\n1,"a,b",2.5\n2,"say ""hi""",3\n3,"x\r\ny",\n',
+	'<!doctype html><a href="/x" id=1>t</a><!-- <b> --><br/><p x=\'>\'>',
+	'a { color: red; b { margin: 0 } } @media (x) { c { d: "e;}" } } /* } */',
+]
+
+
+class Failure(Exception):
+	pass
+
+
+def mutate(rng, src):
+	s = list(src)
+	for _ in range(rng.randint(1, 8)):
+		op = rng.random()
+		k = rng.randint(0, len(s))
+		if op < 0.4 or not s:
+			s[k:k] = rng.choice(ALPHABET) * rng.choice([1, 1, 1, 2, 5])
+		elif op < 0.7:
+			del s[k:k + rng.randint(1, 4)]
+		elif op < 0.9:
+			j = rng.randint(0, len(s))
+			s[k:k] = s[j:j + rng.randint(1, 16)]
+		else:
+			s[k:k] = rng.choice(SEEDS)
+	return ''.join(s)
+
+
+def random_text(rng):
+	if rng.random() < 0.7:
+		return mutate(rng, rng.choice(SEEDS))
+	return ''.join(rng.choice(ALPHABET) for _ in range(rng.randint(0, 64)))
+
+
+def attempt(func, *args, **kwargs):
+	# (result, None) or (None, exception) for the exceptions malformed
+	# input may raise; anything else propagates as a bug
+	try:
+		return func(*args, **kwargs), None
+	except (ValueError, RecursionError) as e:
+		return None, e
+
+
+def check_cursor(name, result, src, end=0):
+	# end=1 where a last row without its line break reports len + 1
+	index = result[0] if isinstance(result, tuple) else result
+	if index is not None and not 0 <= index <= len(src) + end:
+		raise Failure('%s: index %r out of range' % (name, index))
+
+
+def check_on_error(name, func, src):
+	raised, exc = attempt(func, src)
+	skipped, _ = attempt(func, src, on_error='skip')
+	collected, _ = attempt(func, src, on_error='collect')
+	if skipped is None or collected is None:
+		raise Failure('%s: skip/collect raised' % name)
+	if collected[0] != skipped:
+		raise Failure('%s: skip and collect disagree' % name)
+	if exc is None and (raised != skipped or collected[1]):
+		raise Failure('%s: raise and skip disagree on valid input' % name)
+	if exc is not None and isinstance(exc, pu.ParseError) and not collected[1]:
+		raise Failure('%s: raised but collected no error' % name)
+	for e in collected[1]:
+		if not 0 <= e.offset <= len(src) or e.line < 1 or e.column < 1:
+			raise Failure('%s: error position %r' % (name, (e.offset, e.line, e.column)))
+
+
+def check_cursors(src):
+	n = len(src)
+	for func in (pu.parse_section, pu.parse_key_value, pu.parse_list, pu.skip_spaces):
+		for i in (0, n // 2):
+			check_cursor(func.__name__, attempt(func, i, src, n)[0], src)
+	check_cursor('skip_at_newline', attempt(pu.skip_at_newline, 0, src, n)[0], src)
+
+	value, _ = attempt(pu.parse_dict, 0, src, n)
+	spans, _ = attempt(pu.parse_dict, 0, src, n, offsets=True)
+	check_cursor('parse_dict', value, src)
+	if value is not None and (spans is None or spans[0] != value[0] or len(spans[1]) < len(value[1])):
+		raise Failure('parse_dict: offsets=True disagrees')
+	if value is not None and pu.parse_dict_many([src]) != [value[1]]:
+		raise Failure('parse_dict_many disagrees with parse_dict')
+	attempt(pu.extract, src, ['a', 'b.c', 'c.d', 'x[0]'])
+
+	tag, _ = attempt(pu.parse_tag, 0, src, n)
+	spans, _ = attempt(pu.parse_tag, 0, src, n, offsets=True)
+	check_cursor('parse_tag', tag, src)
+	if tag is not None and (spans is None or spans[0] != tag[0]):
+		raise Failure('parse_tag: offsets=True disagrees')
+
+	row, _ = attempt(pu.parse_csv_line, 0, src, n)
+	spans, _ = attempt(pu.parse_csv_line, 0, src, n, offsets=True)
+	check_cursor('parse_csv_line', row, src, 1)
+	if row is not None and (spans is None or spans[0] != row[0]):
+		raise Failure('parse_csv_line: offsets=True disagrees')
+
+	attempt(pu.parse_key_value_many, src.split('\n'))
+	check_cursor('parse_css_block', attempt(pu.parse_css_block, 0, src, n)[0], src)
+	check_cursor('parse_css_blocks', attempt(pu.parse_css_blocks, 0, src, n)[0], src)
+
+
+def check_documents(rng, src):
+	check_on_error('parse_ini', pu.parse_ini, src)
+	check_on_error('parse_tags', pu.parse_tags, src)
+	check_on_error('parse_csv_records', pu.parse_csv_records, src)
+
+	rows, _ = attempt(pu.parse_csv_rows, src)
+	starts = pu.csv_row_starts(src)
+	if rows is not None:
+		if len(starts) != len(rows) + 1:
+			raise Failure('csv_row_starts disagrees with parse_csv_rows')
+		if pu.parse_csv_rows(src, 1, len(rows), row_starts=starts) != rows[1:]:
+			raise Failure('parse_csv_rows: row_starts changes the rows')
+	attempt(pu.parse_csv_arrow, src)
+	if pu.find_line_starts(src).tolist() != [0] + [k + 1 for k, c in enumerate(src) if c == '\n' and k + 1 < len(src)]:
+		raise Failure('find_line_starts')
+
+	doc = pu.IniDocument(src)
+	css, _ = attempt(pu.CssDocument, src)
+	for _ in range(4):
+		beg = rng.randint(0, len(src))
+		end = rng.randint(beg, min(len(src), beg + 8))
+		text = rng.choice(['', '\n', ']', '[s]\n', 'k = v\n', '"', '}', '{', ';', rng.choice(ALPHABET)])
+		src = src[:beg] + text + src[end:]
+		doc.edit(beg, end, text)
+		fresh, errors = pu.parse_ini(src, on_error='collect')
+		if doc.doc != fresh or [(e.offset, e.expected) for e in doc.errors] != [(e.offset, e.expected) for e in errors]:
+			raise Failure('IniDocument.edit differs from a fresh parse')
+		if css is not None:
+			_, exc = attempt(css.edit, beg, end, text)
+			fresh, _ = attempt(pu.CssDocument, src)
+			if exc is not None:
+				css = None  # a failed edit is not applied, so it no longer follows src
+			elif fresh is None or css.doc != fresh.doc:
+				raise Failure('CssDocument.edit differs from a fresh parse')
+
+
+def random_value(rng, depth=0):
+	r = rng.random()
+	if depth < 3 and r < 0.15:
+		return [random_value(rng, depth + 1) for _ in range(rng.randint(0, 3))]
+	if depth < 3 and r < 0.3:
+		return {random_word(rng): random_value(rng, depth + 1) for _ in range(rng.randint(0, 3))}
+	if r < 0.5:
+		return rng.randint(0, 10 ** rng.randint(1, 20))
+	if r < 0.6:
+		return rng.random() * 10 ** rng.randint(-8, 8)
+	return random_word(rng)
+
+
+def random_word(rng):
+	return ''.join(rng.choice(ALPHABET) for _ in range(rng.randint(0, 8)))
+
+
+def check_round_trips(rng):
+	obj = {random_word(rng): random_value(rng) for _ in range(rng.randint(0, 4))}
+	try:
+		src = pu.dump_dict(obj)
+	except ValueError:
+		return
+	if pu.parse_dict(0, src, len(src)) != (len(src), obj):
+		raise Failure('dump_dict round trip: %r' % (obj,))
+
+	rows = [[random_word(rng) for _ in range(rng.randint(1, 4))] for _ in range(rng.randint(1, 4))]
+	rows = [row for row in rows if row != ['']]  # a blank line is no row
+	if pu.parse_csv_rows(pu.dump_csv(rows)) != rows:
+		raise Failure('dump_csv round trip: %r' % (rows,))
+
+	sections = {random_word(rng): {random_word(rng): random_word(rng)
+		for _ in range(rng.randint(0, 3))} for _ in range(rng.randint(0, 3))}
+	try:
+		src = pu.dump_ini(sections)
+	except ValueError:
+		return  # not representable in INI
+	if pu.parse_ini(src) != {k: v for k, v in sections.items() if k or v}:  # no '' header to write
+		raise Failure('dump_ini round trip: %r' % (sections,))
+
+
+def check_files(src, tmp):
+	path = os.path.join(tmp, 'in.txt')
+	with open(path, 'w', encoding='utf-8', newline='') as f:
+		f.write(src)
+	for name, func in [('parse_csv_file', pu.parse_csv_file), ('parse_ini_file', pu.parse_ini_file)]:
+		whole, _ = attempt(func, path, on_error='skip')
+		small, _ = attempt(func, path, on_error='skip', block_size=7)
+		if whole != small:
+			raise Failure('%s: block_size changes the result' % name)
+	if attempt(pu.build_csv_index, path, path + '.idx')[0] is not None:
+		with pu.open_csv_index(path + '.idx') as idx:
+			attempt(idx.rows)
+
+
+def fuzz(seconds, seed):
+	rng = random.Random(seed)
+	n = 0
+	stop = time.time() + seconds
+	with tempfile.TemporaryDirectory() as tmp:
+		while time.time() < stop:
+			src = random_text(rng)
+			try:
+				check_cursors(src)
+				check_documents(rng, src)
+				check_round_trips(rng)
+				if n % 16 == 0:
+					check_files(src, tmp)
+			except Failure as e:
+				report('fuzz-%d.txt' % n, src, e)
+				return False
+			n += 1
+	print('%d random inputs, seed %d' % (n, seed))
+	return True
+
+
+def cursor(func, **kwargs):
+	return lambda s: func(0, s, len(s), **kwargs)
+
+
+def collect(func):
+	return lambda s: func(s, on_error='collect')
+
+
+def from_file(func):
+	def parse(s):
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'in.txt')
+			with open(path, 'w', encoding='utf-8', newline='') as f:
+				f.write(s)
+			return func(path, on_error='collect', block_size=64)
+	return parse
+
+
+# parser, then inputs of about n characters
+ADVERSARIAL = [
+	('parse_list', cursor(pu.parse_list), [lambda n: '[' * n, lambda n: '[' + '1,' * (n // 2), lambda n: '[' + '"' * n]),
+	('parse_dict', cursor(pu.parse_dict), [lambda n: '{"a":' * (n // 5), lambda n: '{' + '"a":1,' * (n // 6), lambda n: '{"' + '\\' * n]),
+	('parse_dict offsets', cursor(pu.parse_dict, offsets=True), [lambda n: '{"a":' + '[' * n, lambda n: '{"a":"' + '\\"' * (n // 2)]),
+	('extract', lambda s: pu.extract(s, ['a.b']), [lambda n: '{"a":' * (n // 5), lambda n: '[' * n, lambda n: '{"b":[' + '{"c":1},' * (n // 8)]),
+	('parse_key_value', cursor(pu.parse_key_value), [lambda n: 'a' * n, lambda n: 'a="' + '\\' * n]),
+	('parse_section', cursor(pu.parse_section), [lambda n: '[' * n, lambda n: '[' + 'a' * n]),
+	('parse_tag', cursor(pu.parse_tag), [lambda n: '<a ' + 'b=c ' * (n // 4), lambda n: '<a' + ' ' * n, lambda n: '<a b="' + 'x' * n]),
+	('parse_tags', collect(pu.parse_tags), [lambda n: '<' * n, lambda n: '<a ' * (n // 3), lambda n: '<a b="' * (n // 6), lambda n: '<a b=c\n' * (n // 7)]),
+	('parse_ini', collect(pu.parse_ini), [lambda n: 'x\n' * (n // 2), lambda n: '[' * n, lambda n: '[s\n' * (n // 3), lambda n: 'k = "' * (n // 5)]),
+	('parse_csv_line', cursor(pu.parse_csv_line), [lambda n: '"' * n, lambda n: ',' * n, lambda n: '"a""' * (n // 4)]),
+	('parse_csv_records', collect(pu.parse_csv_records), [lambda n: 'a,b\n' + '"\n' * (n // 2), lambda n: 'a\n' + '"' * n, lambda n: 'a\n' + 'x\n' * (n // 2)]),
+	('parse_csv_records dtypes', lambda s: pu.parse_csv_records(s, dtypes={'a': int}, on_error='collect'), [lambda n: 'a\n' + 'x\n' * (n // 2)]),
+	('parse_csv_rows', pu.parse_csv_rows, [lambda n: '"' * n, lambda n: '\n' * n, lambda n: '"\n' * (n // 2)]),
+	('csv_row_starts', pu.csv_row_starts, [lambda n: '"' * n, lambda n: '""\n' * (n // 3)]),
+	('parse_csv_file', from_file(pu.parse_csv_file), [lambda n: 'a\n"' + 'x' * n, lambda n: 'a\n' + 'x' * n + '\n1\n']),
+	('parse_ini_file', from_file(pu.parse_ini_file), [lambda n: 'k = ' + 'x' * n, lambda n: '[' * n]),
+	('parse_csv_arrow', pu.parse_csv_arrow, [lambda n: 'a\n' + '"' * n, lambda n: 'a,b\n' + '1\n' * (n // 2)]),
+	('parse_css_blocks', cursor(pu.parse_css_blocks), [lambda n: 'a{' * (n // 2), lambda n: '(' * n, lambda n: '/*' * (n // 2), lambda n: 'a{b:' * (n // 4), lambda n: '"' * n]),
+	('IniDocument', pu.IniDocument, [lambda n: 'x\n' * (n // 2), lambda n: '[s]\n' * (n // 4)]),
+	('CssDocument', pu.CssDocument, [lambda n: '}' * n, lambda n: 'a{}' * (n // 3)]),
+	('find_line_starts', pu.find_line_starts, [lambda n: '\n' * n, lambda n: '\r\n' * (n // 2)]),
+]
+
+
+def best(func, src, rounds=3):
+	times = []
+	for _ in range(rounds):
+		t = time.perf_counter()
+		attempt(func, src)
+		times.append(time.perf_counter() - t)
+	return min(times)
+
+
+def scanned(func, src):
+	if not pu.stats():
+		return None
+	pu.reset_stats()
+	attempt(func, src)
+	return pu.stats()['chars_scanned']
+
+
+def linear(n):
+	ok = True
+	for name, func, makers in ADVERSARIAL:
+		for k, make in enumerate(makers):
+			small, large = make(n), make(8 * n)
+			growth = best(func, large) / max(best(func, small), 1e-5)
+			chars = scanned(func, large)
+			bad = growth > GROWTH or (chars is not None and chars > SCANNED_PER_CHAR * len(large) + 64)
+			if bad:
+				report('fuzz-%s-%d.txt' % (name.replace(' ', '-'), k), large,
+					'x%.1f time for x8 input, %s characters scanned' % (growth, chars))
+				ok = False
+	print('%d parsers linear from %d to %d characters' % (len(ADVERSARIAL), n, 8 * n))
+	return ok
+
+
+def report(path, src, why):
+	with open(path, 'w', encoding='utf-8', newline='') as f:
+		f.write(src)
+	print('FAIL %s: %s' % (path, why))
+
+
+if __name__ == '__main__':
+	seconds = float(sys.argv[1]) if len(sys.argv) > 1 else 10
+	seed = int(sys.argv[2]) if len(sys.argv) > 2 else random.randrange(1 << 32)
+	ok = fuzz(seconds, seed)
+	ok = linear(20000) and ok
+	sys.exit(0 if ok else 1)
@@ -1,59 +1,865 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
-#include <ctype.h>
+#include <datetime.h>
+#include <pythread.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#define PARSEUTILS_MODULE
+#include "parseutils.h"
+
+#if PY_VERSION_HEX < 0x030D0000
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/*
+ * Module state
+ *
+ * Every Python object the module keeps lives in the state of its module
+ * object, so the module can be imported by several interpreters, each
+ * with its own GIL, and runs without the GIL on free-threaded builds.
+ * Module functions reach it through self, methods through their type.
+ * The character tables and the default dialects are plain data that
+ * every import fills with the same bytes.
+ */
+typedef struct {
+    PyObject *ParseError;
+    PyTypeObject *CsvDialectType;
+    PyTypeObject *IniDialectType;
+    PyTypeObject *CsvIndexType;
+    PyTypeObject *ArrowBatchType;
+    PyTypeObject *IniDocumentType;
+    PyTypeObject *CssDocumentType;
+    PyObject *array_type;  // array.array
+    PyDateTime_CAPI *datetime;  // of this interpreter; PyDateTimeAPI is never set
+    PyObject *pool;  // executor of submit(), started on first use
+    PyObject *tz_cache[2 * 24 * 60];  // timezone by minutes east of UTC
+#ifdef Py_GIL_DISABLED
+    PyMutex tz_lock;
+#endif
+} _ModState;
+
+static inline _ModState *
+_get_state(PyObject *module) {
+    return (_ModState *) PyModule_GetState(module);
+}
 
 static bool
-_parse_list(Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *lis, int beg_bracket, int end_bracket);
+_parse_list(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *lis, int beg_bracket, int end_bracket);
 static bool
-_parse_dict(Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *dict, int beg_brace, int end_brace);
+_parse_dict(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *dict, int beg_brace, int end_brace, bool offsets);
+
+/*
+ * Where the last error of a view was placed, so that the errors of an
+ * on_error='collect' pass count lines from there instead of from the
+ * start of the view each time.
+ */
+typedef struct {
+    Py_ssize_t offset;
+    Py_ssize_t line;
+    Py_ssize_t column;
+} _LineMark;
+
+/*
+ * Read-only view of a str. len is clamped to the string length so the
+ * scanners never read past the end whatever the caller passes. base and
+ * base_line place a block of a streamed file in the whole input, for
+ * error positions; both are 0 for a plain str. mark is NULL unless the
+ * caller reports several errors in order of offset (see _src_mark).
+ */
+typedef struct {
+    int kind;
+    const void *data;
+    Py_ssize_t len;
+    Py_ssize_t base;
+    Py_ssize_t base_line;
+    _LineMark *mark;
+} _Src;
 
-static inline bool
-_is_ident(int c) {
-    return (c == '_' || c == '-' || isalnum(c));
+static void
+_src_init(_Src *s, PyObject *src, Py_ssize_t len) {
+    s->kind = PyUnicode_KIND(src);
+    s->data = PyUnicode_DATA(src);
+    s->len = len < PyUnicode_GET_LENGTH(src) ? len : PyUnicode_GET_LENGTH(src);
+    s->base = 0;
+    s->base_line = 0;
+    s->mark = NULL;
 }
 
-static inline bool
-_is_ident_head(int c) {
-    return (c == '_' || c == '-' || isalpha(c));
+/*
+ * Let the errors of s count lines on from the previous one. Callers that
+ * resume after errors set this so a document with an error on every line
+ * is placed in one pass rather than one pass per error.
+ */
+static void
+_src_mark(_Src *s, _LineMark *mark) {
+    mark->offset = 0;
+    mark->line = 1;
+    mark->column = 1;
+    s->mark = mark;
 }
 
-static inline bool
-_is_css_ident(int c) {
-    return (c == ' ' || c == ':' || c == '>' || c == '*' || c == '.' || c == '#' || c == '_' || c == '-' || isalnum(c));
+/*
+ * Offset of the first '\n' in src[i:len], -1 if there is none. 1-byte
+ * strings are searched with memchr; PyUnicode_FindChar has its own fast
+ * search for the wider kinds.
+ */
+static Py_ssize_t
+_find_newline(PyObject *src, Py_ssize_t i, Py_ssize_t len) {
+    if (i >= len) {
+        return -1;
+    }
+    if (PyUnicode_KIND(src) == PyUnicode_1BYTE_KIND) {
+        const char *data = PyUnicode_DATA(src);
+        const char *p = memchr(data + i, '\n', len - i);
+        return p ? p - data : -1;
+    }
+    return PyUnicode_FindChar(src, '\n', i, len, 1);
 }
 
-static inline bool
-_is_css_ident_head(int c) {
-    return (c == ':' || c == '>' || c == '*' || c == '.' || c == '#' || c == '_' || c == '-' || isalpha(c));
+/*
+ * Errors
+ *
+ * Malformed input raises ParseError, a ValueError carrying the offset,
+ * the 1-based line and column and the expected token. The line and
+ * column are counted from the start of src only when an error is raised,
+ * so the scanners track nothing on the hot path. The scalar scanners
+ * (_parse_value, _parse_ident, _parse_key_value) may run without the
+ * GIL; they only return false with *index at the failure and their
+ * callers raise.
+ */
+
+/*
+ * Build a ParseError for offset. detail replaces the default
+ * "expected ..." text when not NULL.
+ */
+static PyObject *
+_new_parse_error(_ModState *st, const _Src *s, Py_ssize_t offset, const char *expected, PyObject *detail) {
+    if (offset > s->len) {
+        offset = s->len;
+    }
+    Py_ssize_t from = 0;
+    Py_ssize_t line = 1;
+    Py_ssize_t column = 1;
+    if (s->mark && s->mark->offset <= offset) {
+        from = s->mark->offset;
+        line = s->mark->line;
+        column = s->mark->column;
+    }
+    for (Py_ssize_t i = from; i < offset; i++) {
+        if (PyUnicode_READ(s->kind, s->data, i) == '\n') {
+            line++;
+            column = 1;
+        } else {
+            column++;
+        }
+    }
+    if (s->mark) {
+        s->mark->offset = offset;
+        s->mark->line = line;
+        s->mark->column = column;
+    }
+    line += s->base_line;
+    offset += s->base;
+
+    PyObject *msg = detail
+        ? PyUnicode_FromFormat("%S at line %zd, column %zd (offset %zd)", detail, line, column, offset)
+        : PyUnicode_FromFormat("expected %s at line %zd, column %zd (offset %zd)", expected, line, column, offset);
+    if (!msg) {
+        return NULL;
+    }
+    PyObject *exc = PyObject_CallOneArg(st->ParseError, msg);
+    Py_DECREF(msg);
+    if (!exc) {
+        return NULL;
+    }
+    PyObject *oexpected = PyUnicode_FromString(expected);
+    PyObject *ooffset = PyLong_FromSsize_t(offset);
+    PyObject *oline = PyLong_FromSsize_t(line);
+    PyObject *ocolumn = PyLong_FromSsize_t(column);
+    bool ok = oexpected && ooffset && oline && ocolumn &&
+        PyObject_SetAttrString(exc, "offset", ooffset) == 0 &&
+        PyObject_SetAttrString(exc, "line", oline) == 0 &&
+        PyObject_SetAttrString(exc, "column", ocolumn) == 0 &&
+        PyObject_SetAttrString(exc, "expected", oexpected) == 0;
+    Py_XDECREF(oexpected);
+    Py_XDECREF(ooffset);
+    Py_XDECREF(oline);
+    Py_XDECREF(ocolumn);
+    if (!ok) {
+        Py_CLEAR(exc);
+    }
+    return exc;
 }
 
-static inline bool
-_is_css_key(int c) {
-    return (c == '_' || c == '-' || isalnum(c));
+static void
+_set_parse_error(_ModState *st, const _Src *s, Py_ssize_t offset, const char *expected) {
+    if (PyErr_Occurred()) {
+        return;  // keep MemoryError and friends
+    }
+    PyObject *exc = _new_parse_error(st, s, offset, expected, NULL);
+    if (exc) {
+        PyErr_SetObject(st->ParseError, exc);
+        Py_DECREF(exc);
+    }
+}
+
+static void
+_parse_error(_ModState *st, PyObject *src, Py_ssize_t len, Py_ssize_t offset, const char *expected) {
+    _Src s;
+    _src_init(&s, src, len);
+    _set_parse_error(st, &s, offset, expected);
+}
+
+/*
+ * What a scalar scanner that stopped at i was missing: input ran out
+ * inside a quote, or the token did not fit the fixed buffer.
+ */
+static const char *
+_scalar_expected(Py_ssize_t i, Py_ssize_t len) {
+    return i >= len ? "closing quote" : "a token shorter than 1024 characters";
+}
+
+/*
+ * Check the (index, src, len) arguments of the cursor APIs: len is
+ * clamped to the string so no scanner reads past the end.
+ */
+static bool
+_check_cursor(PyObject *src, Py_ssize_t i, Py_ssize_t *len) {
+    if (i < 0) {
+        PyErr_SetString(PyExc_ValueError, "index must be >= 0");
+        return false;
+    }
+    if (*len > PyUnicode_GET_LENGTH(src)) {
+        *len = PyUnicode_GET_LENGTH(src);
+    }
+    return true;
+}
+
+/*
+ * on_error='raise' | 'skip' | 'collect' of the whole-document parsers.
+ * A record that fails with a ValueError is dropped (skip) or its error
+ * is appended to a list returned next to the results (collect), and
+ * parsing resumes at the next record boundary.
+ */
+enum {
+    _ON_ERROR_RAISE,
+    _ON_ERROR_SKIP,
+    _ON_ERROR_COLLECT,
+};
+
+static bool
+_on_error_mode(PyObject *o, int *mode) {
+    static const char *names[] = {"raise", "skip", "collect"};
+    for (int k = 0; k < 3; k++) {
+        if (PyUnicode_Check(o) && PyUnicode_CompareWithASCIIString(o, names[k]) == 0) {
+            *mode = k;
+            return true;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "on_error must be 'raise', 'skip' or 'collect', not %R", o);
+    return false;
+}
+
+/*
+ * Handle the exception of a failed record starting at offset. Returns
+ * true when parsing may go on. A plain ValueError (a bad cell) is
+ * collected as a ParseError located at the record.
+ */
+static bool
+_on_error(_ModState *st, int mode, PyObject *errors, const _Src *s, Py_ssize_t offset) {
+    if (mode == _ON_ERROR_RAISE || !PyErr_ExceptionMatches(PyExc_ValueError)) {
+        return false;
+    }
+    if (mode == _ON_ERROR_SKIP) {
+        PyErr_Clear();
+        return true;
+    }
+
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    Py_XDECREF(type);
+    Py_XDECREF(tb);
+    if (!PyObject_TypeCheck(value, (PyTypeObject *) st->ParseError)) {
+        PyObject *detail = PyObject_Str(value);
+        Py_DECREF(value);
+        value = detail ? _new_parse_error(st, s, offset, "a valid record", detail) : NULL;
+        Py_XDECREF(detail);
+        if (!value) {
+            return false;
+        }
+    }
+    int rc = PyList_Append(errors, value);
+    Py_DECREF(value);
+    return rc == 0;
+}
+
+/*
+ * Return results, or (results, errors) with on_error='collect'. Steals
+ * both references.
+ */
+static PyObject *
+_on_error_result(int mode, PyObject *results, PyObject *errors) {
+    if (!results) {
+        Py_XDECREF(errors);
+        return NULL;
+    }
+    if (mode != _ON_ERROR_COLLECT) {
+        Py_XDECREF(errors);
+        return results;
+    }
+    return Py_BuildValue("(NN)", results, errors);
+}
+
+/*
+ * Growable UCS4 buffer for tokens whose length is not bounded by the
+ * input syntax (CSS selectors, values).
+ */
+typedef struct {
+    Py_UCS4 *data;
+    size_t len;
+    size_t size;
+} _Buf;
+
+static void
+_buf_init(_Buf *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+static void
+_buf_free(_Buf *buf) {
+    PyMem_Free(buf->data);
+    _buf_init(buf);
+}
+
+static bool
+_buf_reserve(_Buf *buf, size_t n) {
+    if (buf->len + n > buf->size) {
+        size_t size = buf->size ? buf->size * 2 : 256;
+        while (size < buf->len + n) {
+            size *= 2;
+        }
+        Py_UCS4 *data = PyMem_Realloc(buf->data, size * sizeof(Py_UCS4));
+        if (!data) {
+            PyErr_NoMemory();
+            return false;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+    return true;
+}
+
+static bool
+_buf_push(_Buf *buf, Py_UCS4 c) {
+    if (buf->len >= buf->size && !_buf_reserve(buf, 1)) {
+        return false;
+    }
+    buf->data[buf->len++] = c;
+    return true;
+}
+
+static bool
+_buf_write_ascii(_Buf *buf, const char *s, size_t n) {
+    if (!_buf_reserve(buf, n)) {
+        return false;
+    }
+    for (size_t k = 0; k < n; k++) {
+        buf->data[buf->len++] = (unsigned char) s[k];
+    }
+    return true;
+}
+
+static bool
+_buf_write_src(_Buf *buf, const _Src *s, Py_ssize_t beg, Py_ssize_t end) {
+    if (end <= beg) {
+        return true;
+    }
+    if (!_buf_reserve(buf, end - beg)) {
+        return false;
+    }
+    Py_UCS4 *out = buf->data + buf->len;
+    switch (s->kind) {
+    case PyUnicode_1BYTE_KIND:
+        for (Py_ssize_t i = beg; i < end; i++) {
+            *out++ = ((const Py_UCS1 *) s->data)[i];
+        }
+        break;
+    case PyUnicode_2BYTE_KIND:
+        for (Py_ssize_t i = beg; i < end; i++) {
+            *out++ = ((const Py_UCS2 *) s->data)[i];
+        }
+        break;
+    default:
+        memcpy(out, (const Py_UCS4 *) s->data + beg, (end - beg) * sizeof(Py_UCS4));
+        break;
+    }
+    buf->len += end - beg;
+    return true;
+}
+
+enum {
+    _SPAN_QUOTED = 1 << 0,
+    _SPAN_ESCAPED = 1 << 1,  // contains escapes, must be unescaped
+};
+
+typedef struct {
+    Py_ssize_t beg;
+    Py_ssize_t end;
+    int flags;
+} _Span;
+
+/*
+ * Growable span list in raw memory, so a scan may fill it without the
+ * GIL; nogil scans leave the MemoryError to the caller.
+ */
+typedef struct {
+    _Span *data;
+    size_t len;
+    size_t size;
+    bool nogil;
+} _Spans;
+
+/*
+ * Character classes
+ *
+ * Every scanner classifies characters through _CTYPE(). Code points below
+ * U+0100 are looked up in a table built at import time; wider code points
+ * fall back to the Unicode database, so a non-ASCII letter is an ident
+ * character and a non-ASCII space is a space, but only ASCII digits are
+ * digits and no wide character is ever a terminator.
+ */
+
+enum {
+    _C_SPACE = 1 << 0,
+    _C_DIGIT = 1 << 1,
+    _C_IDENT_HEAD = 1 << 2,  // letter, '_' or '-'
+    _C_IDENT = 1 << 3,  // ident head or digit
+    _C_QUOTE = 1 << 4,  // '"' or '\''
+    _C_END_LIST = 1 << 5,  // ',' and ']' end a list item
+    _C_END_DICT = 1 << 6,  // ',' and '}' end a dict item
+    _C_END_TAG = 1 << 7,  // '>' ends a tag attribute
+};
+
+static unsigned char _ctype[256];
+
+static unsigned char
+_ctype_of(Py_UCS4 c) {
+    unsigned char cls = 0;
+
+    if (Py_UNICODE_ISSPACE(c)) {
+        cls |= _C_SPACE;
+    }
+    if (Py_UNICODE_ISALPHA(c)) {
+        cls |= _C_IDENT_HEAD | _C_IDENT;
+    } else if (Py_UNICODE_ISALNUM(c)) {
+        cls |= _C_IDENT;
+    }
+    if (c >= '0' && c <= '9') {
+        cls |= _C_DIGIT;
+    }
+    return cls;
+}
+
+static void
+_ctype_init(void) {
+    for (Py_UCS4 c = 0; c < 256; c++) {
+        _ctype[c] = _ctype_of(c);
+    }
+    _ctype['_'] |= _C_IDENT_HEAD | _C_IDENT;
+    _ctype['-'] |= _C_IDENT_HEAD | _C_IDENT;
+    _ctype['"'] |= _C_QUOTE;
+    _ctype['\''] |= _C_QUOTE;
+    _ctype[','] |= _C_END_LIST | _C_END_DICT;
+    _ctype[']'] |= _C_END_LIST;
+    _ctype['}'] |= _C_END_DICT;
+    _ctype['>'] |= _C_END_TAG;
+}
+
+#define _CTYPE(c) ((c) < 256 ? _ctype[(c)] : _ctype_of(c))
+#define _IS_SPACE(c) (_CTYPE(c) & _C_SPACE)
+
+/*
+ * Statistics
+ *
+ * Hot-path counters for spotting pathological inputs. They are compiled
+ * in only with PU_STATS defined (PU_STATS=1 python setup.py build);
+ * otherwise _STAT_ADD() expands to nothing and stats() returns an empty
+ * dict. The counters are process-wide rather than module state, as
+ * the scanners bumping them run without the GIL or a module, so every
+ * update is a relaxed atomic add.
+ */
+
+#define _STAT_FIELDS(X) \
+    X(chars_scanned) \
+    X(values) \
+    X(quoted_values) \
+    X(escaped_values) \
+    X(buffer_overflows) \
+    X(ints) \
+    X(floats) \
+    X(strings) \
+    X(numeric_fallbacks) \
+    X(csv_rows) \
+    X(csv_rows_rejected) \
+    X(csv_fields) \
+    X(csv_quoted_fields) \
+    X(csv_escaped_fields) \
+    X(tags) \
+    X(tag_attrs)
+
+#ifdef PU_STATS
+#include <stdatomic.h>
+#define _STAT_DECL(name) atomic_ullong name;
+static struct {
+    _STAT_FIELDS(_STAT_DECL)
+} _stats;
+#define _STAT_ADD(name, n) \
+    atomic_fetch_add_explicit(&_stats.name, (unsigned long long) (n), memory_order_relaxed)
+#else
+#define _STAT_ADD(name, n) ((void) 0)
+#endif
+#define _STAT_INC(name) _STAT_ADD(name, 1)
+
+/*
+ * Dialects
+ *
+ * A dialect is validated and compiled once into a 256-entry character
+ * class table, so the per-row scanners only do a table lookup per
+ * character. Dialect characters must be below U+0100; anything above
+ * is an ordinary character for every dialect.
+ */
+
+enum {
+    _CSV_SEP = 1 << 0,
+    _CSV_QUOTE = 1 << 1,
+    _CSV_ESCAPE = 1 << 2,
+    _CSV_NEWLINE = 1 << 3,
+    _CSV_SPACE = 1 << 4,
+};
+
+typedef struct {
+    PyObject_HEAD
+    Py_UCS4 sep;
+    Py_UCS4 quote;  // 0 if quoting is disabled
+    Py_UCS4 escape;  // 0 if escaping is disabled
+    bool doublequote;  // "" inside quotes is one quote (RFC 4180)
+    Py_UCS4 line_terminator;
+    bool crlf;  // '\r' and "\r\n" also terminate a row
+    bool skip_initial_space;
+    bool typed;
+    unsigned char cls[256];
+} CsvDialect;
+
+typedef struct {
+    PyObject_HEAD
+    Py_UCS4 sep;
+    Py_UCS4 section_begin;
+    Py_UCS4 section_end;
+} IniDialect;
+
+#define _CSV_CLS(d, c) ((c) < 256 ? (d)->cls[(c)] : 0)
+
+static void
+_csv_dialect_compile(CsvDialect *d) {
+    memset(d->cls, 0, sizeof(d->cls));
+
+    d->cls[d->line_terminator] |= _CSV_NEWLINE;
+    if (d->crlf) {
+        d->cls['\r'] |= _CSV_NEWLINE;
+    }
+    d->cls[d->sep] |= _CSV_SEP;
+    if (d->quote) {
+        d->cls[d->quote] |= _CSV_QUOTE;
+    }
+    if (d->escape) {
+        d->cls[d->escape] |= _CSV_ESCAPE;
+    }
+    for (int c = 0; c < 256; c++) {
+        if ((_ctype[c] & _C_SPACE) && !d->cls[c]) {
+            d->cls[c] |= _CSV_SPACE;
+        }
+    }
+}
+
+static void
+_csv_dialect_init(CsvDialect *d, Py_UCS4 sep) {
+    d->sep = sep;
+    d->quote = '"';
+    d->escape = 0;
+    d->doublequote = true;
+    d->line_terminator = '\n';
+    d->crlf = true;
+    d->skip_initial_space = true;
+    d->typed = true;
+    _csv_dialect_compile(d);
+}
+
+/*
+ * Convert a dialect option to a character. None stores 0 when allowed.
+ */
+static bool
+_dialect_char(PyObject *o, const char *name, bool allow_none, Py_UCS4 *out) {
+    if (o == Py_None && allow_none) {
+        *out = 0;
+        return true;
+    }
+    if (!PyUnicode_Check(o) || PyUnicode_GET_LENGTH(o) != 1) {
+        PyErr_Format(PyExc_TypeError, "%s must be a 1-character string", name);
+        return false;
+    }
+    Py_UCS4 c = PyUnicode_READ_CHAR(o, 0);
+    if (c == 0 || c >= 256) {
+        PyErr_Format(PyExc_ValueError, "%s must be a character in U+0001..U+00FF", name);
+        return false;
+    }
+    *out = c;
+    return true;
+}
+
+static PyObject *
+_dialect_char_obj(Py_UCS4 c) {
+    if (!c) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromOrdinal(c);
+}
+
+static PyObject *
+CsvDialect_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    PyObject *osep = NULL;
+    PyObject *oquote = NULL;
+    PyObject *oescape = NULL;
+    PyObject *oterm = NULL;
+    int skip_initial_space = 1;
+    int typed = 1;
+    int doublequote = 1;
+    static char *kwlist[] = {"sep", "quote", "escape", "line_terminator", "skip_initial_space", "typed", "doublequote", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOOppp", kwlist,
+        &osep, &oquote, &oescape, &oterm, &skip_initial_space, &typed, &doublequote)) {
+        return NULL;
+    }
+
+    CsvDialect *d = (CsvDialect *) type->tp_alloc(type, 0);
+    if (!d) {
+        return NULL;
+    }
+    _csv_dialect_init(d, ',');
+    d->skip_initial_space = skip_initial_space;
+    d->typed = typed;
+    d->doublequote = doublequote;
+
+    if ((osep && !_dialect_char(osep, "sep", false, &d->sep)) ||
+        (oquote && !_dialect_char(oquote, "quote", true, &d->quote)) ||
+        (oescape && !_dialect_char(oescape, "escape", true, &d->escape))) {
+        Py_DECREF(d);
+        return NULL;
+    }
+    if (d->escape && d->escape == d->quote) {
+        // escape='"' is the RFC 4180 doubled quote
+        d->escape = 0;
+        d->doublequote = true;
+    }
+
+    if (oterm) {
+        if (PyUnicode_Check(oterm) && PyUnicode_CompareWithASCIIString(oterm, "\r\n") == 0) {
+            d->line_terminator = '\n';
+            d->crlf = true;
+        } else if (!_dialect_char(oterm, "line_terminator", false, &d->line_terminator)) {
+            Py_DECREF(d);
+            return NULL;
+        } else {
+            d->crlf = d->line_terminator == '\n';
+        }
+    }
+
+    if (d->sep == d->quote || d->sep == d->escape || d->sep == d->line_terminator ||
+        (d->crlf && d->sep == '\r') || (d->quote && d->quote == d->line_terminator)) {
+        Py_DECREF(d);
+        PyErr_SetString(PyExc_ValueError, "dialect characters must be distinct");
+        return NULL;
+    }
+
+    _csv_dialect_compile(d);
+    return (PyObject *) d;
+}
+
+static PyObject *
+CsvDialect_get_sep(CsvDialect *self, void *closure) {
+    return _dialect_char_obj(self->sep);
+}
+
+static PyObject *
+CsvDialect_get_quote(CsvDialect *self, void *closure) {
+    return _dialect_char_obj(self->quote);
+}
+
+static PyObject *
+CsvDialect_get_escape(CsvDialect *self, void *closure) {
+    return _dialect_char_obj(self->escape);
+}
+
+static PyObject *
+CsvDialect_get_doublequote(CsvDialect *self, void *closure) {
+    return PyBool_FromLong(self->doublequote);
+}
+
+static PyObject *
+CsvDialect_get_line_terminator(CsvDialect *self, void *closure) {
+    return _dialect_char_obj(self->line_terminator);
+}
+
+static PyObject *
+CsvDialect_get_skip_initial_space(CsvDialect *self, void *closure) {
+    return PyBool_FromLong(self->skip_initial_space);
+}
+
+static PyObject *
+CsvDialect_get_typed(CsvDialect *self, void *closure) {
+    return PyBool_FromLong(self->typed);
+}
+
+static PyGetSetDef CsvDialect_getset[] = {
+    {"sep", (getter) CsvDialect_get_sep, NULL, "Field separator.", NULL},
+    {"quote", (getter) CsvDialect_get_quote, NULL, "Quote character or None.", NULL},
+    {"escape", (getter) CsvDialect_get_escape, NULL, "Escape character inside quotes or None.", NULL},
+    {"doublequote", (getter) CsvDialect_get_doublequote, NULL, "A doubled quote inside quotes is one quote.", NULL},
+    {"line_terminator", (getter) CsvDialect_get_line_terminator, NULL, "Row terminator.", NULL},
+    {"skip_initial_space", (getter) CsvDialect_get_skip_initial_space, NULL, "Strip spaces around unquoted fields.", NULL},
+    {"typed", (getter) CsvDialect_get_typed, NULL, "Convert unquoted numbers to int and float.", NULL},
+    {NULL}
+};
+
+static PyType_Slot CsvDialect_slots[] = {
+    {Py_tp_doc, "CsvDialect(sep=',', quote='\"', escape=None, line_terminator='\\n', skip_initial_space=True, typed=True, doublequote=True)\n\nCompiled CSV dialect."},
+    {Py_tp_new, CsvDialect_new},
+    {Py_tp_getset, CsvDialect_getset},
+    {0, NULL}
+};
+
+static PyType_Spec CsvDialect_spec = {
+    .name = "parseutils.CsvDialect",
+    .basicsize = sizeof(CsvDialect),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = CsvDialect_slots,
+};
+
+static PyObject *
+IniDialect_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    PyObject *osep = NULL;
+    PyObject *obegin = NULL;
+    PyObject *oend = NULL;
+    static char *kwlist[] = {"sep", "section_begin", "section_end", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOO", kwlist, &osep, &obegin, &oend)) {
+        return NULL;
+    }
+
+    IniDialect *d = (IniDialect *) type->tp_alloc(type, 0);
+    if (!d) {
+        return NULL;
+    }
+    d->sep = '=';
+    d->section_begin = '[';
+    d->section_end = ']';
+
+    if ((osep && !_dialect_char(osep, "sep", false, &d->sep)) ||
+        (obegin && !_dialect_char(obegin, "section_begin", false, &d->section_begin)) ||
+        (oend && !_dialect_char(oend, "section_end", false, &d->section_end))) {
+        Py_DECREF(d);
+        return NULL;
+    }
+
+    return (PyObject *) d;
+}
+
+static PyObject *
+IniDialect_get_sep(IniDialect *self, void *closure) {
+    return _dialect_char_obj(self->sep);
+}
+
+static PyObject *
+IniDialect_get_section_begin(IniDialect *self, void *closure) {
+    return _dialect_char_obj(self->section_begin);
+}
+
+static PyObject *
+IniDialect_get_section_end(IniDialect *self, void *closure) {
+    return _dialect_char_obj(self->section_end);
+}
+
+static PyGetSetDef IniDialect_getset[] = {
+    {"sep", (getter) IniDialect_get_sep, NULL, "Key/value separator.", NULL},
+    {"section_begin", (getter) IniDialect_get_section_begin, NULL, "Opening section bracket.", NULL},
+    {"section_end", (getter) IniDialect_get_section_end, NULL, "Closing section bracket.", NULL},
+    {NULL}
+};
+
+static PyType_Slot IniDialect_slots[] = {
+    {Py_tp_doc, "IniDialect(sep='=', section_begin='[', section_end=']')\n\nCompiled INI dialect."},
+    {Py_tp_new, IniDialect_new},
+    {Py_tp_getset, IniDialect_getset},
+    {0, NULL}
+};
+
+static PyType_Spec IniDialect_spec = {
+    .name = "parseutils.IniDialect",
+    .basicsize = sizeof(IniDialect),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = IniDialect_slots,
+};
+
+static const IniDialect _ini_default = {
+    .sep = '=',
+    .section_begin = '[',
+    .section_end = ']',
+};
+
+static bool
+_get_ini_dialect(_ModState *st, PyObject *odialect, const IniDialect **d) {
+    if (!odialect || odialect == Py_None) {
+        *d = &_ini_default;
+        return true;
+    }
+    if (!PyObject_TypeCheck(odialect, st->IniDialectType)) {
+        PyErr_SetString(PyExc_TypeError, "dialect must be an IniDialect");
+        return false;
+    }
+    *d = (const IniDialect *) odialect;
+    return true;
 }
 
 static inline bool
-_is_css_key_head(int c) {
-    return (c == '_' || c == '-' || isalpha(c));
+_is_ident(Py_UCS4 c) {
+    return _CTYPE(c) & _C_IDENT;
 }
 
 static inline bool
-_is_css_block_name(int c) {
-    return (c == ':' || c == '>' || c == ' ' || c == '*' || c == '.' || c == '#' || c == '_' || c == '-' || isalnum(c));
+_is_ident_head(Py_UCS4 c) {
+    return _CTYPE(c) & _C_IDENT_HEAD;
 }
 
 static void
 _skip_sp(Py_ssize_t *index, PyObject *src, Py_ssize_t srclen)
 {
     Py_ssize_t i = *index;
+    const void *data = PyUnicode_DATA(src);
 
-    while (i < srclen) {
-        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
-        if (!Py_UNICODE_ISSPACE(c)) {
-            break;
+    if (PyUnicode_KIND(src) == PyUnicode_1BYTE_KIND) {
+        const Py_UCS1 *p = data;
+        while (i < srclen && (_ctype[p[i]] & _C_SPACE)) {
+            i++;
+        }
+    } else {
+        int kind = PyUnicode_KIND(src);
+        while (i < srclen && _IS_SPACE(PyUnicode_READ(kind, data, i))) {
+            i++;
         }
-        i++;
     }
 
     *index = i;
@@ -77,141 +883,86 @@ _parse_ident(
             break;
         }
         if (_is_ident(c)) {
-            if (*buf_len >= buf_size-1) {
-                return false;
+            if (buf) {
+                if (*buf_len >= buf_size-1) {
+                    *index = i;
+                    return false;
+                }
+                buf[*buf_len] = c;
             }
-            buf[*buf_len] = c;
             (*buf_len)++;
         } else {
             break;
         }
     }
 
-    buf[*buf_len] = 0;
+    if (buf) {
+        buf[*buf_len] = 0;
+    }
     *index = i;
     return true;
 }
 
+enum {
+    _STR,
+    _INT,
+    _FLOAT,
+};
+
 static bool
-_parse_css_ident(
+_parse_value(
     Py_ssize_t *index,
     PyObject *src,
     Py_ssize_t len,
     Py_UCS4 buf[],
     size_t buf_size,
-    size_t *buf_len
+    size_t *buf_len,
+    unsigned end,  // terminator class, e.g. _C_END_LIST, or 0
+    int *type,
+    _Span *span  // receives the value position, quotes excluded
 ) {
+    #define _PUSH(c) do { \
+        if (buf) { \
+            if (*buf_len >= buf_size-1) { \
+                _STAT_INC(buffer_overflows); \
+                ret = false; \
+                goto done; \
+            } \
+            buf[*buf_len] = (c); \
+        } \
+        (*buf_len)++; \
+    } while (0)
+
+    bool ret = true;
     Py_ssize_t i = *index;
+    int m = 0;
     *buf_len = 0;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == '\n') {
-            break;
-        }
-        if (_is_css_ident(c)) {
-            if (*buf_len >= buf_size-1) {
-                return false;
-            }
-            buf[*buf_len] = c;
-            (*buf_len)++;
-        } else {
-            break;
-        }
-    }
-
-    for (; *buf_len > 0; ) {
-        size_t k = *buf_len - 1;
-        if (!isspace(buf[k])) {
-            break;
-        }
-        (*buf_len)--;
-    }
-
-    buf[*buf_len] = 0;
-    *index = i;
-    return true;
-}
-
-static bool
-_parse_css_key(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 buf[],
-    size_t buf_size,
-    size_t *buf_len
-) {
-    Py_ssize_t i = *index;
-    *buf_len = 0;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == ':') {
-            break;
-        }
-        if (_is_css_key(c)) {
-            if (*buf_len >= buf_size-1) {
-                return false;
-            }
-            buf[*buf_len] = c;
-            (*buf_len)++;
-        } else {
-            break;
-        }
-    }
-
-    buf[*buf_len] = 0;
-    *index = i;
-    return true;
-}
-
-enum {
-    _STR,
-    _INT,
-    _FLOAT,
-};
-
-static bool
-_parse_value(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 buf[],
-    size_t buf_size,
-    size_t *buf_len,
-    const char *end,  // "\n" or ">" or ",]"
-    int *type
-) {
-    bool ret = true;
-    Py_ssize_t i = *index;
-    int m = 0;
-    *buf_len = 0;
-    int quote = 0;
-    int ndot = 0;
+    int quote = 0;
+    int ndot = 0;
+    span->beg = span->end = i;
+    span->flags = 0;
 
     for (; i < len; i++) {
         int c = PyUnicode_READ_CHAR(src, i);
 
         switch (m) {
         case 0:
-            if (c == '"' || c == '\'') {
+            if (_CTYPE(c) & _C_QUOTE) {
                 m = 100;
                 quote = c;
                 *type = _STR;
-            } else if (strchr(end, c)) {
+                span->beg = i+1;
+                span->flags = _SPAN_QUOTED;
+            } else if (_CTYPE(c) & end) {
+                span->beg = i;
                 goto done;
-            } else if (Py_UNICODE_ISSPACE(c)) {
+            } else if (_IS_SPACE(c)) {
                 // pass
             } else {
-                if (*buf_len >= buf_size-1) {
-                    ret = false;
-                    goto done;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;
+                span->beg = i;
+                _PUSH(c);
                 m = 50;
-                if (isdigit(c)) {
+                if (_CTYPE(c) & _C_DIGIT) {
                     *type = _INT;
                 } else if (c == '.') {
                     *type = _FLOAT;
@@ -222,25 +973,23 @@ _parse_value(
             }
             break;
         case 50:
-            if (strchr(end, c)) {
+            if (_CTYPE(c) & end) {
                 goto done;
-            } else if (Py_UNICODE_ISSPACE(c)) {
+            } else if (_IS_SPACE(c)) {
                 goto done;
             } else {
-                if (*buf_len >= buf_size-1) {
-                    ret = false;
-                    goto done;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;
-                if (isdigit(c)) {
+                _PUSH(c);
+                if (_CTYPE(c) & _C_DIGIT) {
                     // pass
                 } else if (c == '.') {
-                    if (ndot > 0) {
+                    if (ndot > 0 || *type == _STR) {
                         *type = _STR;
                     } else {
                         *type = _FLOAT;
                     }
+                    ndot++;
+                } else {
+                    *type = _STR;
                 }
             }
             break;
@@ -252,32 +1001,39 @@ _parse_value(
                     goto done;
                 }
                 c = PyUnicode_READ_CHAR(src, i);
-
-                if (*buf_len >= buf_size-1) {
-                    ret = false;
-                    goto done;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;
+                span->flags |= _SPAN_ESCAPED;
+                _PUSH(c);
             } else if (c == quote) {
+                span->end = i;
                 i++;
-                goto done;
+                goto quoted;
             } else {
-                if (*buf_len >= buf_size-1) {
-                    ret = false;
-                    goto done;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;                
+                _PUSH(c);
             }
             break;
         }
     }
+    if (m == 100) {
+        ret = false;  // no closing quote
+    }
 
 done:
+    span->end = i;
+quoted:
+    _STAT_INC(values);
+    _STAT_ADD(chars_scanned, i - *index);
+    if (span->flags & _SPAN_QUOTED) {
+        _STAT_INC(quoted_values);
+    }
+    if (span->flags & _SPAN_ESCAPED) {
+        _STAT_INC(escaped_values);
+    }
     *index = i;
-    buf[*buf_len] = 0;
+    if (buf) {
+        buf[*buf_len] = 0;
+    }
     return ret;
+    #undef _PUSH
 }
 
 static PyObject *
@@ -287,83 +1043,96 @@ ucs4_to_obj(Py_UCS4 ary[], size_t len, int type) {
     char buf[_BUF_SIZE];
     size_t i;
 
-    for (i = 0; i < len && i < _BUF_SIZE; i++) {
+    if (type == _STR || len >= _BUF_SIZE) {
+        if (type != _STR) {
+            _STAT_INC(numeric_fallbacks);
+        }
+        _STAT_INC(strings);
+        return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, ary, len);
+    }
+
+    for (i = 0; i < len; i++) {
         buf[i] = (char)ary[i];
     }
     buf[i] = '\0';
 
     if (type == _FLOAT) {
         // float型として変換
-        char* endptr;
-        double value = strtod(buf, &endptr);
-        if (endptr == buf) {
-            PyErr_SetString(PyExc_ValueError, "could not convert string to float");
+        _STAT_INC(floats);
+        double value = PyOS_string_to_double(buf, NULL, NULL);
+        if (value == -1.0 && PyErr_Occurred()) {
             return NULL;
         }
         return PyFloat_FromDouble(value);
-    } else if (type == _INT) {
-        // long型として変換
-        char* endptr;
-        long value = strtol(buf, &endptr, 10);
-        if (endptr == buf) {
-            printf("buf[%s]\n", buf);
-            PyErr_SetString(PyExc_ValueError, "could not convert string to long");
-            return NULL;
-        }
-        return PyLong_FromLong(value);
     } else {
-        return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, ary, len);
+        // long型として変換
+        _STAT_INC(ints);
+        return PyLong_FromString(buf, NULL, 10);
     }
 }
 
-static PyObject *
-_parse_ovalue(Py_ssize_t *index, PyObject *src, Py_ssize_t len, const char *end) {
-    Py_ssize_t i = *index;
-    #undef _BUF_SIZE 
+/*
+ * A scalar of a list or dict. Kept out of _parse_ovalue() so that the
+ * frames of nested lists and dicts do not each carry its buffer.
+ */
+static Py_NO_INLINE PyObject *
+_parse_oscalar(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end) {
+    #undef _BUF_SIZE
     #define _BUF_SIZE 1024
-    Py_UCS4 val[_BUF_SIZE] = {0};
+    Py_UCS4 val[_BUF_SIZE];
     size_t val_len = 0;
+    int type;
+    _Span span;
+    if (!_parse_value(
+        index, src, len,
+        val, _BUF_SIZE, &val_len,
+        end, &type, &span)) {
+        _parse_error(st, src, len, *index, _scalar_expected(*index, len));
+        return NULL;
+    }
+    if (val_len) {
+        return ucs4_to_obj(val, val_len, type);
+    }
+    return PyUnicode_FromString("");
+}
+
+/*
+ * Nested lists and dicts recurse, so their depth is bounded by the
+ * recursion limit like json's: a run of '[' raises RecursionError
+ * instead of overflowing the C stack.
+ */
+static PyObject *
+_parse_ovalue(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end) {
+    Py_ssize_t i = *index;
     PyObject *o = NULL;
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == '[') {
-            PyObject *lis = PyList_New(0);
-            if (!lis)  {
-                return NULL;
-            }
-            if (!_parse_list(&i, src, len, lis, '[', ']')) {
-                return NULL;
-            }
-            o = lis;
-            break;
-        } else if (c == '{') {
-            PyObject *dict = PyDict_New();
-            if (!dict) {
-                return NULL;
-            }
-            if (!_parse_dict(&i, src, len, dict, '{', '}')) {
-                return NULL;
-            }
-            o = dict;
-            break;
-        } else if (Py_UNICODE_ISSPACE(c)) {
-            // pass
-        } else {
-            int type;
-            if (!_parse_value(
-                &i, src, len,
-                val, _BUF_SIZE, &val_len,
-                end, &type)) {
-                return NULL;
-            }
-            if (val_len) {
-                o = ucs4_to_obj(val, val_len, type);
-            } else {
-                o = PyUnicode_FromString("");
-            }
-            break;
+    _skip_sp(&i, src, len);
+    if (i >= len) {
+        _parse_error(st, src, len, i, "a value");
+        return NULL;
+    }
+
+    int c = PyUnicode_READ_CHAR(src, i);
+    if (c == '[') {
+        if (Py_EnterRecursiveCall(" while parsing a list")) {
+            return NULL;
+        }
+        o = PyList_New(0);
+        if (o && !_parse_list(st, &i, src, len, o, '[', ']')) {
+            Py_CLEAR(o);
+        }
+        Py_LeaveRecursiveCall();
+    } else if (c == '{') {
+        if (Py_EnterRecursiveCall(" while parsing a dict")) {
+            return NULL;
+        }
+        o = PyDict_New();
+        if (o && !_parse_dict(st, &i, src, len, o, '{', '}', false)) {
+            Py_CLEAR(o);
         }
+        Py_LeaveRecursiveCall();
+    } else {
+        o = _parse_oscalar(st, &i, src, len, end);
     }
 
     *index = i;
@@ -371,44 +1140,120 @@ _parse_ovalue(Py_ssize_t *index, PyObject *src, Py_ssize_t len, const char *end)
 }
 
 static bool
-_parse_css_value(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 buf[],
-    size_t buf_size,
-    size_t *buf_len
-) {
-    bool ret = true;
+_parse_string(Py_ssize_t *index, PyObject *src, Py_ssize_t len, Py_UCS4 buf[], size_t buf_size, size_t *buf_len, _Span *span);
+static bool
+_skip_value(Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, _Span *span, int depth);
+
+/*
+ * The items of a list or dict after its opening bracket, read as
+ * _parse_list() and _parse_dict() read them but building nothing. The
+ * escape flags of the keys and values are added to *flags. depth is as
+ * for _skip_value().
+ */
+static bool
+_skip_items(Py_ssize_t *index, PyObject *src, Py_ssize_t len, bool dict, int *flags, int depth) {
     Py_ssize_t i = *index;
-    int m = 0;
-    *buf_len = 0;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
+    Py_UCS4 close = dict ? '}' : ']';
+    unsigned end = dict ? _C_END_DICT : _C_END_LIST;
+    bool ret = false;
 
-        switch (m) {
-        case 0:
-            if (c == ';' || c == '}') {
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == close) {
+        i++;
+        ret = true;
+        goto done;
+    }
+    for (;;) {
+        _Span kspan, vspan;
+        if (dict) {
+            size_t key_len;
+            _skip_sp(&i, src, len);
+            if (!_parse_string(&i, src, len, NULL, 0, &key_len, &kspan)) {
                 goto done;
-            } else {
-                if (*buf_len >= buf_size-1) {
-                    ret = false;
-                    goto done;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;                
             }
+            *flags |= kspan.flags & _SPAN_ESCAPED;
+            _skip_sp(&i, src, len);
+            if (i >= len || PyUnicode_READ_CHAR(src, i) != ':') {
+                goto done;
+            }
+            i++;
+        }
+        if (!_skip_value(&i, src, len, end, &vspan, depth)) {
+            goto done;
+        }
+        *flags |= vspan.flags & _SPAN_ESCAPED;
+
+        _skip_sp(&i, src, len);
+        Py_UCS4 c = i < len ? PyUnicode_READ_CHAR(src, i) : 0;
+        if (c == close) {
+            i++;
+            break;
+        } else if (c != ',') {
+            goto done;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == close) {
+            i++;  // trailing comma
             break;
         }
     }
+    ret = true;
 
 done:
     *index = i;
-    buf[*buf_len] = 0;
     return ret;
 }
 
+/*
+ * Skip a value like _parse_ovalue() but only record where it is. Nested
+ * lists and dicts are spanned whole, brackets included, and accepted
+ * exactly where _parse_ovalue() accepts them. With depth < 0 their depth
+ * is bounded by the recursion limit the same way, which needs the GIL;
+ * otherwise at most depth of them may nest and the GIL is not needed.
+ */
+static bool
+_skip_value(Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, _Span *span, int depth) {
+    Py_ssize_t i = *index;
+    _skip_sp(&i, src, len);
+    if (i >= len) {
+        span->beg = span->end = i;
+        span->flags = 0;
+        *index = i;
+        return true;
+    }
+
+    int c = PyUnicode_READ_CHAR(src, i);
+    if (c != '[' && c != '{') {
+        int type;
+        size_t val_len = 0;
+        if (!_parse_value(&i, src, len, NULL, 0, &val_len, end, &type, span)) {
+            return false;
+        }
+        *index = i;
+        return true;
+    }
+
+    span->beg = i++;
+    span->flags = 0;
+    if (depth < 0 ? Py_EnterRecursiveCall(c == '[' ? " while parsing a list" : " while parsing a dict") : depth == 0) {
+        *index = i;
+        return false;
+    }
+    bool ok = _skip_items(&i, src, len, c == '{', &span->flags, depth < 0 ? depth : depth - 1);
+    if (depth < 0) {
+        Py_LeaveRecursiveCall();
+    }
+    span->end = i;
+    *index = i;
+    return ok;
+}
+
+static bool
+_skip_ovalue(Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, _Span *span) {
+    return _skip_value(index, src, len, end, span, -1);
+}
+
 static bool
 _parse_string(
     Py_ssize_t *index,
@@ -416,47 +1261,55 @@ _parse_string(
     Py_ssize_t len,
     Py_UCS4 buf[],
     size_t buf_size,
-    size_t *buf_len
+    size_t *buf_len,
+    _Span *span  // receives the position of the content
 ) {
     Py_ssize_t i = *index;
-    int m = 0;
     int quote = 0;
     *buf_len = 0;
 
+    _skip_sp(&i, src, len);
+    if (i < len) {
+        quote = PyUnicode_READ_CHAR(src, i);
+    }
+    if (quote != '"' && quote != '\'') {
+        *index = i;
+        return false;
+    }
+    span->beg = ++i;
+    span->flags = _SPAN_QUOTED;
+
     for (; i < len; i++) {
-        _skip_sp(&i, src, len);
         int c = PyUnicode_READ_CHAR(src, i);
-        // printf("m[%d] c[%c]\n", m, c);
-
-        switch (m) {
-        case 0:
-            if (c == '"' || c == '\'') {
-                quote = c;
-                m = 10;
-            } else if (Py_UNICODE_ISSPACE(c)) {
-                // pass
-            } else {
-                return false;
-            }
+        if (c == quote) {
             break;
-        case 10:
-            if (c == quote) {
-                i++;
-                goto done;
-            } else {
-                if (*buf_len >= buf_size-1) {
-                    return false;
-                }
-                buf[*buf_len] = c;
-                (*buf_len)++;                
+        }
+        if (c == '\\') {  // as in _parse_value(), so dump_dict() keys read back
+            if (++i >= len) {
+                break;
             }
-            break;
+            c = PyUnicode_READ_CHAR(src, i);
+            span->flags |= _SPAN_ESCAPED;
+        }
+        if (buf) {
+            if (*buf_len >= buf_size-1) {
+                *index = i;
+                return false;
+            }
+            buf[*buf_len] = c;
         }
+        (*buf_len)++;
     }
 
-done:
-    buf[*buf_len] = 0;
+    span->end = i;
     *index = i;
+    if (i >= len) {
+        return false;  // no closing quote
+    }
+    if (buf) {
+        buf[*buf_len] = 0;
+    }
+    *index = i + 1;
     return true;
 }
 
@@ -471,21 +1324,28 @@ _parse_key_value(
     Py_UCS4 val[],
     size_t val_size,
     size_t *val_len,
-    int sep,  // '=' or ':'
-    const char *end  // 0 or ';'
+    Py_UCS4 sep,  // '=' or ':'
+    unsigned end,  // terminator class or 0
+    _Span *kspan,
+    _Span *vspan
 ) {
     Py_ssize_t i = *index;
+    kspan->beg = kspan->end = vspan->beg = vspan->end = i;
+    kspan->flags = vspan->flags = 0;
 
     for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (strchr(end, c)) {
+        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
+        if (_CTYPE(c) & end) {
             break;
         }
 
         if (_is_ident_head(c)) {
+            kspan->beg = i;
             if (!_parse_ident(&i, src, len, key, key_size, key_len)) {
-                break;
+                *index = i;
+                return false;
             }
+            kspan->end = i;
             _skip_sp(&i, src, len);
             if (i >= len) {
                 break;
@@ -496,57 +1356,17 @@ _parse_key_value(
                 i++;
                 _skip_sp(&i, src, len);
                 int type;
-                if (!_parse_value(&i, src, len, 
-                    val, val_size, val_len, end, &type)) {
-                    break;
+                if (!_parse_value(&i, src, len,
+                    val, val_size, val_len, end, &type, vspan)) {
+                    *index = i;
+                    return false;
                 }
                 break;
             }
-        }
-    }
-
-    *index = i;
-    return true;
-}
-
-static bool
-_parse_css_key_value(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 key[],
-    size_t key_size,
-    size_t *key_len,
-    Py_UCS4 val[],
-    size_t val_size,
-    size_t *val_len
-) {
-    Py_ssize_t i = *index;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (_is_css_key_head(c)) {
-            if (!_parse_css_key(&i, src, len, key, key_size, key_len)) {
-                break;
-            }
-            _skip_sp(&i, src, len);
-            if (i >= len) {
-                break;
-            }
-
-            c = PyUnicode_READ_CHAR(src, i);
-            if (c == ':') {
-                i++;
-                _skip_sp(&i, src, len);
-                if (!_parse_css_value(&i, src, len, val, val_size, val_len)) {
-                    break;
-                }
-                for (; i < len; i++) {
-                    c = PyUnicode_READ_CHAR(src, i);
-                    if (c == ';' || c == '}') {
-                        break;
-                    }
-                }
+            if (end) {
+                // a tag attribute may have no value; leave what follows the
+                // key (the next attribute, '/' or '>') to the caller
+                vspan->beg = vspan->end = i;
                 break;
             }
         }
@@ -557,31 +1377,49 @@ _parse_css_key_value(
 }
 
 static PyObject *
-parse_key_value(PyObject* self, PyObject* args) {
+parse_key_value(PyObject* self, PyObject* args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
     Py_ssize_t i = 0;
     PyObject *src = NULL;
     Py_ssize_t len = 0;
+    PyObject *odialect = Py_None;
+    int offsets = 0;
+    static char *kwlist[] = {"index", "src", "len", "dialect", "offsets", NULL};
 
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nUn|O$p", kwlist,
+            &i, &src, &len, &odialect, &offsets) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    const IniDialect *d;
+    if (!_get_ini_dialect(st, odialect, &d)) {
         return NULL;
     }
 
     #undef _BUF_SIZE
     #define _BUF_SIZE 1024
-    Py_UCS4 key[_BUF_SIZE] = {0};
-    Py_UCS4 val[_BUF_SIZE] = {0};
+    Py_UCS4 key[_BUF_SIZE];
+    Py_UCS4 val[_BUF_SIZE];
     size_t key_len = 0;
     size_t val_len = 0;
+    _Span kspan, vspan;
 
     if (!_parse_key_value(
-        &i, src, len, 
-        key, _BUF_SIZE, &key_len,
-        val, _BUF_SIZE, &val_len,
-        '=', ""
+        &i, src, len,
+        offsets ? NULL : key, _BUF_SIZE, &key_len,
+        offsets ? NULL : val, _BUF_SIZE, &val_len,
+        d->sep, 0, &kspan, &vspan
     )) {
+        _parse_error(st, src, len, i, _scalar_expected(i, len));
         return NULL;
     }
 
+    if (offsets) {
+        return Py_BuildValue("n(nn)(nnO)", i, kspan.beg, kspan.end,
+            vspan.beg, vspan.end, (vspan.flags & _SPAN_ESCAPED) ? Py_True : Py_False);
+    }
+
     PyObject* result = PyTuple_New(3);
     if (result == NULL) {
         return NULL;
@@ -594,317 +1432,606 @@ parse_key_value(PyObject* self, PyObject* args) {
     return result;
 }
 
-static bool
-_parse_css_block_content(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    PyObject *dict
-) {
-    Py_ssize_t i = *index;
-    i++;  // '{'
+/*
+ * Batch key/value and dict parsing
+ *
+ * Every item is first scanned into spans, which touches no objects and
+ * so runs with the GIL released, split across threads when asked to.
+ * Keys and values are then built from the spans.
+ */
+
+typedef struct {
+    _Span key;
+    _Span val;
+    Py_ssize_t end;  // where the scan stopped
+    bool ok;
+} _KvSpans;
+
+typedef struct {
+    PyObject **items;
+    Py_ssize_t n;
+    Py_UCS4 sep;
+    _KvSpans *out;
+} _KvJob;
+
+typedef struct {
+    void (*scan)(void *);
+    void *job;
+    PyThread_type_lock done;  // released when the worker is finished
+} _ScanThread;
+
+/*
+ * The number of jobs for n items on up to threads threads, at least 1024
+ * items each.
+ */
+static int
+_scan_jobs(int threads, Py_ssize_t n) {
+    if (threads > n / 1024) {
+        threads = (int) (n / 1024);
+    }
+    return threads < 1 ? 1 : threads;
+}
 
-    for (; i < len; i++) {
-        _skip_sp(&i, src, len);
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == '}') {
-            i++;
-            break;
+static void
+_scan_worker(void *arg) {
+    _ScanThread *t = arg;
+    t->scan(t->job);
+    PyThread_release_lock(t->done);
+}
+
+/*
+ * Run scan on each of njobs jobs of job_size bytes with the GIL released,
+ * a worker thread for every job but the first, which the calling thread
+ * takes. A job whose thread does not start runs on the calling thread.
+ */
+static bool
+_scan_threads(void (*scan)(void *), void *jobs, size_t job_size, int njobs) {
+    _ScanThread *threads = PyMem_Calloc(njobs, sizeof(_ScanThread));
+    if (!threads) {
+        PyErr_NoMemory();
+        return false;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (int t = 1; t < njobs; t++) {
+        threads[t].scan = scan;
+        threads[t].job = (char *) jobs + t * job_size;
+        threads[t].done = PyThread_allocate_lock();
+        if (threads[t].done) {
+            PyThread_acquire_lock(threads[t].done, WAIT_LOCK);
+            if (PyThread_start_new_thread(_scan_worker, &threads[t]) == PYTHREAD_INVALID_THREAD_ID) {
+                PyThread_release_lock(threads[t].done);
+                PyThread_free_lock(threads[t].done);
+                threads[t].done = NULL;
+            }
+        }
+    }
+    scan(jobs);
+    for (int t = 1; t < njobs; t++) {
+        if (threads[t].done) {
+            PyThread_acquire_lock(threads[t].done, WAIT_LOCK);
+            PyThread_release_lock(threads[t].done);
+            PyThread_free_lock(threads[t].done);
+        } else {
+            scan(threads[t].job);
         }
+    }
+    Py_END_ALLOW_THREADS
+    PyMem_Free(threads);
+    return true;
+}
 
-        #undef _BUF_SIZE
-        #define _BUF_SIZE 1024
-        Py_UCS4 key[_BUF_SIZE] = {0};
-        Py_UCS4 val[_BUF_SIZE] = {0};
-        size_t key_len = 0;
-        size_t val_len = 0;
+static void
+_kv_scan(void *arg) {
+    _KvJob *job = arg;
+    for (Py_ssize_t k = 0; k < job->n; k++) {
+        PyObject *src = job->items[k];
+        Py_ssize_t i = 0;
+        size_t key_len, val_len;
+        job->out[k].ok = _parse_key_value(&i, src, PyUnicode_GET_LENGTH(src),
+            NULL, 0, &key_len, NULL, 0, &val_len,
+            job->sep, 0, &job->out[k].key, &job->out[k].val);
+        job->out[k].end = i;
+    }
+}
 
-        if (!_parse_css_key_value(
-            &i, src, len,
-            key, _BUF_SIZE, &key_len,
-            val, _BUF_SIZE, &val_len
-        )) {
-            return false;
+/*
+ * Build a string from a value span, dropping the backslash of escapes
+ * as _parse_value() does.
+ */
+static PyObject *
+_span_unescape(PyObject *src, const _Span *sp, _Buf *buf) {
+    if (!(sp->flags & _SPAN_ESCAPED)) {
+        return PyUnicode_Substring(src, sp->beg, sp->end);
+    }
+    buf->len = 0;
+    for (Py_ssize_t i = sp->beg; i < sp->end; i++) {
+        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
+        if (c == '\\' && i + 1 < sp->end) {
+            c = PyUnicode_READ_CHAR(src, ++i);
         }
-        _skip_sp(&i, src, len);
-        c = PyUnicode_READ_CHAR(src, i);
-        if (c == '}') {
-            i++;
-            break;
+        if (!_buf_push(buf, c)) {
+            return NULL;
         }
+    }
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buf->data, buf->len);
+}
 
-        PyObject *okey = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, key, key_len);
-        PyObject *oval = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, val, val_len);
-
-        if (PyDict_SetItem(dict, okey, oval) < 0) {
-            Py_DECREF(okey);
-            Py_DECREF(oval);
+/*
+ * Whether a value span equals str once unescaped, without building it.
+ */
+static bool
+_span_unescaped_equals(PyObject *src, const _Span *sp, PyObject *str) {
+    Py_ssize_t n = PyUnicode_GET_LENGTH(str);
+    Py_ssize_t k = 0;
+    for (Py_ssize_t i = sp->beg; i < sp->end; i++, k++) {
+        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
+        if (c == '\\' && i + 1 < sp->end) {
+            c = PyUnicode_READ_CHAR(src, ++i);
+        }
+        if (k >= n || c != PyUnicode_READ_CHAR(str, k)) {
             return false;
         }
     }
+    return k == n;
+}
 
-    *index = i;
-    return true;
+static PyObject *
+_fast_str_items(PyObject *items) {
+    // a tuple copy of a list: the workers read items without the GIL
+    PyObject *seq = PyTuple_CheckExact(items) ? Py_NewRef(items) : PySequence_Tuple(items);
+    if (!seq) {
+        return NULL;
+    }
+    for (Py_ssize_t k = 0; k < PySequence_Fast_GET_SIZE(seq); k++) {
+        if (!PyUnicode_Check(PySequence_Fast_GET_ITEM(seq, k))) {
+            PyErr_Format(PyExc_TypeError, "item %zd is not a str", k);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    return seq;
 }
 
-static bool
-_parse_css_media_query_ident(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 ident[],
-    size_t ident_size,
-    size_t *ident_len    
-) {
-    Py_ssize_t i = *index;
+static PyObject *
+parse_key_value_many(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *items;
+    PyObject *odialect = Py_None;
+    int threads = 1;
+    static char *kwlist[] = {"items", "dialect", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$i", kwlist, &items, &odialect, &threads)) {
+        return NULL;
+    }
+    const IniDialect *d;
+    if (!_get_ini_dialect(st, odialect, &d)) {
+        return NULL;
+    }
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == '{') {
+    PyObject *seq = _fast_str_items(items);
+    if (!seq) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    PyObject **objs = PySequence_Fast_ITEMS(seq);
+    _KvSpans *spans = PyMem_Malloc((n ? n : 1) * sizeof(_KvSpans));
+    if (!spans) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    threads = _scan_jobs(threads, n);
+    _KvJob *jobs = PyMem_Calloc(threads, sizeof(_KvJob));
+    if (!jobs) {
+        PyMem_Free(spans);
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t chunk = (n + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        Py_ssize_t beg = t * chunk;
+        Py_ssize_t end = beg + chunk < n ? beg + chunk : n;
+        jobs[t].items = objs + beg;
+        jobs[t].n = end > beg ? end - beg : 0;
+        jobs[t].sep = d->sep;
+        jobs[t].out = spans + beg;
+    }
+
+    bool scanned = _scan_threads(_kv_scan, jobs, sizeof(_KvJob), threads);
+    PyMem_Free(jobs);
+    if (!scanned) {
+        PyMem_Free(spans);
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    _Buf buf;
+    _buf_init(&buf);
+    PyObject *results = PyList_New(n);
+    for (Py_ssize_t k = 0; results && k < n; k++) {
+        if (!spans[k].ok) {
+            Py_ssize_t len = PyUnicode_GET_LENGTH(objs[k]);
+            _parse_error(st, objs[k], len, spans[k].end, _scalar_expected(spans[k].end, len));
+            Py_CLEAR(results);
             break;
         }
-
-        if (*ident_len >= ident_size-1) {
-            return false;
+        PyObject *key = PyUnicode_Substring(objs[k], spans[k].key.beg, spans[k].key.end);
+        PyObject *val = key ? _span_unescape(objs[k], &spans[k].val, &buf) : NULL;
+        PyObject *pair = val ? PyTuple_Pack(2, key, val) : NULL;
+        Py_XDECREF(key);
+        Py_XDECREF(val);
+        if (!pair) {
+            Py_CLEAR(results);
+            break;
         }
-        ident[*ident_len] = c;
-        (*ident_len)++;
+        PyList_SET_ITEM(results, k, pair);
     }
 
-    for (; *ident_len > 0; ) {
-        size_t k = *ident_len - 1;
-        if (!isspace(ident[k])) {
+    _buf_free(&buf);
+    PyMem_Free(spans);
+    Py_DECREF(seq);
+    return results;
+}
+
+/*
+ * CSS
+ *
+ * The stylesheet is read by a single forward cursor. Every item inside a
+ * block (or at the top level) is scanned once up to the first `;`, `{` or
+ * `}` that is not inside a string, a comment or parentheses. An item
+ * ending in `{` is a rule whose prelude is the scanned text and whose
+ * content is parsed recursively, so at-rules nest to any depth. Any other
+ * item is a declaration split at its first top-level `:`.
+ */
+
+static void
+_css_skip_sp(Py_ssize_t *index, const _Src *s) {
+    Py_ssize_t i = *index;
+
+    while (i < s->len) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+        if (_IS_SPACE(c)) {
+            i++;
+        } else if (c == '/' && i+1 < s->len && PyUnicode_READ(s->kind, s->data, i+1) == '*') {
+            for (i += 2; i < s->len; i++) {
+                if (PyUnicode_READ(s->kind, s->data, i) == '*' &&
+                    i+1 < s->len && PyUnicode_READ(s->kind, s->data, i+1) == '/') {
+                    i += 2;
+                    break;
+                }
+            }
+        } else {
             break;
         }
-        (*ident_len)--;
     }
 
     *index = i;
-    return true;
 }
 
-static bool
-_parse_css_media_query_block(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 ident[],
-    size_t ident_size,
-    size_t *ident_len,
-    PyObject *dict
-) {
+/*
+ * Scan one item into buf with comments removed and whitespace outside of
+ * strings collapsed to a single space. Returns the terminating character
+ * ('{', ';', '}') without consuming it, or 0 at the end of input.
+ * *colon is set to the buffer position of the first top-level ':' or -1.
+ */
+static int
+_parse_css_item(Py_ssize_t *index, const _Src *s, _Buf *buf, Py_ssize_t *colon) {
     Py_ssize_t i = *index;
-    int m = 0;
-    #undef _BUF_SIZE
-    #define _BUF_SIZE 1024
-    Py_UCS4 tmp[_BUF_SIZE] = {0};
-    size_t tmp_len = 0;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        switch (m) {
-        case 0:
-            if (c == '@') {
-                if (!_parse_css_media_query_ident(&i, src, len, ident, ident_size, ident_len)) {
-                    return false;
+    int term = 0;
+    int depth = 0;
+    bool space = false;
+    buf->len = 0;
+    *colon = -1;
+
+    while (i < s->len) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+
+        if (c == '/' && i+1 < s->len && PyUnicode_READ(s->kind, s->data, i+1) == '*') {
+            for (i += 2; i < s->len; i++) {
+                if (PyUnicode_READ(s->kind, s->data, i) == '*' &&
+                    i+1 < s->len && PyUnicode_READ(s->kind, s->data, i+1) == '/') {
+                    i += 2;
+                    break;
                 }
-                i--;
-                m = 10;
             }
+            continue;
+        }
+        if (_IS_SPACE(c)) {
+            space = buf->len > 0;
+            i++;
+            continue;
+        }
+        if (depth == 0 && (c == '{' || c == ';' || c == '}')) {
+            term = c;
             break;
-        case 10:
-            if (c == '{') {
-                m = 20;
+        }
+
+        if (space) {
+            if (!_buf_push(buf, ' ')) {
+                return -1;
             }
-            break;
-        case 20:
-            if (_is_css_ident_head(c)) {
-                if (!_parse_css_ident(&i, src, len, tmp, _BUF_SIZE, &tmp_len)) {
+            space = false;
+        }
+
+        if (c == '"' || c == '\'') {
+            Py_UCS4 quote = c;
+            if (!_buf_push(buf, c)) {
+                return -1;
+            }
+            for (i++; i < s->len; i++) {
+                c = PyUnicode_READ(s->kind, s->data, i);
+                if (!_buf_push(buf, c)) {
+                    return -1;
                 }
-                _skip_sp(&i, src, len);
-                c = PyUnicode_READ_CHAR(src, i);
-                if (c == '{') {
-                    PyObject *content = PyDict_New();
-                    if (!content) {
-                        return false;
-                    }
-                    if (!_parse_css_block_content(&i, src, len, content)) {
-                        Py_DECREF(content);
-                        return false;
-                    }
-                    PyObject *okey = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, tmp, tmp_len);
-                    if (!okey) {
-                        Py_DECREF(content);
-                        return false;
-                    }
-                    if (PyDict_SetItem(dict, okey, content) < 0) {
-                        Py_DECREF(content);
-                        return false;
+                if (c == '\\' && i+1 < s->len) {
+                    i++;
+                    if (!_buf_push(buf, PyUnicode_READ(s->kind, s->data, i))) {
+                        return -1;
                     }
-                } else {
-                    return false;
+                } else if (c == quote) {
+                    break;
                 }
-            } else if (c == '}') {
-                goto done;
             }
-            break;
+            if (i < s->len) {
+                i++;
+            }
+            continue;
         }
-    }
-
-done:
-    *index = i;
-    return true;
-}
-
-static bool
-_parse_css_block(
-    Py_ssize_t *index,
-    PyObject *src,
-    Py_ssize_t len,
-    Py_UCS4 ident[],
-    size_t ident_size,
-    size_t *ident_len,
-    PyObject *dict
-) {
-    Py_ssize_t i = *index;
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (_is_css_ident_head(c)) {
-            if (!_parse_css_ident(&i, src, len, ident, ident_size, ident_len)) {
-                return false;
+        if (c == '\\') {
+            if (!_buf_push(buf, c)) {
+                return -1;
             }
-            _skip_sp(&i, src, len);
-            c = PyUnicode_READ_CHAR(src, i);
-            if (c == '{') {
-                if (!_parse_css_block_content(&i, src, len, dict)) {
-                    return false;
+            i++;
+            if (i < s->len) {
+                if (!_buf_push(buf, PyUnicode_READ(s->kind, s->data, i))) {
+                    return -1;
                 }
-                break;
-            } else {
-                return false;
+                i++;
             }
+            continue;
+        }
+
+        if (c == '(' || c == '[') {
+            depth++;
+        } else if ((c == ')' || c == ']') && depth > 0) {
+            depth--;
+        } else if (c == ':' && depth == 0 && *colon < 0) {
+            *colon = (Py_ssize_t) buf->len;
         }
+        if (!_buf_push(buf, c)) {
+            return -1;
+        }
+        i++;
     }
 
     *index = i;
-    return true;
+    return term;
 }
 
 static PyObject *
-parse_css_block(PyObject* self, PyObject* args) {
-    Py_ssize_t i = 0;
-    PyObject *src = NULL;
-    Py_ssize_t len = 0;
-
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
-        return NULL;
+_css_str(const _Buf *buf, Py_ssize_t beg, Py_ssize_t end) {
+    while (beg < end && buf->data[beg] == ' ') {
+        beg++;
     }
-
-    PyObject *dict = PyDict_New();
-    if (!dict) {
-        return NULL;
+    while (end > beg && buf->data[end-1] == ' ') {
+        end--;
     }
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buf->data + beg, end - beg);
+}
 
-    #undef _BUF_SIZE
-    #define _BUF_SIZE 1024
-    Py_UCS4 ident[_BUF_SIZE] = {0};
-    size_t ident_len = 0;
+static bool
+_css_set_decl(PyObject *dict, const _Buf *buf, Py_ssize_t colon) {
+    Py_ssize_t sep = colon;
 
-    if (!_parse_css_block(
-        &i, src, len,
-        ident, _BUF_SIZE, &ident_len,
-        dict
-    )) {
-        Py_DECREF(dict);
-        return NULL;
+    if (sep < 0) {
+        // statement at-rule such as `@import url(a.css)`
+        if (buf->len == 0 || buf->data[0] != '@') {
+            return true;
+        }
+        for (sep = 0; sep < (Py_ssize_t) buf->len && buf->data[sep] != ' '; sep++) {
+        }
     }
 
-    PyObject* result = PyTuple_New(3);
-    if (!result) {
-        Py_DECREF(dict);
-        return NULL;
+    PyObject *okey = _css_str(buf, 0, sep);
+    if (!okey) {
+        return false;
+    }
+    PyObject *oval = _css_str(buf, colon < 0 ? sep : sep + 1, buf->len);
+    if (!oval) {
+        Py_DECREF(okey);
+        return false;
     }
 
-    PyTuple_SET_ITEM(result, 0, PyLong_FromSsize_t(i));
-    PyTuple_SET_ITEM(result, 1, PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, ident, ident_len));
-    PyTuple_SET_ITEM(result, 2, dict); 
-
-    return result;
+    int r = PyDict_SetItem(dict, okey, oval);
+    Py_DECREF(okey);
+    Py_DECREF(oval);
+    return r == 0;
 }
 
+static bool
+_parse_css_rules(Py_ssize_t *index, const _Src *s, _Buf *buf, PyObject *dict, bool nested);
+
+/*
+ * Parse the block following a prelude held in buf. *index points at '{'.
+ * Rules with the same prelude are merged into one dict.
+ */
 static PyObject *
-parse_css_blocks(PyObject* self, PyObject* args) {
-    Py_ssize_t i = 0;
-    PyObject *src = NULL;
-    Py_ssize_t len = 0;
+_parse_css_rule_block(Py_ssize_t *index, const _Src *s, _Buf *buf, PyObject *dict, PyObject **oprelude) {
+    PyObject *prelude = _css_str(buf, 0, buf->len);
+    if (!prelude) {
+        return NULL;
+    }
 
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    PyObject *block = dict ? PyDict_GetItemWithError(dict, prelude) : NULL;
+    if (block && PyDict_Check(block)) {
+        Py_INCREF(block);
+    } else if (PyErr_Occurred()) {
+        Py_DECREF(prelude);
         return NULL;
+    } else {
+        block = PyDict_New();
+        if (!block) {
+            Py_DECREF(prelude);
+            return NULL;
+        }
     }
 
-    PyObject *blocks = PyDict_New();
-    if (!blocks) {
+    (*index)++;  // '{'
+    if (!_parse_css_rules(index, s, buf, block, true)) {
+        Py_DECREF(prelude);
+        Py_DECREF(block);
         return NULL;
     }
 
-    #undef _BUF_SIZE
-    #define _BUF_SIZE 1024
-    Py_UCS4 ident[_BUF_SIZE] = {0};
-    size_t ident_len = 0;
+    *oprelude = prelude;
+    return block;
+}
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (_is_css_ident_head(c)) {
-            PyObject *block = PyDict_New();
-            if (!block) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
+/*
+ * One rule block or declaration at *index into dict.
+ */
+static bool
+_parse_css_rule(Py_ssize_t *index, const _Src *s, _Buf *buf, PyObject *dict) {
+    Py_ssize_t colon;
+    int term = _parse_css_item(index, s, buf, &colon);
+    if (term < 0) {
+        return false;
+    }
 
-            if (!_parse_css_block(
-                &i, src, len,
-                ident, _BUF_SIZE, &ident_len, block
-            )) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
+    if (term == '{') {
+        PyObject *prelude = NULL;
+        PyObject *block = _parse_css_rule_block(index, s, buf, dict, &prelude);
+        if (!block) {
+            return false;
+        }
+        int r = PyDict_SetItem(dict, prelude, block);
+        Py_DECREF(prelude);
+        Py_DECREF(block);
+        return r == 0;
+    }
+    if (!_css_set_decl(dict, buf, colon)) {
+        return false;
+    }
+    if (term == ';') {
+        (*index)++;
+    }
+    return true;
+}
 
-            PyObject *oident = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, ident, ident_len);
-            if (!oident) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
+static bool
+_parse_css_rules(Py_ssize_t *index, const _Src *s, _Buf *buf, PyObject *dict, bool nested) {
+    Py_ssize_t i = *index;
+    bool ret = false;
 
-            if (PyDict_SetItem(blocks, oident, block) < 0) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
-        } else if (c == '@') {
-            PyObject *block = PyDict_New();
-            if (!block) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
+    if (Py_EnterRecursiveCall(" while parsing CSS")) {
+        return false;
+    }
 
-            if (!_parse_css_media_query_block(
-                &i, src, len,
-                ident, _BUF_SIZE, &ident_len, block
-            )) {
-                Py_DECREF(blocks);
-            }
-            PyObject *oident = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, ident, ident_len);
-            if (!oident) {
-                Py_DECREF(blocks);
-                return NULL;
-            }
-            if (PyDict_SetItem(blocks, oident, block) < 0) {
-                Py_DECREF(blocks);
-                return NULL;
+    for (;;) {
+        _css_skip_sp(&i, s);
+        if (i >= s->len) {
+            break;
+        }
+        if (PyUnicode_READ(s->kind, s->data, i) == '}') {
+            i++;
+            if (nested) {
+                break;
             }
+            continue;  // stray '}' at the top level
+        }
+
+        if (!_parse_css_rule(&i, s, buf, dict)) {
+            goto done;
         }
     }
 
+    ret = true;
+done:
+    Py_LeaveRecursiveCall();
+    *index = i;
+    return ret;
+}
+
+static PyObject *
+parse_css_block(PyObject* self, PyObject* args) {
+    _ModState *st = _get_state(self);
+    Py_ssize_t i = 0;
+    PyObject *src = NULL;
+    Py_ssize_t len = 0;
+
+    if (!PyArg_ParseTuple(args, "nUn", &i, &src, &len) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, len);
+    _Buf buf;
+    _buf_init(&buf);
+
+    _css_skip_sp(&i, &s);
+    Py_ssize_t colon;
+    int term = _parse_css_item(&i, &s, &buf, &colon);
+    if (term < 0) {
+        _buf_free(&buf);
+        return NULL;
+    }
+    if (term != '{') {
+        _buf_free(&buf);
+        _set_parse_error(st, &s, i, "'{'");
+        return NULL;
+    }
+
+    PyObject *ident = NULL;
+    PyObject *block = _parse_css_rule_block(&i, &s, &buf, NULL, &ident);
+    _buf_free(&buf);
+    if (!block) {
+        return NULL;
+    }
+
+    PyObject* result = PyTuple_New(3);
+    if (!result) {
+        Py_DECREF(ident);
+        Py_DECREF(block);
+        return NULL;
+    }
+
+    PyTuple_SET_ITEM(result, 0, PyLong_FromSsize_t(i));
+    PyTuple_SET_ITEM(result, 1, ident);
+    PyTuple_SET_ITEM(result, 2, block);
+
+    return result;
+}
+
+static PyObject *
+parse_css_blocks(PyObject* self, PyObject* args) {
+    Py_ssize_t i = 0;
+    PyObject *src = NULL;
+    Py_ssize_t len = 0;
+
+    if (!PyArg_ParseTuple(args, "nUn", &i, &src, &len) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    PyObject *blocks = PyDict_New();
+    if (!blocks) {
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, len);
+    _Buf buf;
+    _buf_init(&buf);
+
+    bool ok = _parse_css_rules(&i, &s, &buf, blocks, false);
+    _buf_free(&buf);
+    if (!ok) {
+        Py_DECREF(blocks);
+        return NULL;
+    }
+
     PyObject* result = PyTuple_New(2);
     if (!result) {
         Py_DECREF(blocks);
@@ -924,13 +2051,21 @@ enum {
 
 static bool
 _parse_tag(
-    Py_ssize_t *index, PyObject *src, Py_ssize_t len,
+    _ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len,
     Py_UCS4 tag_name[], size_t tag_name_size, size_t *tag_name_len,
-    PyObject *attrs, int *tag_type
+    PyObject *attrs, int *tag_type,
+    _Span *name_span,  // if not NULL, attrs is a list of offset tuples
+    const _Src *s  // view to place errors in, or NULL for src
 ) {
     Py_ssize_t i = *index;
     int m = 0;
+    const char *expected = NULL;
     *tag_type = BEGIN;
+    _Src whole;
+    if (!s) {
+        _src_init(&whole, src, len);
+        s = &whole;
+    }
 
     for (; i < len; i++) {
         int c = PyUnicode_READ_CHAR(src, i);
@@ -941,8 +2076,7 @@ _parse_tag(
                 m = 10;
                 Py_ssize_t k = i+1;
                 _skip_sp(&k, src, len);
-                c = PyUnicode_READ_CHAR(src, k);
-                if (c == '/') {
+                if (k < len && PyUnicode_READ_CHAR(src, k) == '/') {
                     i = k;
                     *tag_type = END;
                 }
@@ -950,8 +2084,16 @@ _parse_tag(
             break;
         case 10:
             _skip_sp(&i, src, len);
-            if (!_parse_ident(&i, src, len, tag_name, tag_name_size, tag_name_len)) {
-                return false;
+            if (name_span) {
+                name_span->beg = i;
+            }
+            if (!_parse_ident(&i, src, len,
+                    name_span ? NULL : tag_name, tag_name_size, tag_name_len)) {
+                expected = "a tag name shorter than 1024 characters";
+                goto error;
+            }
+            if (name_span) {
+                name_span->end = i;
             }
             _skip_sp(&i, src, len);
             i--;
@@ -962,22 +2104,49 @@ _parse_tag(
                 i++;
                 goto done;
             } else {
+                Py_ssize_t k = i;
+                _skip_sp(&k, src, len);
+                if (k < len && PyUnicode_READ_CHAR(src, k) == '<') {
+                    i = k;  // the next tag begins, this one is cut short
+                    expected = "'>'";
+                    goto error;
+                }
                 #undef _BUF_SIZE
                 #define _BUF_SIZE 1024
-                Py_UCS4 key[_BUF_SIZE] = {0};
-                Py_UCS4 val[_BUF_SIZE] = {0};
+                Py_UCS4 key[_BUF_SIZE];
+                Py_UCS4 val[_BUF_SIZE];
                 size_t key_len = 0;
                 size_t val_len = 0;
+                _Span kspan, vspan;
                 if (!_parse_key_value(
                     &i, src, len,
-                    key, _BUF_SIZE, &key_len,
-                    val, _BUF_SIZE, &val_len,
-                    '=', ">"
+                    name_span ? NULL : key, _BUF_SIZE, &key_len,
+                    name_span ? NULL : val, _BUF_SIZE, &val_len,
+                    '=', _C_END_TAG, &kspan, &vspan
                 )) {
-                    return false;
+                    expected = _scalar_expected(i, len);
+                    goto error;
                 }
                 i--;
 
+                if (kspan.beg == kspan.end) {
+                    continue;  // spaces or '/' before '>'
+                }
+                if (name_span) {
+                    PyObject *item = Py_BuildValue("nnnnO",
+                        kspan.beg, kspan.end, vspan.beg, vspan.end,
+                        (vspan.flags & _SPAN_ESCAPED) ? Py_True : Py_False);
+                    if (!item) {
+                        return false;
+                    }
+                    int rc = PyList_Append(attrs, item);
+                    Py_DECREF(item);
+                    if (rc < 0) {
+                        return false;
+                    }
+                    continue;
+                }
+
                 PyObject *okey = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, key, key_len);
                 if (!okey) {
                     return false;
@@ -988,28 +2157,48 @@ _parse_tag(
                     return false;
                 }
 
-                if (PyDict_SetItem(attrs, okey, oval) < 0) {
-                    Py_DECREF(okey);
-                    Py_DECREF(oval);
+                int rc = PyDict_SetItem(attrs, okey, oval);
+                Py_DECREF(okey);
+                Py_DECREF(oval);
+                if (rc < 0) {
                     return false;
                 }
             }
             break;
         }
     }
+    if (m != 0) {
+        expected = "'>'";
+        goto error;
+    }
 
 done:
+#ifdef PU_STATS
+    _STAT_INC(tags);
+    _STAT_ADD(chars_scanned, i - *index);
+    _STAT_ADD(tag_attrs, PyList_Check(attrs) ? PyList_GET_SIZE(attrs) : PyDict_GET_SIZE(attrs));
+#endif
     *index = i;
     return true;
+
+error:
+    _set_parse_error(st, s, i, expected);
+    *index = i;
+    return false;
 }
 
 static PyObject *
-parse_tag(PyObject* self, PyObject* args) {
+parse_tag(PyObject* self, PyObject* args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
     Py_ssize_t i = 0;
     PyObject *src = NULL;
     Py_ssize_t len = 0;
+    int offsets = 0;
+    static char *kwlist[] = {"index", "src", "len", "offsets", NULL};
 
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nUn|$p", kwlist,
+            &i, &src, &len, &offsets) ||
+        !_check_cursor(src, i, &len)) {
         return NULL;
     }
 
@@ -1017,8 +2206,9 @@ parse_tag(PyObject* self, PyObject* args) {
     #define _BUF_SIZE 1024
     Py_UCS4 tag_name[_BUF_SIZE];
     size_t tag_name_len = 0;
+    _Span name_span = {i, i, 0};
 
-    PyObject *attrs = PyDict_New();
+    PyObject *attrs = offsets ? PyList_New(0) : PyDict_New();
     if (!attrs) {
         return NULL;
     }
@@ -1026,8 +2216,9 @@ parse_tag(PyObject* self, PyObject* args) {
     int tag_type;
 
     if (!_parse_tag(
-        &i, src, len,
-        tag_name, _BUF_SIZE, &tag_name_len, attrs, &tag_type
+        st, &i, src, len,
+        tag_name, _BUF_SIZE, &tag_name_len, attrs, &tag_type,
+        offsets ? &name_span : NULL, NULL
     )) {
         Py_DECREF(attrs);
         return NULL;
@@ -1040,7 +2231,11 @@ parse_tag(PyObject* self, PyObject* args) {
     }
 
     PyTuple_SET_ITEM(result, 0, PyLong_FromSsize_t(i));
-    PyTuple_SET_ITEM(result, 1, PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, tag_name, tag_name_len));
+    if (offsets) {
+        PyTuple_SET_ITEM(result, 1, Py_BuildValue("(nn)", name_span.beg, name_span.end));
+    } else {
+        PyTuple_SET_ITEM(result, 1, PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, tag_name, tag_name_len));
+    }
     switch (tag_type) {
     case BEGIN:
         PyTuple_SET_ITEM(result, 2, PyUnicode_FromString("begin"));
@@ -1054,8 +2249,114 @@ parse_tag(PyObject* self, PyObject* args) {
     return result;    
 }
 
+/*
+ * Every tag of a document as (name, type, attrs). Text between tags is
+ * skipped, as are comments, <!...> and <?...?> declarations. After a
+ * malformed tag parsing resumes at the next '<' from where the tag went
+ * wrong, so no character is scanned twice however the input is broken;
+ * an unquoted '<' inside a tag ends it as malformed.
+ */
+static PyObject *
+parse_tags(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *src;
+    PyObject *oon_error = NULL;
+    static char *kwlist[] = {"src", "on_error", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|$O", kwlist, &src, &oon_error)) {
+        return NULL;
+    }
+    int on_error = _ON_ERROR_RAISE;
+    if (oon_error && !_on_error_mode(oon_error, &on_error)) {
+        return NULL;
+    }
+
+    PyObject *tags = PyList_New(0);
+    PyObject *errors = PyList_New(0);
+    if (!tags || !errors) {
+        Py_XDECREF(tags);
+        Py_XDECREF(errors);
+        return NULL;
+    }
+
+    _Src s;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(src);
+    _src_init(&s, src, len);
+    _LineMark mark;
+    _src_mark(&s, &mark);
+    #undef _BUF_SIZE
+    #define _BUF_SIZE 1024
+    Py_UCS4 tag_name[_BUF_SIZE];
+
+    for (Py_ssize_t i = 0; i < len; ) {
+        Py_ssize_t beg = PyUnicode_FindChar(src, '<', i, len, 1);
+        if (beg == -2) {
+            goto error;
+        } else if (beg < 0) {
+            break;
+        }
+        Py_UCS4 c = beg + 1 < len ? PyUnicode_READ(s.kind, s.data, beg + 1) : 0;
+        if (c == '!' || c == '?') {
+            bool comment = beg + 3 < len && c == '!' &&
+                PyUnicode_READ(s.kind, s.data, beg + 2) == '-' &&
+                PyUnicode_READ(s.kind, s.data, beg + 3) == '-';
+            if (comment) {
+                PyObject *close = PyUnicode_FromString("-->");
+                if (!close) {
+                    goto error;
+                }
+                Py_ssize_t k = PyUnicode_Find(src, close, beg + 4, len, 1);
+                Py_DECREF(close);
+                if (k == -2) {
+                    goto error;
+                }
+                i = k < 0 ? len : k + 3;
+            } else {
+                Py_ssize_t k = PyUnicode_FindChar(src, '>', beg + 2, len, 1);
+                if (k == -2) {
+                    goto error;
+                }
+                i = k < 0 ? len : k + 1;
+            }
+            continue;
+        }
+
+        PyObject *attrs = PyDict_New();
+        if (!attrs) {
+            goto error;
+        }
+        Py_ssize_t j = beg;
+        size_t tag_name_len = 0;
+        int tag_type;
+        if (!_parse_tag(st, &j, src, len, tag_name, _BUF_SIZE, &tag_name_len, attrs, &tag_type, NULL, &s)) {
+            Py_DECREF(attrs);
+            if (!_on_error(st, on_error, errors, &s, beg)) {
+                goto error;
+            }
+            i = j > beg ? j : beg + 1;  // the scanner read up to j
+            continue;
+        }
+        PyObject *tag = Py_BuildValue("(NsN)",
+            PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, tag_name, tag_name_len),
+            tag_type == END ? "end" : "begin", attrs);
+        if (!tag || PyList_Append(tags, tag) < 0) {
+            Py_XDECREF(tag);
+            goto error;
+        }
+        Py_DECREF(tag);
+        i = j > beg ? j : beg + 1;
+    }
+
+    return _on_error_result(on_error, tags, errors);
+error:
+    Py_DECREF(tags);
+    Py_DECREF(errors);
+    return NULL;
+}
+
 static bool
 _parse_section(
+    _ModState *st,
     Py_ssize_t *index, 
     PyObject *src, 
     Py_ssize_t len,
@@ -1078,12 +2379,13 @@ _parse_section(
             }
             break;
         case 10:
-            if (Py_UNICODE_ISSPACE(c)) {
+            if (_IS_SPACE(c)) {
                 // pass
             } else if (c == end_brace) {
                 goto done;
             } else {
                 if (*section_name_len >= section_name_size-1) {
+                    _parse_error(st, src, len, i, "a section name shorter than 1024 characters");
                     return false;
                 }
                 section_name[*section_name_len] = c;
@@ -1092,12 +2394,13 @@ _parse_section(
             }
             break;
         case 20:
-            if (Py_UNICODE_ISSPACE(c)) {
+            if (_IS_SPACE(c)) {
                 m = 30;
             } else if (c == end_brace) {
                 goto done;
             } else {
                 if (*section_name_len >= section_name_size-1) {
+                    _parse_error(st, src, len, i, "a section name shorter than 1024 characters");
                     return false;
                 }
                 section_name[*section_name_len] = c;
@@ -1111,6 +2414,16 @@ _parse_section(
             break;
         }
     }
+    if (m != 0) {
+        char expected[8] = "']'";
+        if (end_brace < 128) {
+            PyOS_snprintf(expected, sizeof(expected), "'%c'", end_brace);
+        }
+        _parse_error(st, src, len, i, expected);
+        return false;
+    }
+    *index = i;  // no section before len
+    return true;
 
 done:
     i++;
@@ -1118,12 +2431,23 @@ done:
     return true;
 }
 
-PyObject *
-parse_section(PyObject *self, PyObject *args) {
+static PyObject *
+parse_section(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
     Py_ssize_t i;
     PyObject *src;
     Py_ssize_t len;
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    PyObject *odialect = Py_None;
+    static char *kwlist[] = {"index", "src", "len", "dialect", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nUn|O", kwlist,
+            &i, &src, &len, &odialect) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    const IniDialect *d;
+    if (!_get_ini_dialect(st, odialect, &d)) {
         return NULL;
     }
 
@@ -1133,9 +2457,9 @@ parse_section(PyObject *self, PyObject *args) {
     size_t section_name_len = 0;
 
     if (!_parse_section(
-        &i, src, len,
+        st, &i, src, len,
         section_name, _BUF_SIZE, &section_name_len,
-        '[', ']')) {
+        d->section_begin, d->section_end)) {
         return NULL;
     }
 
@@ -1156,293 +2480,6272 @@ parse_section(PyObject *self, PyObject *args) {
     return tuple;
 }
 
+/*
+ * Whole INI documents
+ *
+ * parse_ini() reads line by line into {section: {key: value}}. Keys
+ * before the first section go to the section ''. A value is the rest of
+ * the line, or a quoted string with backslash escapes. Lines starting
+ * with ';' or '#' are comments. A bad line is a record for on_error; a
+ * bad section header skips everything up to the next section.
+ */
+
+static void
+_trim(const _Src *s, Py_ssize_t *beg, Py_ssize_t *end) {
+    while (*beg < *end && _IS_SPACE(PyUnicode_READ(s->kind, s->data, *beg))) {
+        (*beg)++;
+    }
+    while (*end > *beg && _IS_SPACE(PyUnicode_READ(s->kind, s->data, *end - 1))) {
+        (*end)--;
+    }
+}
+
 static bool
-_parse_list(Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *lis, int beg_bracket, int end_bracket) {
-    Py_ssize_t i = *index;
+_ini_rest_blank(const _Src *s, Py_ssize_t i, Py_ssize_t end) {
+    _trim(s, &i, &end);
+    if (i == end) {
+        return true;
+    }
+    Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+    return c == ';' || c == '#';
+}
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == beg_bracket) {
-            i++;
-            _skip_sp(&i, src, len);
+static PyObject *
+_ini_section(PyObject *doc, PyObject *src, Py_ssize_t beg, Py_ssize_t end) {
+    PyObject *name = PyUnicode_Substring(src, beg, end);
+    if (!name) {
+        return NULL;
+    }
+    PyObject *section = PyDict_GetItemWithError(doc, name);
+    if (!section && !PyErr_Occurred()) {
+        section = PyDict_New();
+        if (section) {
+            int rc = PyDict_SetItem(doc, name, section);
+            Py_DECREF(section);  // doc holds it
+            if (rc < 0) {
+                section = NULL;
+            }
+        }
+    }
+    Py_DECREF(name);
+    return section;  // borrowed
+}
+
+/*
+ * GIL-free scanning
+ *
+ * The whole-document parsers tokenize a block of about _TAPE_BLOCK
+ * characters at a time into a tape in raw memory, reading nothing but the
+ * str data, and only then build objects from the tape. A block of at
+ * least _TAPE_NOGIL_MIN characters is scanned with the GIL released, so
+ * a multi-megabyte parse in a worker thread gives the GIL up every few
+ * milliseconds instead of holding it to the end, and on free-threaded
+ * builds scans in parallel with other threads at no cost.
+ */
+
+#define _TAPE_BLOCK (1 << 16)
+#define _TAPE_NOGIL_MIN (1 << 14)
+
+enum {
+    _INI_SECTION,
+    _INI_KEY_VALUE,
+    _INI_BAD_SECTION,  // the lines up to the next header are skipped
+    _INI_BAD_LINE,
+};
+
+/*
+ * One INI line on the tape; blank and comment lines leave none.
+ */
+typedef struct {
+    int type;  // _INI_*
+    Py_ssize_t line;  // offset of the line
+    _Span name;  // section name or key
+    _Span value;  // quoted values exclude the quotes
+    Py_ssize_t err;  // error offset of a bad line
+    const char *expected;
+} _IniLine;
+
+typedef struct {
+    _IniLine *lines;
+    size_t nlines;
+    size_t size;
+} _IniTape;
+
+/*
+ * Scan "key = value" in [i, end) into l. A quoted value is
+ * _SPAN_ESCAPED when it holds a backslash escape. Returns false with
+ * l->err and l->expected set for a malformed line.
+ */
+static bool
+_ini_scan_key_value(const _Src *s, const IniDialect *d, Py_ssize_t i, Py_ssize_t end, _IniLine *l) {
+    Py_ssize_t sep = i;
+    while (sep < end && PyUnicode_READ(s->kind, s->data, sep) != d->sep) {
+        sep++;
+    }
+    if (sep == end) {
+        l->err = end;
+        l->expected = "key/value separator";
+        return false;
+    }
+    Py_ssize_t kbeg = i, kend = sep;
+    _trim(s, &kbeg, &kend);
+    if (kbeg == kend) {
+        l->err = i;
+        l->expected = "a key";
+        return false;
+    }
+    l->name = (_Span) {kbeg, kend, 0};
+
+    Py_ssize_t vbeg = sep + 1, vend = end;
+    _trim(s, &vbeg, &vend);
+    Py_UCS4 quote = vbeg < vend ? PyUnicode_READ(s->kind, s->data, vbeg) : 0;
+    if (quote != '"' && quote != '\'') {
+        l->value = (_Span) {vbeg, vend, 0};
+        return true;
+    }
+    int flags = _SPAN_QUOTED;
+    Py_ssize_t k = vbeg + 1;
+    for (; k < end; k++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, k);
+        if (c == quote) {
             break;
+        } else if (c == '\\' && k + 1 < end) {
+            flags |= _SPAN_ESCAPED;
+            k++;
         }
     }
+    if (k >= end) {
+        l->err = end;
+        l->expected = "closing quote";
+        return false;
+    }
+    if (!_ini_rest_blank(s, k + 1, end)) {
+        l->err = k + 1;
+        l->expected = "end of line";
+        return false;
+    }
+    l->value = (_Span) {vbeg + 1, k, flags};
+    return true;
+}
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        _skip_sp(&i, src, len);
+/*
+ * Tokenize the lines from *index until a block is passed or the input
+ * ends. Unless final, a line without its newline is left at *index.
+ * Needs no GIL; returns false out of memory.
+ */
+static bool
+_ini_tape_scan(_IniTape *t, Py_ssize_t *index, const _Src *s, const IniDialect *d, bool final) {
+    Py_ssize_t i = *index;
+    Py_ssize_t limit = s->len - i > _TAPE_BLOCK ? i + _TAPE_BLOCK : s->len;
+    t->nlines = 0;
+
+    while (i < limit) {
+        Py_ssize_t line = i;
+        Py_ssize_t end = i;
+        while (end < s->len && PyUnicode_READ(s->kind, s->data, end) != '\n') {
+            end++;
+        }
+        if (!final && end == s->len) {
+            break;
+        }
+        Py_ssize_t next = end < s->len ? end + 1 : end;
+        Py_ssize_t beg = i;
+        _trim(s, &beg, &end);
+        i = next;
+        if (beg == end) {
+            continue;
+        }
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, beg);
+        if (c == ';' || c == '#') {
+            continue;
+        }
 
-        PyObject *oval = _parse_ovalue(&i, src, len, ",]");
-        if (!oval) {
-            return false;
+        if (t->nlines >= t->size) {
+            size_t size = t->size ? 2 * t->size : 256;
+            _IniLine *lines = PyMem_RawRealloc(t->lines, size * sizeof(_IniLine));
+            if (!lines) {
+                *index = line;
+                return false;
+            }
+            t->lines = lines;
+            t->size = size;
         }
-        if (PyList_Append(lis, oval) < 0) {
-            Py_DECREF(oval);
-            return false;
+        _IniLine *l = &t->lines[t->nlines++];
+        l->line = line;
+        if (c != d->section_begin) {
+            l->type = _ini_scan_key_value(s, d, beg, end, l) ? _INI_KEY_VALUE : _INI_BAD_LINE;
+            continue;
+        }
+        Py_ssize_t close = beg + 1;
+        while (close < end && PyUnicode_READ(s->kind, s->data, close) != d->section_end) {
+            close++;
+        }
+        l->type = _INI_BAD_SECTION;
+        if (close == end) {
+            l->err = end;
+            l->expected = "section end";
+        } else if (!_ini_rest_blank(s, close + 1, end)) {
+            l->err = close + 1;
+            l->expected = "end of line";
+        } else {
+            Py_ssize_t nbeg = beg + 1, nend = close;
+            _trim(s, &nbeg, &nend);
+            l->type = _INI_SECTION;
+            l->name = (_Span) {nbeg, nend, 0};
         }
+    }
 
-        _skip_sp(&i, src, len);
-        c = PyUnicode_READ_CHAR(src, i);
-        if (c == end_bracket) {
-            i++;
+    *index = i;
+    return true;
+}
+
+/*
+ * The next block of lines onto the tape, without the GIL if it is large.
+ */
+static bool
+_ini_tape_fill(_IniTape *t, Py_ssize_t *index, const _Src *s, const IniDialect *d, bool final) {
+    bool ok;
+    if (s->len - *index >= _TAPE_NOGIL_MIN) {
+        Py_BEGIN_ALLOW_THREADS
+        ok = _ini_tape_scan(t, index, s, d, final);
+        Py_END_ALLOW_THREADS
+    } else {
+        ok = _ini_tape_scan(t, index, s, d, final);
+    }
+    if (!ok) {
+        PyErr_NoMemory();
+    }
+    return ok;
+}
+
+static bool
+_ini_key_value(PyObject *src, const _IniLine *l, PyObject *section, _Buf *buf) {
+    PyObject *val = _span_unescape(src, &l->value, buf);
+    PyObject *key = val ? PyUnicode_Substring(src, l->name.beg, l->name.end) : NULL;
+    int rc = key ? PyDict_SetItem(section, key, val) : -1;
+    Py_XDECREF(key);
+    Py_XDECREF(val);
+    return rc == 0;
+}
+
+/*
+ * State of one INI call, kept across the blocks of a streamed file.
+ */
+typedef struct {
+    _ModState *st;
+    const IniDialect *d;
+    PyObject *doc;
+    PyObject *section;  // borrowed from doc
+    bool skip_section;
+    int on_error;  // _ON_ERROR_*
+    PyObject *errors;  // borrowed list with on_error='collect'
+    _Buf buf;
+} _IniParser;
+
+/*
+ * Lines from *index on into p->doc. Unless final, a line without its
+ * newline is left at *index for the next block of a stream.
+ */
+static bool
+_parse_ini_lines(Py_ssize_t *index, PyObject *src, const _Src *text, _IniParser *p, bool final) {
+    Py_ssize_t i = *index;
+    bool ret = false;
+    _IniTape t = {0};
+    _Src view = *text;
+    const _Src *s = &view;
+    _LineMark mark;
+    _src_mark(&view, &mark);
+
+    while (i < s->len) {
+        Py_ssize_t beg = i;
+        if (!_ini_tape_fill(&t, &i, s, p->d, final)) {
             goto done;
-        } else if (c == ',') {
-            // pass
+        }
+        for (size_t k = 0; k < t.nlines; k++) {
+            const _IniLine *l = &t.lines[k];
+            if (l->type == _INI_SECTION) {
+                p->section = _ini_section(p->doc, src, l->name.beg, l->name.end);
+                if (!p->section) {
+                    goto done;
+                }
+                p->skip_section = false;
+                continue;
+            } else if (l->type == _INI_BAD_SECTION) {
+                p->skip_section = true;
+            } else if (p->skip_section) {
+                continue;
+            } else {
+                if (!p->section) {
+                    p->section = _ini_section(p->doc, src, 0, 0);
+                    if (!p->section) {
+                        goto done;
+                    }
+                }
+                if (l->type == _INI_KEY_VALUE) {
+                    if (!_ini_key_value(src, l, p->section, &p->buf)) {
+                        goto done;
+                    }
+                    continue;
+                }
+            }
+
+            _set_parse_error(p->st, s, l->err, l->expected);
+            if (!_on_error(p->st, p->on_error, p->errors, s, l->line)) {
+                goto done;
+            }
+        }
+        if (i == beg) {
+            break;  // only an unfinished line is left
         }
     }
 
+    ret = true;
 done:
+    PyMem_RawFree(t.lines);
     *index = i;
-    return true;
+    return ret;
 }
 
-PyObject *
-parse_list(PyObject *self, PyObject *args) {
-    Py_ssize_t i;
+static PyObject *
+parse_ini(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
     PyObject *src;
-    Py_ssize_t len;
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    PyObject *odialect = Py_None;
+    PyObject *oon_error = NULL;
+    static char *kwlist[] = {"src", "dialect", "on_error", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|O$O", kwlist, &src, &odialect, &oon_error)) {
+        return NULL;
+    }
+    _IniParser p = {.st = st, .on_error = _ON_ERROR_RAISE};
+    if (!_get_ini_dialect(st, odialect, &p.d) ||
+        (oon_error && !_on_error_mode(oon_error, &p.on_error))) {
+        return NULL;
+    }
+
+    p.doc = PyDict_New();
+    p.errors = PyList_New(0);
+    if (!p.doc || !p.errors) {
+        Py_XDECREF(p.doc);
+        Py_XDECREF(p.errors);
         return NULL;
     }
 
-    PyObject *lis = PyList_New(0);
-    if (!lis) {
-        return NULL;
+    _Src s;
+    _src_init(&s, src, PyUnicode_GET_LENGTH(src));
+    _buf_init(&p.buf);
+    Py_ssize_t i = 0;
+    if (!_parse_ini_lines(&i, src, &s, &p, true)) {
+        Py_CLEAR(p.doc);
+    }
+    _buf_free(&p.buf);
+    return _on_error_result(p.on_error, p.doc, p.errors);
+}
+
+static bool
+_parse_list(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *lis, int beg_bracket, int end_bracket) {
+    Py_ssize_t i = *index;
+
+    _skip_sp(&i, src, len);
+    if (i >= len || PyUnicode_READ_CHAR(src, i) != (Py_UCS4) beg_bracket) {
+        _parse_error(st, src, len, i, "'['");
+        return false;
+    }
+    i++;
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == (Py_UCS4) end_bracket) {
+        i++;
+        goto done;
+    }
+
+    for (;;) {
+        PyObject *oval = _parse_ovalue(st, &i, src, len, _C_END_LIST);
+        if (!oval) {
+            return false;
+        }
+        int rc = PyList_Append(lis, oval);
+        Py_DECREF(oval);
+        if (rc < 0) {
+            return false;
+        }
+
+        _skip_sp(&i, src, len);
+        int c = i < len ? (int) PyUnicode_READ_CHAR(src, i) : -1;
+        if (c == end_bracket) {
+            i++;
+            goto done;
+        } else if (c != ',') {
+            _parse_error(st, src, len, i, "',' or ']'");
+            return false;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == (Py_UCS4) end_bracket) {
+            i++;  // trailing comma
+            goto done;
+        }
+    }
+
+done:
+    *index = i;
+    return true;
+}
+
+static PyObject *
+parse_list(PyObject *self, PyObject *args) {
+    _ModState *st = _get_state(self);
+    Py_ssize_t i;
+    PyObject *src;
+    Py_ssize_t len;
+    if (!PyArg_ParseTuple(args, "nUn", &i, &src, &len) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    PyObject *lis = PyList_New(0);
+    if (!lis) {
+        return NULL;
+    }
+
+    if (!_parse_list(st, &i, src, len, lis, '[', ']')) {
+        Py_DECREF(lis);
+        return NULL;
+    }
+
+    PyObject *tuple = PyTuple_New(2);
+    if (!tuple) {
+        Py_DECREF(lis);
+        return NULL;
+    }
+
+    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
+    PyTuple_SET_ITEM(tuple, 1, lis);
+
+    return tuple;
+}
+
+/*
+ * The quoted key of a dict item as str, or None with offsets, where only
+ * span is wanted. Like _parse_oscalar() it keeps its buffer out of the
+ * recursion.
+ */
+static Py_NO_INLINE PyObject *
+_parse_okey(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, bool offsets, _Span *span) {
+    #undef _BUF_SIZE
+    #define _BUF_SIZE 1024
+    Py_UCS4 val[_BUF_SIZE];
+    size_t val_len = 0;
+    Py_ssize_t beg = *index;
+    if (!_parse_string(index, src, len, offsets ? NULL : val, _BUF_SIZE, &val_len, span)) {
+        _parse_error(st, src, len, *index, *index == beg ? "a quoted key" : _scalar_expected(*index, len));
+        return NULL;
+    }
+    if (offsets) {
+        return Py_NewRef(Py_None);
+    }
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, val, val_len);
+}
+
+/*
+ * With offsets, dict is a list that receives (key_beg, key_end, val_beg,
+ * val_end, escaped) for each item and no values are built.
+ */
+static bool
+_parse_dict(_ModState *st, Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *dict, int beg_brace, int end_brace, bool offsets) {
+    Py_ssize_t i = *index;
+
+    _skip_sp(&i, src, len);
+    if (i >= len || PyUnicode_READ_CHAR(src, i) != (Py_UCS4) beg_brace) {
+        _parse_error(st, src, len, i, "'{'");
+        return false;
+    }
+    i++;
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == (Py_UCS4) end_brace) {
+        i++;
+        goto done;
+    }
+
+    for (;;) {
+        _Span kspan, vspan;
+        _skip_sp(&i, src, len);
+        // read key
+        PyObject *okey = _parse_okey(st, &i, src, len, offsets, &kspan);
+        if (!okey) {
+            return false;
+        }
+
+        _skip_sp(&i, src, len);
+        if (i >= len || PyUnicode_READ_CHAR(src, i) != ':') {
+            Py_DECREF(okey);
+            _parse_error(st, src, len, i, "':'");
+            return false;
+        }
+        i++;
+
+        // read value
+        if (offsets) {
+            Py_DECREF(okey);
+            if (!_skip_ovalue(&i, src, len, _C_END_DICT, &vspan)) {
+                _parse_error(st, src, len, i, _scalar_expected(i, len));
+                return false;
+            }
+            PyObject *item = Py_BuildValue("nnnnO",
+                kspan.beg, kspan.end, vspan.beg, vspan.end,
+                (vspan.flags & _SPAN_ESCAPED) ? Py_True : Py_False);
+            if (!item) {
+                return false;
+            }
+            int rc = PyList_Append(dict, item);
+            Py_DECREF(item);
+            if (rc < 0) {
+                return false;
+            }
+        } else {
+            PyObject *oval = _parse_ovalue(st, &i, src, len, _C_END_DICT);
+            if (!oval) {
+                Py_DECREF(okey);
+                return false;
+            }
+            // set key and value
+            int rc = PyDict_SetItem(dict, okey, oval);
+            Py_DECREF(okey);
+            Py_DECREF(oval);
+            if (rc < 0) {
+                return false;
+            }
+        }
+
+        _skip_sp(&i, src, len);
+        int c = i < len ? (int) PyUnicode_READ_CHAR(src, i) : -1;
+        if (c == end_brace) {
+            i++;
+            goto done;
+        } else if (c != ',') {
+            _parse_error(st, src, len, i, "',' or '}'");
+            return false;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == (Py_UCS4) end_brace) {
+            i++;  // trailing comma
+            goto done;
+        }
+    }
+
+done:
+    *index = i;
+    return true;
+}
+
+static PyObject *
+parse_dict(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    Py_ssize_t i;
+    PyObject *src;
+    Py_ssize_t len;
+    int offsets = 0;
+    static char *kwlist[] = {"index", "src", "len", "offsets", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nUn|$p", kwlist,
+            &i, &src, &len, &offsets) ||
+        !_check_cursor(src, i, &len)) {
+        return NULL;
+    }
+
+    PyObject *dict = offsets ? PyList_New(0) : PyDict_New();
+    if (!dict) {
+        return NULL;
+    }
+
+    if (!_parse_dict(st, &i, src, len, dict, '{', '}', offsets)) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    PyObject *tuple = PyTuple_New(2);
+    if (!tuple) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+
+    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
+    PyTuple_SET_ITEM(tuple, 1, dict);
+
+    return tuple;
+}
+/*
+ * Key path extraction
+ *
+ * extract() walks a dict or list document for a few key paths only.
+ * Members off every path are passed over with _skip_ovalue(), which
+ * reads them as the parsers do without building anything, so only the
+ * requested values become objects. A path is "a.b[0].c" or a tuple of
+ * str keys and int indexes; it is resolved by its first occurrence and
+ * the scan stops once every path is resolved.
+ */
+
+typedef struct {
+    PyObject *steps;  // tuple of str keys and int indexes
+    Py_ssize_t nsteps;
+    Py_ssize_t matched;  // steps matched by the member being walked
+    PyObject *value;  // NULL until found
+    bool done;  // found, or known to be missing
+} _ExtractPath;
+
+typedef struct {
+    _ModState *st;
+    _ExtractPath *paths;
+    Py_ssize_t npaths;
+    Py_ssize_t left;  // paths not done
+} _Extract;
+
+static PyObject *
+_extract_steps(PyObject *path) {
+    PyObject *steps;
+    if (PyTuple_Check(path)) {
+        steps = Py_NewRef(path);
+    } else if (!PyUnicode_Check(path)) {
+        PyErr_Format(PyExc_TypeError, "a path must be str or tuple, not %.200s", Py_TYPE(path)->tp_name);
+        return NULL;
+    } else {
+        steps = PyList_New(0);
+        if (!steps) {
+            return NULL;
+        }
+        Py_ssize_t len = PyUnicode_GET_LENGTH(path);
+        for (Py_ssize_t i = 0; i < len; ) {
+            Py_UCS4 c = PyUnicode_READ_CHAR(path, i);
+            PyObject *step;
+            if (c == '[') {
+                Py_ssize_t beg = ++i;
+                while (i < len && Py_UNICODE_ISDIGIT(PyUnicode_READ_CHAR(path, i))) {
+                    i++;
+                }
+                if (i == beg || i >= len || PyUnicode_READ_CHAR(path, i) != ']') {
+                    goto bad;
+                }
+                PyObject *digits = PyUnicode_Substring(path, beg, i++);
+                step = digits ? PyLong_FromUnicodeObject(digits, 10) : NULL;
+                Py_XDECREF(digits);
+            } else {
+                if (c == '.' && i > 0) {
+                    i++;
+                } else if (i > 0) {
+                    goto bad;
+                }
+                Py_ssize_t beg = i;
+                while (i < len && (c = PyUnicode_READ_CHAR(path, i)) != '.' && c != '[') {
+                    i++;
+                }
+                if (i == beg) {
+                    goto bad;
+                }
+                step = PyUnicode_Substring(path, beg, i);
+            }
+            int rc = step ? PyList_Append(steps, step) : -1;
+            Py_XDECREF(step);
+            if (rc < 0) {
+                Py_DECREF(steps);
+                return NULL;
+            }
+        }
+        Py_SETREF(steps, PyList_AsTuple(steps));
+        if (!steps) {
+            return NULL;
+        }
+    }
+
+    for (Py_ssize_t k = 0; k < PyTuple_GET_SIZE(steps); k++) {
+        PyObject *step = PyTuple_GET_ITEM(steps, k);
+        if (PyLong_Check(step)) {
+            if (PyLong_AsSsize_t(step) < 0) {
+                if (PyErr_Occurred()) {
+                    Py_DECREF(steps);
+                    return NULL;
+                }
+                goto bad;
+            }
+        } else if (!PyUnicode_Check(step)) {
+            PyErr_Format(PyExc_TypeError, "path steps must be str or int, not %.200s", Py_TYPE(step)->tp_name);
+            Py_DECREF(steps);
+            return NULL;
+        }
+    }
+    return steps;
+
+bad:
+    PyErr_Format(PyExc_ValueError, "bad path %R", path);
+    Py_DECREF(steps);
+    return NULL;
+}
+
+/*
+ * Follow the steps of p past depth through an object already built.
+ */
+static bool
+_extract_lookup(_ExtractPath *p, PyObject *o, Py_ssize_t depth) {
+    for (Py_ssize_t k = depth; o && k < p->nsteps; k++) {
+        PyObject *step = PyTuple_GET_ITEM(p->steps, k);
+        if (PyUnicode_Check(step) && PyDict_Check(o)) {
+            o = PyDict_GetItemWithError(o, step);
+            if (!o && PyErr_Occurred()) {
+                return false;
+            }
+        } else if (PyLong_Check(step) && PyList_Check(o)) {
+            Py_ssize_t n = PyLong_AsSsize_t(step);
+            if (n == -1 && PyErr_Occurred()) {
+                return false;
+            }
+            o = n >= 0 && n < PyList_GET_SIZE(o) ? PyList_GET_ITEM(o, n) : NULL;
+        } else {
+            o = NULL;
+        }
+    }
+    p->value = Py_XNewRef(o);
+    return true;
+}
+
+static bool
+_extract_value(_Extract *x, Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, Py_ssize_t depth);
+
+/*
+ * Mark the paths whose next step is the member at key (a span of src) or
+ * index. Returns whether any is.
+ */
+static bool
+_extract_enter(_Extract *x, Py_ssize_t depth, PyObject *src, const _Span *key, Py_ssize_t index) {
+    bool any = false;
+    for (Py_ssize_t k = 0; k < x->npaths; k++) {
+        _ExtractPath *p = &x->paths[k];
+        if (p->done || p->matched != depth || p->nsteps == depth) {
+            continue;
+        }
+        PyObject *step = PyTuple_GET_ITEM(p->steps, depth);
+        bool match;
+        if (key && (key->flags & _SPAN_ESCAPED)) {
+            match = PyUnicode_Check(step) && _span_unescaped_equals(src, key, step);
+        } else if (key) {
+            match = PyUnicode_Check(step) &&
+                PyUnicode_GET_LENGTH(step) == key->end - key->beg &&
+                PyUnicode_Tailmatch(src, step, key->beg, key->end, -1) == 1;
+        } else {
+            match = PyLong_Check(step) && PyLong_AsSsize_t(step) == index;
+        }
+        if (match) {
+            p->matched = depth + 1;
+            any = true;
+        }
+    }
+    return any;
+}
+
+static void
+_extract_leave(_Extract *x, Py_ssize_t depth) {
+    for (Py_ssize_t k = 0; k < x->npaths; k++) {
+        if (x->paths[k].matched > depth) {
+            x->paths[k].matched = depth;
+        }
+    }
+}
+
+/*
+ * The paths still matched at depth end in this container: they are
+ * missing.
+ */
+static void
+_extract_missing(_Extract *x, Py_ssize_t depth) {
+    for (Py_ssize_t k = 0; k < x->npaths; k++) {
+        _ExtractPath *p = &x->paths[k];
+        if (!p->done && p->matched == depth) {
+            p->done = true;
+            x->left--;
+        }
+    }
+}
+
+/*
+ * Skip or walk one member; on the paths, it is walked.
+ */
+static bool
+_extract_member(_Extract *x, Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, Py_ssize_t depth,
+    bool on_path) {
+    if (on_path) {
+        bool ok = _extract_value(x, index, src, len, end, depth + 1);
+        _extract_leave(x, depth);
+        return ok;
+    }
+    _Span span;
+    if (!_skip_ovalue(index, src, len, end, &span)) {
+        _parse_error(x->st, src, len, *index, _scalar_expected(*index, len));
+        return false;
+    }
+    return true;
+}
+
+static bool
+_extract_dict(_Extract *x, Py_ssize_t *index, PyObject *src, Py_ssize_t len, Py_ssize_t depth) {
+    Py_ssize_t i = *index + 1;  // past '{'
+    size_t key_len;
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == '}') {
+        i++;
+        goto done;
+    }
+
+    for (;;) {
+        _Span kspan;
+        _skip_sp(&i, src, len);
+        Py_ssize_t key_beg = i;
+        if (!_parse_string(&i, src, len, NULL, 0, &key_len, &kspan)) {
+            _parse_error(x->st, src, len, i, i == key_beg ? "a quoted key" : _scalar_expected(i, len));
+            return false;
+        }
+        _skip_sp(&i, src, len);
+        if (i >= len || PyUnicode_READ_CHAR(src, i) != ':') {
+            _parse_error(x->st, src, len, i, "':'");
+            return false;
+        }
+        i++;
+
+        bool on_path = _extract_enter(x, depth, src, &kspan, 0);
+        if (!_extract_member(x, &i, src, len, _C_END_DICT, depth, on_path)) {
+            return false;
+        }
+        if (!x->left) {
+            goto done;
+        }
+
+        _skip_sp(&i, src, len);
+        int c = i < len ? (int) PyUnicode_READ_CHAR(src, i) : -1;
+        if (c == '}') {
+            i++;
+            goto done;
+        } else if (c != ',') {
+            _parse_error(x->st, src, len, i, "',' or '}'");
+            return false;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == '}') {
+            i++;  // trailing comma
+            goto done;
+        }
+    }
+
+done:
+    _extract_missing(x, depth);
+    *index = i;
+    return true;
+}
+
+static bool
+_extract_list(_Extract *x, Py_ssize_t *index, PyObject *src, Py_ssize_t len, Py_ssize_t depth) {
+    Py_ssize_t i = *index + 1;  // past '['
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == ']') {
+        i++;
+        goto done;
+    }
+
+    for (Py_ssize_t n = 0; ; n++) {
+        bool on_path = _extract_enter(x, depth, src, NULL, n);
+        if (!_extract_member(x, &i, src, len, _C_END_LIST, depth, on_path)) {
+            return false;
+        }
+        if (!x->left) {
+            goto done;
+        }
+
+        _skip_sp(&i, src, len);
+        int c = i < len ? (int) PyUnicode_READ_CHAR(src, i) : -1;
+        if (c == ']') {
+            i++;
+            goto done;
+        } else if (c != ',') {
+            _parse_error(x->st, src, len, i, "',' or ']'");
+            return false;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == ']') {
+            i++;  // trailing comma
+            goto done;
+        }
+    }
+
+done:
+    _extract_missing(x, depth);
+    *index = i;
+    return true;
+}
+
+/*
+ * A value reached by the paths matched up to depth. It is built only
+ * when a path ends on it; the paths going deeper are then looked up in
+ * the built object.
+ */
+static bool
+_extract_value(_Extract *x, Py_ssize_t *index, PyObject *src, Py_ssize_t len, unsigned end, Py_ssize_t depth) {
+    bool ends = false;
+    for (Py_ssize_t k = 0; k < x->npaths; k++) {
+        _ExtractPath *p = &x->paths[k];
+        ends |= !p->done && p->matched == depth && p->nsteps == depth;
+    }
+
+    if (ends) {
+        PyObject *o = _parse_ovalue(x->st, index, src, len, end);
+        if (!o) {
+            return false;
+        }
+        for (Py_ssize_t k = 0; k < x->npaths; k++) {
+            _ExtractPath *p = &x->paths[k];
+            if (p->done || p->matched != depth) {
+                continue;
+            }
+            if (!_extract_lookup(p, o, depth)) {
+                Py_DECREF(o);
+                return false;
+            }
+            p->done = true;
+            x->left--;
+        }
+        Py_DECREF(o);
+        return true;
+    }
+
+    Py_ssize_t i = *index;
+    _skip_sp(&i, src, len);
+    int c = i < len ? (int) PyUnicode_READ_CHAR(src, i) : -1;
+    if (c == '{' || c == '[') {
+        *index = i;
+        return c == '{' ? _extract_dict(x, index, src, len, depth) : _extract_list(x, index, src, len, depth);
+    }
+    if (depth == 0) {
+        _parse_error(x->st, src, len, i, "'{' or '['");
+        return false;
+    }
+    _extract_missing(x, depth);  // a scalar has no members
+    return _extract_member(x, index, src, len, end, depth, false);
+}
+
+static PyObject *
+extract(PyObject *self, PyObject *args, PyObject *kwargs) {
+    PyObject *src;
+    PyObject *opaths;
+    PyObject *dflt = Py_None;
+    static char *kwlist[] = {"src", "paths", "default", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "UO|$O", kwlist, &src, &opaths, &dflt)) {
+        return NULL;
+    }
+    if (PyUnicode_Check(opaths)) {
+        PyErr_SetString(PyExc_TypeError, "paths must be a sequence of paths, not str");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(opaths, "paths must be a sequence of paths");
+    if (!seq) {
+        return NULL;
+    }
+
+    _Extract x = {.st = _get_state(self), .npaths = PySequence_Fast_GET_SIZE(seq)};
+    x.paths = PyMem_Calloc(x.npaths ? x.npaths : 1, sizeof(*x.paths));
+    PyObject *ret = NULL;
+    if (!x.paths) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t k = 0; k < x.npaths; k++) {
+        _ExtractPath *p = &x.paths[k];
+        p->steps = _extract_steps(PySequence_Fast_GET_ITEM(seq, k));
+        if (!p->steps) {
+            goto done;
+        }
+        p->nsteps = PyTuple_GET_SIZE(p->steps);
+    }
+
+    x.left = x.npaths;
+    Py_ssize_t i = 0;
+    if (x.left && !_extract_value(&x, &i, src, PyUnicode_GET_LENGTH(src), 0, 0)) {
+        goto done;
+    }
+    ret = PyList_New(x.npaths);
+    for (Py_ssize_t k = 0; ret && k < x.npaths; k++) {
+        PyObject *v = x.paths[k].value ? x.paths[k].value : dflt;
+        PyList_SET_ITEM(ret, k, Py_NewRef(v));
+    }
+
+done:
+    if (x.paths) {
+        for (Py_ssize_t k = 0; k < x.npaths; k++) {
+            Py_XDECREF(x.paths[k].steps);
+            Py_XDECREF(x.paths[k].value);
+        }
+        PyMem_Free(x.paths);
+    }
+    Py_DECREF(seq);
+    return ret;
+}
+
+/*
+ * parse_dict_many() scans the top level of every dict into key and value
+ * spans the same way, then builds keys and scalars from the spans and
+ * parses only the nested values, which need the GIL for their objects.
+ * An item the scan does not take whole, being invalid, nested deeper than
+ * _DICT_SCAN_DEPTH or holding a key or scalar too long for the buffers of
+ * _parse_dict(), is parsed again by _parse_dict(), which raises its error
+ * or builds what it can.
+ */
+
+#define _DICT_SCAN_DEPTH 64
+#define _DICT_SCAN_SCALAR 1024  // the buffers of _parse_okey() and _parse_oscalar()
+
+typedef struct {
+    _Span key;
+    _Span val;
+    int type;  // of a scalar value, -1 for a nested list or dict
+} _DictItem;
+
+typedef struct {
+    Py_ssize_t first;  // its first item in the items of the job
+    Py_ssize_t n;
+    bool ok;
+} _DictSpans;
+
+typedef struct {
+    PyObject **srcs;
+    Py_ssize_t n;
+    _DictSpans *out;
+    _DictItem *items;  // PyMem_Raw, as it grows without the GIL
+    Py_ssize_t nitems;
+    Py_ssize_t size;
+} _DictJob;
+
+static _DictItem *
+_dict_job_push(_DictJob *job) {
+    if (job->nitems >= job->size) {
+        Py_ssize_t size = job->size ? job->size * 2 : 64;
+        _DictItem *items = PyMem_RawRealloc(job->items, size * sizeof(_DictItem));
+        if (!items) {
+            return NULL;
+        }
+        job->items = items;
+        job->size = size;
+    }
+    return &job->items[job->nitems++];
+}
+
+/*
+ * The top level of a dict as _parse_dict() reads it, appending an item
+ * per key to job. Returns false where _parse_dict() has to take over.
+ */
+static bool
+_dict_scan_items(_DictJob *job, PyObject *src) {
+    Py_ssize_t len = PyUnicode_GET_LENGTH(src);
+    Py_ssize_t i = 0;
+
+    _skip_sp(&i, src, len);
+    if (i >= len || PyUnicode_READ_CHAR(src, i) != '{') {
+        return false;
+    }
+    i++;
+    _skip_sp(&i, src, len);
+    if (i < len && PyUnicode_READ_CHAR(src, i) == '}') {
+        return true;
+    }
+
+    for (;;) {
+        _DictItem *item = _dict_job_push(job);
+        if (!item) {
+            return false;
+        }
+        size_t n;
+        _skip_sp(&i, src, len);
+        if (!_parse_string(&i, src, len, NULL, 0, &n, &item->key) || n >= _DICT_SCAN_SCALAR) {
+            return false;
+        }
+        _skip_sp(&i, src, len);
+        if (i >= len || PyUnicode_READ_CHAR(src, i) != ':') {
+            return false;
+        }
+        i++;
+
+        _skip_sp(&i, src, len);
+        if (i >= len) {
+            return false;
+        }
+        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
+        if (c == '[' || c == '{') {
+            item->type = -1;
+            if (!_skip_value(&i, src, len, _C_END_DICT, &item->val, _DICT_SCAN_DEPTH)) {
+                return false;
+            }
+        } else {
+            item->type = _STR;
+            if (!_parse_value(&i, src, len, NULL, 0, &n, _C_END_DICT, &item->type, &item->val) ||
+                n >= _DICT_SCAN_SCALAR) {
+                return false;
+            }
+        }
+
+        _skip_sp(&i, src, len);
+        c = i < len ? PyUnicode_READ_CHAR(src, i) : 0;
+        if (c == '}') {
+            return true;
+        } else if (c != ',') {
+            return false;
+        }
+        i++;
+        _skip_sp(&i, src, len);
+        if (i < len && PyUnicode_READ_CHAR(src, i) == '}') {
+            return true;  // trailing comma
+        }
+    }
+}
+
+static void
+_dict_scan(void *arg) {
+    _DictJob *job = arg;
+    for (Py_ssize_t k = 0; k < job->n; k++) {
+        _DictSpans *out = &job->out[k];
+        out->first = job->nitems;
+        out->ok = _dict_scan_items(job, job->srcs[k]);
+        if (!out->ok) {
+            job->nitems = out->first;
+        }
+        out->n = job->nitems - out->first;
+    }
+}
+
+/*
+ * The characters of a key or scalar span into buf, escapes dropped as
+ * _parse_string() and _parse_value() drop them.
+ */
+static bool
+_span_chars(PyObject *src, const _Span *sp, _Buf *buf) {
+    buf->len = 0;
+    for (Py_ssize_t i = sp->beg; i < sp->end; i++) {
+        Py_UCS4 c = PyUnicode_READ_CHAR(src, i);
+        if ((sp->flags & _SPAN_ESCAPED) && c == '\\' && i + 1 < sp->end) {
+            c = PyUnicode_READ_CHAR(src, ++i);
+        }
+        if (!_buf_push(buf, c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static PyObject *
+_dict_build(_ModState *st, PyObject *src, const _DictItem *items, Py_ssize_t n, _Buf *buf) {
+    PyObject *dict = PyDict_New();
+    for (Py_ssize_t k = 0; dict && k < n; k++) {
+        const _DictItem *item = &items[k];
+        PyObject *key = NULL;
+        PyObject *val = NULL;
+        if (_span_chars(src, &item->key, buf)) {
+            key = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buf->data, buf->len);
+        }
+        if (!key) {
+            // pass
+        } else if (item->type < 0) {
+            Py_ssize_t i = item->val.beg;
+            val = _parse_ovalue(st, &i, src, PyUnicode_GET_LENGTH(src), _C_END_DICT);
+        } else if (_span_chars(src, &item->val, buf)) {
+            val = buf->len ? ucs4_to_obj(buf->data, buf->len, item->type) : PyUnicode_FromString("");
+        }
+        if (!val || PyDict_SetItem(dict, key, val) < 0) {
+            Py_CLEAR(dict);
+        }
+        Py_XDECREF(key);
+        Py_XDECREF(val);
+    }
+    return dict;
+}
+
+static PyObject *
+parse_dict_many(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *items;
+    int threads = 1;
+    static char *kwlist[] = {"items", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$i", kwlist, &items, &threads)) {
+        return NULL;
+    }
+
+    PyObject *seq = _fast_str_items(items);
+    if (!seq) {
+        return NULL;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    PyObject **objs = PySequence_Fast_ITEMS(seq);
+    _DictSpans *spans = PyMem_Malloc((n ? n : 1) * sizeof(_DictSpans));
+    threads = _scan_jobs(threads, n);
+    _DictJob *jobs = PyMem_Calloc(threads, sizeof(_DictJob));
+    if (!spans || !jobs) {
+        PyMem_Free(spans);
+        PyMem_Free(jobs);
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    Py_ssize_t chunk = (n + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        Py_ssize_t beg = t * chunk;
+        Py_ssize_t end = beg + chunk < n ? beg + chunk : n;
+        jobs[t].srcs = objs + beg;
+        jobs[t].n = end > beg ? end - beg : 0;
+        jobs[t].out = spans + beg;
+    }
+
+    PyObject *results = NULL;
+    if (_scan_threads(_dict_scan, jobs, sizeof(_DictJob), threads)) {
+        results = PyList_New(n);
+    }
+    _Buf buf;
+    _buf_init(&buf);
+    for (Py_ssize_t k = 0; results && k < n; k++) {
+        const _DictJob *job = &jobs[k / chunk];
+        PyObject *dict;
+        if (spans[k].ok) {
+            dict = _dict_build(st, objs[k], job->items + spans[k].first, spans[k].n, &buf);
+        } else {
+            Py_ssize_t i = 0;
+            dict = PyDict_New();
+            if (dict && !_parse_dict(st, &i, objs[k], PyUnicode_GET_LENGTH(objs[k]), dict, '{', '}', false)) {
+                Py_CLEAR(dict);
+            }
+        }
+        if (!dict) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, k, dict);
+    }
+
+    _buf_free(&buf);
+    for (int t = 0; t < threads; t++) {
+        PyMem_RawFree(jobs[t].items);
+    }
+    PyMem_Free(jobs);
+    PyMem_Free(spans);
+    Py_DECREF(seq);
+    return results;
+}
+
+/*
+ * CSV
+ *
+ * A row is scanned once into field spans (no objects), then each span is
+ * converted. Quoted spans exclude the quotes.
+ */
+
+static void
+_spans_init(_Spans *spans) {
+    spans->data = NULL;
+    spans->len = 0;
+    spans->size = 0;
+    spans->nogil = false;
+}
+
+static void
+_spans_free(_Spans *spans) {
+    PyMem_RawFree(spans->data);
+    _spans_init(spans);
+}
+
+static bool
+_spans_reserve(_Spans *spans, size_t n) {
+    if (spans->len + n > spans->size) {
+        size_t size = spans->size ? spans->size * 2 : 32;
+        while (size < spans->len + n) {
+            size *= 2;
+        }
+        _Span *data = PyMem_RawRealloc(spans->data, size * sizeof(_Span));
+        if (!data) {
+            if (!spans->nogil) {
+                PyErr_NoMemory();
+            }
+            return false;
+        }
+        spans->data = data;
+        spans->size = size;
+    }
+    return true;
+}
+
+static bool
+_spans_push(_Spans *spans, Py_ssize_t beg, Py_ssize_t end, int flags) {
+    if (spans->len >= spans->size && !_spans_reserve(spans, 1)) {
+        return false;
+    }
+    _Span *sp = &spans->data[spans->len++];
+    sp->beg = beg;
+    sp->end = end;
+    sp->flags = flags;
+    return true;
+}
+
+static Py_ssize_t
+_csv_skip_newline(Py_ssize_t i, const _Src *s, const CsvDialect *d) {
+    Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+    i++;
+    if (c == '\r' && d->crlf && i < s->len && PyUnicode_READ(s->kind, s->data, i) == '\n') {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Scan one row starting at *index into spans. *index is left after the
+ * row terminator. An empty line yields no fields.
+ */
+static bool
+_scan_csv_row(Py_ssize_t *index, const _Src *s, const CsvDialect *d, _Spans *spans) {
+    Py_ssize_t i = *index;
+    const int kind = s->kind;
+    const void *data = s->data;
+    const Py_ssize_t len = s->len;
+    spans->len = 0;
+
+    if (i >= len) {
+        return true;
+    }
+    Py_UCS4 c = PyUnicode_READ(kind, data, i);
+    if (_CSV_CLS(d, c) & _CSV_NEWLINE) {
+        *index = _csv_skip_newline(i, s, d);
+        return true;
+    }
+
+    for (;;) {
+        Py_ssize_t beg, end;
+        int flags = 0;
+
+        if (d->skip_initial_space) {
+            while (i < len && (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_SPACE)) {
+                i++;
+            }
+        }
+
+        if (i < len && (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_QUOTE)) {
+            Py_UCS4 quote = PyUnicode_READ(kind, data, i);
+            flags |= _SPAN_QUOTED;
+            beg = ++i;
+            for (; i < len; i++) {
+                c = PyUnicode_READ(kind, data, i);
+                if (c == quote) {
+                    if (d->doublequote && i+1 < len && PyUnicode_READ(kind, data, i+1) == quote) {
+                        flags |= _SPAN_ESCAPED;
+                        i++;
+                        continue;
+                    }
+                    break;
+                } else if (_CSV_CLS(d, c) & _CSV_ESCAPE) {
+                    flags |= _SPAN_ESCAPED;
+                    i++;
+                }
+            }
+            if (i > len) {
+                i = len;
+            }
+            end = i;
+            if (i < len) {
+                i++;
+            }
+            // spaces between the closing quote and the separator are dropped,
+            // other text is kept as the csv module does; the span then takes
+            // in the closing quote, which _csv_field_to_str drops
+            bool text = false;
+            while (i < len && !(_CSV_CLS(d, c = PyUnicode_READ(kind, data, i)) & (_CSV_SEP | _CSV_NEWLINE))) {
+                text |= !(_CSV_CLS(d, c) & _CSV_SPACE);
+                i++;
+            }
+            if (text) {
+                flags |= _SPAN_ESCAPED;
+                end = i;
+            }
+        } else {
+            beg = i;
+            while (i < len && !(_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & (_CSV_SEP | _CSV_NEWLINE))) {
+                i++;
+            }
+            end = i;
+            if (d->skip_initial_space) {
+                while (end > beg && (_CSV_CLS(d, PyUnicode_READ(kind, data, end-1)) & _CSV_SPACE)) {
+                    end--;
+                }
+            }
+        }
+
+        if (!_spans_push(spans, beg, end, flags)) {
+            return false;
+        }
+
+        if (i >= len) {
+            break;
+        }
+        c = PyUnicode_READ(kind, data, i);
+        if (_CSV_CLS(d, c) & _CSV_SEP) {
+            i++;
+            continue;
+        }
+        i = _csv_skip_newline(i, s, d);
+        break;
+    }
+
+    *index = i;
+    return true;
+}
+
+/*
+ * Skip one row without building spans and return the index after its
+ * terminator. *empty is set for a line without fields.
+ */
+static Py_ssize_t
+_csv_next_row(const _Src *s, const CsvDialect *d, Py_ssize_t i, bool *empty) {
+    const int kind = s->kind;
+    const void *data = s->data;
+    const Py_ssize_t len = s->len;
+
+    *empty = i >= len || (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_NEWLINE);
+    if (i >= len) {
+        return len;
+    } else if (*empty) {
+        return _csv_skip_newline(i, s, d);
+    }
+
+    for (;;) {
+        if (d->skip_initial_space) {
+            while (i < len && (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_SPACE)) {
+                i++;
+            }
+        }
+        if (i < len && (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_QUOTE)) {
+            Py_UCS4 quote = PyUnicode_READ(kind, data, i);
+            for (i++; i < len; i++) {
+                Py_UCS4 c = PyUnicode_READ(kind, data, i);
+                if (c == quote) {
+                    if (d->doublequote && i+1 < len && PyUnicode_READ(kind, data, i+1) == quote) {
+                        i++;
+                        continue;
+                    }
+                    break;
+                } else if (_CSV_CLS(d, c) & _CSV_ESCAPE) {
+                    i++;
+                }
+            }
+            if (i >= len) {
+                return len;
+            }
+            i++;
+        }
+        while (i < len && !(_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & (_CSV_SEP | _CSV_NEWLINE))) {
+            i++;
+        }
+        if (i >= len) {
+            return len;
+        }
+        if (_CSV_CLS(d, PyUnicode_READ(kind, data, i)) & _CSV_SEP) {
+            i++;
+            continue;
+        }
+        return _csv_skip_newline(i, s, d);
+    }
+}
+
+/*
+ * Classify a field as _INT (optional sign and ASCII digits), _FLOAT
+ * (the same with one '.') or _STR.
+ */
+static int
+_span_type(const _Src *s, Py_ssize_t beg, Py_ssize_t end) {
+    int type = _INT;
+    bool digit = false;
+
+    if (beg < end) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, beg);
+        if (c == '-' || c == '+') {
+            beg++;
+        }
+    }
+    for (Py_ssize_t i = beg; i < end; i++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+        if (c >= '0' && c <= '9') {
+            digit = true;
+        } else if (c == '.' && type == _INT) {
+            type = _FLOAT;
+        } else {
+            return _STR;
+        }
+    }
+
+    return digit ? type : _STR;
+}
+
+/*
+ * Convert an _INT span of at most 18 digits without creating objects.
+ * Returns false if the span is longer.
+ */
+static bool
+_span_ll(const _Src *s, Py_ssize_t beg, Py_ssize_t end, long long *value) {
+    bool neg = false;
+    Py_UCS4 c = PyUnicode_READ(s->kind, s->data, beg);
+
+    if (c == '-' || c == '+') {
+        neg = c == '-';
+        beg++;
+    }
+    if (end - beg > 18) {
+        return false;
+    }
+    *value = 0;
+    for (Py_ssize_t i = beg; i < end; i++) {
+        *value = *value * 10 + (PyUnicode_READ(s->kind, s->data, i) - '0');
+    }
+    if (neg) {
+        *value = -*value;
+    }
+    return true;
+}
+
+static PyObject *
+_span_to_str(const _Src *s, Py_ssize_t beg, Py_ssize_t end) {
+    return PyUnicode_FromKindAndData(s->kind, (const char *) s->data + beg * s->kind, end - beg);
+}
+
+/*
+ * Parse a span as a float. Returns 1 on success, 0 if the text is not a
+ * float (no exception set) and -1 on error.
+ */
+static int
+_span_to_double(const _Src *s, Py_ssize_t beg, Py_ssize_t end, double *value) {
+    #undef _BUF_SIZE
+    #define _BUF_SIZE 64
+    char buf[_BUF_SIZE];
+    Py_ssize_t n = end - beg;
+
+    if (n == 0 || n >= _BUF_SIZE) {
+        if (n == 0) {
+            return 0;
+        }
+        PyObject *o = _span_to_str(s, beg, end);
+        if (!o) {
+            return -1;
+        }
+        PyObject *f = PyFloat_FromString(o);
+        Py_DECREF(o);
+        if (!f) {
+            if (PyErr_ExceptionMatches(PyExc_ValueError)) {
+                PyErr_Clear();
+                return 0;
+            }
+            return -1;
+        }
+        *value = PyFloat_AS_DOUBLE(f);
+        Py_DECREF(f);
+        return 1;
+    }
+
+    for (Py_ssize_t i = 0; i < n; i++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, beg + i);
+        if (c >= 128) {
+            return 0;
+        }
+        buf[i] = (char) c;
+    }
+    buf[n] = '\0';
+    *value = PyOS_string_to_double(buf, NULL, NULL);
+    if (*value == -1.0 && PyErr_Occurred()) {
+        if (PyErr_ExceptionMatches(PyExc_ValueError)) {
+            PyErr_Clear();
+            return 0;
+        }
+        return -1;
+    }
+    return 1;
+}
+
+static PyObject *
+_span_to_number(const _Src *s, Py_ssize_t beg, Py_ssize_t end, int type) {
+    if (type == _INT) {
+        long long value;
+        if (_span_ll(s, beg, end, &value)) {
+            _STAT_INC(ints);
+            return PyLong_FromLongLong(value);
+        }
+        _STAT_INC(numeric_fallbacks);
+        PyObject *o = _span_to_str(s, beg, end);
+        if (!o) {
+            return NULL;
+        }
+        PyObject *n = PyLong_FromUnicodeObject(o, 10);
+        Py_DECREF(o);
+        return n;
+    }
+
+    double value;
+    int r = _span_to_double(s, beg, end, &value);
+    if (r <= 0) {
+        if (r == 0) {
+            PyErr_SetString(PyExc_ValueError, "could not convert string to float");
+        }
+        return NULL;
+    }
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject *
+_csv_field_to_str(const _Src *s, const _Span *sp, const CsvDialect *d, _Buf *buf) {
+    if (sp->flags & _SPAN_ESCAPED) {
+        bool quoted = sp->flags & _SPAN_QUOTED;
+        buf->len = 0;
+        for (Py_ssize_t i = sp->beg; i < sp->end; i++) {
+            Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+            if ((_CSV_CLS(d, c) & _CSV_ESCAPE) && i+1 < sp->end) {
+                c = PyUnicode_READ(s->kind, s->data, ++i);
+            } else if (quoted && c == d->quote) {
+                if (d->doublequote && i+1 < sp->end && PyUnicode_READ(s->kind, s->data, i+1) == c) {
+                    i++;  // a doubled quote
+                } else {
+                    quoted = false;  // the closing quote, the rest is literal
+                    continue;
+                }
+            }
+            if (!_buf_push(buf, c)) {
+                return NULL;
+            }
+        }
+        return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buf->data, buf->len);
+    }
+
+    return _span_to_str(s, sp->beg, sp->end);
+}
+
+static PyObject *
+_csv_field_to_obj(const _Src *s, const _Span *sp, const CsvDialect *d, _Buf *buf) {
+    if (d->typed && !(sp->flags & _SPAN_QUOTED)) {
+        int type = _span_type(s, sp->beg, sp->end);
+        if (type != _STR) {
+            return _span_to_number(s, sp->beg, sp->end, type);
+        }
+    }
+
+    return _csv_field_to_str(s, sp, d, buf);
+}
+
+/*
+ * Column selection and row predicates
+ *
+ * Only the selected columns and the predicate column are ever converted;
+ * the other fields of a row are just delimited by the span scan. The
+ * predicate is evaluated on the raw field text before any object of the
+ * row is created: str constants compare against the field text, int and
+ * float constants compare numerically and never match a non-numeric
+ * field (except with '!=').
+ */
+
+enum {
+    _OP_EQ,
+    _OP_NE,
+    _OP_LT,
+    _OP_LE,
+    _OP_GT,
+    _OP_GE,
+};
+
+typedef struct {
+    Py_ssize_t *cols;  // NULL selects every column
+    Py_ssize_t ncols;
+    Py_ssize_t where_col;  // -1 without a predicate
+    int where_op;
+    PyObject *where_value;  // borrowed
+    bool where_num;
+    long long where_ll;
+    bool where_is_ll;
+    double where_dbl;
+} _CsvSelect;
+
+static void
+_csv_select_free(_CsvSelect *sel) {
+    PyMem_Free(sel->cols);
+    sel->cols = NULL;
+}
+
+/*
+ * Resolve a column given as an index or, when keys is not NULL, as a
+ * header name.
+ */
+static bool
+_csv_column(PyObject *o, PyObject *keys, Py_ssize_t *col) {
+    if (PyLong_Check(o)) {
+        *col = PyLong_AsSsize_t(o);
+        if (*col == -1 && PyErr_Occurred()) {
+            return false;
+        }
+        if (*col < 0 || (keys && *col >= PyTuple_GET_SIZE(keys))) {
+            PyErr_Format(PyExc_ValueError, "column index %zd out of range", *col);
+            return false;
+        }
+        return true;
+    }
+    if (keys && PyUnicode_Check(o)) {
+        for (Py_ssize_t k = 0; k < PyTuple_GET_SIZE(keys); k++) {
+            int r = PyUnicode_Compare(PyTuple_GET_ITEM(keys, k), o);
+            if (r == 0) {
+                *col = k;
+                return true;
+            } else if (r == -1 && PyErr_Occurred()) {
+                return false;
+            }
+        }
+        PyErr_Format(PyExc_ValueError, "column %R not in header", o);
+        return false;
+    }
+    PyErr_SetString(PyExc_TypeError, keys ? "column must be an int or a header name" : "column must be an int");
+    return false;
+}
+
+static bool
+_csv_select_init(_CsvSelect *sel, PyObject *usecols, PyObject *where, PyObject *keys) {
+    sel->cols = NULL;
+    sel->ncols = 0;
+    sel->where_col = -1;
+
+    if (usecols && usecols != Py_None) {
+        PyObject *seq = PySequence_Fast(usecols, "usecols must be a sequence");
+        if (!seq) {
+            return false;
+        }
+        sel->ncols = PySequence_Fast_GET_SIZE(seq);
+        sel->cols = PyMem_Malloc((sel->ncols ? sel->ncols : 1) * sizeof(Py_ssize_t));
+        if (!sel->cols) {
+            Py_DECREF(seq);
+            PyErr_NoMemory();
+            return false;
+        }
+        for (Py_ssize_t k = 0; k < sel->ncols; k++) {
+            if (!_csv_column(PySequence_Fast_GET_ITEM(seq, k), keys, &sel->cols[k])) {
+                Py_DECREF(seq);
+                _csv_select_free(sel);
+                return false;
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    if (where && where != Py_None) {
+        static const char *ops[] = {"==", "!=", "<", "<=", ">", ">=", NULL};
+        PyObject *ocol, *oop, *value;
+        if (!PyTuple_Check(where) || !PyArg_ParseTuple(where, "OUO;where must be (column, op, value)", &ocol, &oop, &value)) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError, "where must be (column, op, value)");
+            }
+            goto error;
+        }
+        if (!_csv_column(ocol, keys, &sel->where_col)) {
+            goto error;
+        }
+        sel->where_op = -1;
+        for (int k = 0; ops[k]; k++) {
+            if (PyUnicode_CompareWithASCIIString(oop, ops[k]) == 0) {
+                sel->where_op = k;
+            }
+        }
+        if (sel->where_op < 0) {
+            PyErr_Format(PyExc_ValueError, "unknown operator %R", oop);
+            goto error;
+        }
+
+        sel->where_value = value;
+        if (PyUnicode_Check(value)) {
+            sel->where_num = false;
+        } else if (PyLong_Check(value) || PyFloat_Check(value)) {
+            int overflow = 0;
+            sel->where_num = true;
+            sel->where_is_ll = false;
+            if (PyLong_Check(value)) {
+                sel->where_ll = PyLong_AsLongLongAndOverflow(value, &overflow);
+                if (sel->where_ll == -1 && PyErr_Occurred()) {
+                    goto error;
+                }
+                sel->where_is_ll = !overflow;
+            }
+            sel->where_dbl = PyFloat_AsDouble(value);
+            if (sel->where_dbl == -1.0 && PyErr_Occurred()) {
+                goto error;
+            }
+        } else {
+            PyErr_SetString(PyExc_TypeError, "where value must be a str, int or float");
+            goto error;
+        }
+    }
+
+    return true;
+error:
+    sel->where_col = -1;
+    _csv_select_free(sel);
+    return false;
+}
+
+static bool
+_csv_op(int op, int cmp) {
+    switch (op) {
+    case _OP_EQ: return cmp == 0;
+    case _OP_NE: return cmp != 0;
+    case _OP_LT: return cmp < 0;
+    case _OP_LE: return cmp <= 0;
+    case _OP_GT: return cmp > 0;
+    default: return cmp >= 0;
+    }
+}
+
+/*
+ * Return 1 if the row passes the predicate, 0 if not, -1 on error.
+ */
+static int
+_csv_where(const _Src *s, const _Spans *spans, const CsvDialect *d, const _CsvSelect *sel, _Buf *buf) {
+    if (sel->where_col < 0) {
+        return 1;
+    }
+    if ((size_t) sel->where_col >= spans->len) {
+        return 0;
+    }
+    const _Span *sp = &spans->data[sel->where_col];
+    int cmp;
+
+    if (!sel->where_num) {
+        if (sp->flags & _SPAN_ESCAPED) {
+            PyObject *o = _csv_field_to_str(s, sp, d, buf);
+            if (!o) {
+                return -1;
+            }
+            cmp = PyUnicode_Compare(o, sel->where_value);
+            Py_DECREF(o);
+            if (cmp == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+        } else {
+            PyObject *v = sel->where_value;
+            int vkind = PyUnicode_KIND(v);
+            const void *vdata = PyUnicode_DATA(v);
+            Py_ssize_t vlen = PyUnicode_GET_LENGTH(v);
+            Py_ssize_t n = sp->end - sp->beg;
+            Py_ssize_t k;
+            cmp = 0;
+            for (k = 0; k < n && k < vlen; k++) {
+                Py_UCS4 a = PyUnicode_READ(s->kind, s->data, sp->beg + k);
+                Py_UCS4 b = PyUnicode_READ(vkind, vdata, k);
+                if (a != b) {
+                    cmp = a < b ? -1 : 1;
+                    break;
+                }
+            }
+            if (cmp == 0) {
+                cmp = n < vlen ? -1 : n > vlen;
+            }
+        }
+        return _csv_op(sel->where_op, cmp);
+    }
+
+    int type = _span_type(s, sp->beg, sp->end);
+    if (type == _STR || (!sel->where_is_ll && Py_IS_NAN(sel->where_dbl))) {
+        return sel->where_op == _OP_NE;
+    }
+    long long ivalue;
+    if (type == _INT && _span_ll(s, sp->beg, sp->end, &ivalue)) {
+        if (sel->where_is_ll) {
+            cmp = ivalue < sel->where_ll ? -1 : ivalue > sel->where_ll;
+            return _csv_op(sel->where_op, cmp);
+        }
+        double dvalue = (double) ivalue;
+        cmp = dvalue < sel->where_dbl ? -1 : dvalue > sel->where_dbl;
+        return _csv_op(sel->where_op, cmp);
+    }
+
+    double value;
+    int r = _span_to_double(s, sp->beg, sp->end, &value);
+    if (r <= 0) {
+        return r < 0 ? -1 : sel->where_op == _OP_NE;
+    }
+    cmp = value < sel->where_dbl ? -1 : value > sel->where_dbl;
+    return _csv_op(sel->where_op, cmp);
+}
+
+/*
+ * ISO 8601 / RFC 3339 timestamps
+ *
+ * YYYY-MM-DD, optionally followed by 'T' or ' ' and HH:MM[:SS[.fff]],
+ * optionally followed by 'Z' or an offset +HH:MM, +HHMM or +HH. Digits
+ * after the sixth fractional digit are truncated. Timezone objects for
+ * offsets are created once and cached.
+ */
+
+typedef struct {
+    int year, month, day;
+    int hour, minute, second, usecond;
+    bool aware;
+    int offset;  // minutes east of UTC
+} _DateTime;
+
+static int
+_span_digits(const _Src *s, Py_ssize_t *i, Py_ssize_t end, int n) {
+    int value = 0;
+
+    if (end - *i < n) {
+        return -1;
+    }
+    for (int k = 0; k < n; k++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, *i + k);
+        if (c < '0' || c > '9') {
+            return -1;
+        }
+        value = value * 10 + (int) (c - '0');
+    }
+    *i += n;
+    return value;
+}
+
+static int
+_days_in_month(int year, int month) {
+    static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (month == 2 && (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))) {
+        return 29;
+    }
+    return days[month - 1];
+}
+
+static bool
+_span_to_datetime(const _Src *s, Py_ssize_t beg, Py_ssize_t end, _DateTime *dt) {
+    Py_ssize_t i = beg;
+    memset(dt, 0, sizeof(*dt));
+
+    #define _READ(k) PyUnicode_READ(s->kind, s->data, (k))
+    if ((dt->year = _span_digits(s, &i, end, 4)) < 1 ||
+        i >= end || _READ(i++) != '-' ||
+        (dt->month = _span_digits(s, &i, end, 2)) < 1 || dt->month > 12 ||
+        i >= end || _READ(i++) != '-' ||
+        (dt->day = _span_digits(s, &i, end, 2)) < 1 || dt->day > _days_in_month(dt->year, dt->month)) {
+        return false;
+    }
+    if (i == end) {
+        return true;
+    }
+
+    Py_UCS4 c = _READ(i++);
+    if (c != 'T' && c != 't' && c != ' ') {
+        return false;
+    }
+    if ((dt->hour = _span_digits(s, &i, end, 2)) < 0 || dt->hour > 23 ||
+        i >= end || _READ(i++) != ':' ||
+        (dt->minute = _span_digits(s, &i, end, 2)) < 0 || dt->minute > 59) {
+        return false;
+    }
+    if (i < end && _READ(i) == ':') {
+        i++;
+        if ((dt->second = _span_digits(s, &i, end, 2)) < 0 || dt->second > 59) {
+            return false;
+        }
+        if (i < end && (_READ(i) == '.' || _READ(i) == ',')) {
+            int n = 0;
+            for (i++; i < end && _READ(i) >= '0' && _READ(i) <= '9'; i++, n++) {
+                if (n < 6) {
+                    dt->usecond = dt->usecond * 10 + (int) (_READ(i) - '0');
+                }
+            }
+            if (n == 0) {
+                return false;
+            }
+            for (; n < 6; n++) {
+                dt->usecond *= 10;
+            }
+        }
+    }
+    if (i == end) {
+        return true;
+    }
+
+    c = _READ(i++);
+    if ((c == 'Z' || c == 'z') && i == end) {
+        dt->aware = true;
+        return true;
+    }
+    if (c != '+' && c != '-') {
+        return false;
+    }
+    int hours = _span_digits(s, &i, end, 2);
+    int minutes = 0;
+    if (hours < 0 || hours > 23) {
+        return false;
+    }
+    if (i < end && _READ(i) == ':') {
+        i++;
+    }
+    if (i < end && (minutes = _span_digits(s, &i, end, 2)) < 0) {
+        return false;
+    }
+    if (i != end || minutes > 59) {
+        return false;
+    }
+    #undef _READ
+
+    dt->aware = true;
+    dt->offset = (hours * 60 + minutes) * (c == '-' ? -1 : 1);
+    return true;
+}
+
+static PyObject *
+_tz_from_offset(_ModState *st, int offset) {
+    if (offset == 0) {
+        return Py_NewRef(st->datetime->TimeZone_UTC);
+    }
+
+    PyObject *tz = NULL;
+#ifdef Py_GIL_DISABLED
+    PyMutex_Lock(&st->tz_lock);
+#endif
+    PyObject **slot = &st->tz_cache[offset + 24 * 60];
+    if (!*slot) {
+        PyObject *delta = st->datetime->Delta_FromDelta(0, offset * 60, 0, 1, st->datetime->DeltaType);
+        if (delta) {
+            *slot = st->datetime->TimeZone_FromTimeZone(delta, NULL);
+            Py_DECREF(delta);
+        }
+    }
+    tz = Py_XNewRef(*slot);
+#ifdef Py_GIL_DISABLED
+    PyMutex_Unlock(&st->tz_lock);
+#endif
+    return tz;
+}
+
+static PyObject *
+_datetime_to_obj(_ModState *st, const _DateTime *dt) {
+    PyObject *tz = Py_None;
+
+    if (dt->aware) {
+        tz = _tz_from_offset(st, dt->offset);
+        if (!tz) {
+            return NULL;
+        }
+    }
+
+    PyObject *o = st->datetime->DateTime_FromDateAndTime(
+        dt->year, dt->month, dt->day, dt->hour, dt->minute, dt->second, dt->usecond,
+        tz, st->datetime->DateTimeType);
+    if (dt->aware) {
+        Py_DECREF(tz);
+    }
+    return o;
+}
+
+/*
+ * Microseconds since 1970-01-01T00:00:00Z. Naive timestamps are taken
+ * as UTC.
+ */
+static long long
+_datetime_to_epoch_us(const _DateTime *dt) {
+    // days from civil, proleptic Gregorian calendar
+    long long y = dt->year - (dt->month <= 2);
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    long long yoe = y - era * 400;
+    long long doy = (153 * (dt->month + (dt->month > 2 ? -3 : 9)) + 2) / 5 + dt->day - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long long days = era * 146097 + doe - 719468;
+
+    long long seconds = days * 86400 + dt->hour * 3600 + dt->minute * 60 + dt->second;
+    seconds -= (long long) dt->offset * 60;
+    return seconds * 1000000 + dt->usecond;
+}
+
+/*
+ * Schemas
+ *
+ * A column dtype is enforced in C. _DT_AUTO keeps the dialect typing;
+ * the other dtypes never fall back to another type: a cell that does
+ * not convert is a bad cell, which either raises ValueError or, when a
+ * bad_cells list is given, is appended to it as (row, column, text) and
+ * replaced by None. Empty cells of a numeric column are None.
+ */
+
+enum {
+    _DT_AUTO,
+    _DT_STR,
+    _DT_INT,
+    _DT_FLOAT,
+    _DT_DATETIME,
+    _DT_TIMESTAMP,  // int microseconds since the epoch
+};
+
+static const char *_dt_names[] = {"auto", "str", "int", "float", "datetime", "timestamp_us"};
+
+static bool
+_csv_dtype(_ModState *st, PyObject *o, unsigned char *dt) {
+    if (o == Py_None) {
+        *dt = _DT_AUTO;
+    } else if (o == (PyObject *) &PyUnicode_Type) {
+        *dt = _DT_STR;
+    } else if (o == (PyObject *) &PyLong_Type) {
+        *dt = _DT_INT;
+    } else if (o == (PyObject *) &PyFloat_Type) {
+        *dt = _DT_FLOAT;
+    } else if (o == (PyObject *) st->datetime->DateTimeType) {
+        *dt = _DT_DATETIME;
+    } else {
+        for (unsigned char k = 0; k < sizeof(_dt_names) / sizeof(_dt_names[0]); k++) {
+            if (PyUnicode_Check(o) && PyUnicode_CompareWithASCIIString(o, _dt_names[k]) == 0) {
+                *dt = k;
+                return true;
+            }
+        }
+        PyErr_Format(PyExc_TypeError, "unsupported dtype %R", o);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * State of one CSV call: dialect, selection, schema and the scratch
+ * buffers reused for every row.
+ */
+typedef struct {
+    _ModState *st;
+    const CsvDialect *d;
+    _CsvSelect sel;
+    unsigned char *dtypes;  // per column, NULL if every column is _DT_AUTO
+    Py_ssize_t ndtypes;
+    PyObject *bad_cells;  // borrowed list or NULL to raise
+    PyObject *keys;  // header keys of records or NULL
+    Py_ssize_t row;  // row reported for bad cells
+    int on_error;  // _ON_ERROR_*
+    PyObject *errors;  // borrowed list with on_error='collect'
+    _Spans spans;
+    _Buf buf;
+} _CsvParser;
+
+static void
+_csv_parser_init(_CsvParser *p, _ModState *st, const CsvDialect *d) {
+    memset(p, 0, sizeof(*p));
+    p->st = st;
+    p->d = d;
+    p->sel.where_col = -1;
+    _spans_init(&p->spans);
+    _buf_init(&p->buf);
+}
+
+static void
+_csv_parser_free(_CsvParser *p) {
+    _csv_select_free(&p->sel);
+    PyMem_Free(p->dtypes);
+    p->dtypes = NULL;
+    Py_CLEAR(p->keys);
+    _spans_free(&p->spans);
+    _buf_free(&p->buf);
+}
+
+static bool
+_csv_parser_set_bad_cells(_CsvParser *p, PyObject *bad_cells) {
+    if (bad_cells == Py_None) {
+        return true;
+    }
+    if (!PyList_Check(bad_cells)) {
+        PyErr_SetString(PyExc_TypeError, "bad_cells must be a list");
+        return false;
+    }
+    p->bad_cells = bad_cells;
+    return true;
+}
+
+static bool
+_csv_parser_grow_dtypes(_CsvParser *p, Py_ssize_t n) {
+    if (n <= p->ndtypes) {
+        return true;
+    }
+    unsigned char *dtypes = PyMem_Realloc(p->dtypes, n);
+    if (!dtypes) {
+        PyErr_NoMemory();
+        return false;
+    }
+    memset(dtypes + p->ndtypes, _DT_AUTO, n - p->ndtypes);
+    p->dtypes = dtypes;
+    p->ndtypes = n;
+    return true;
+}
+
+/*
+ * dtypes is a sequence of dtypes by position or a mapping from column
+ * (index or header name) to dtype.
+ */
+static bool
+_csv_parser_set_dtypes(_CsvParser *p, PyObject *dtypes) {
+    if (dtypes == Py_None) {
+        return true;
+    }
+
+    if (PyDict_Check(dtypes)) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(dtypes, &pos, &key, &value)) {
+            Py_ssize_t col;
+            unsigned char dt;
+            if (!_csv_column(key, p->keys, &col) || !_csv_dtype(p->st, value, &dt) ||
+                !_csv_parser_grow_dtypes(p, col + 1)) {
+                return false;
+            }
+            p->dtypes[col] = dt;
+        }
+        return true;
+    }
+
+    PyObject *seq = PySequence_Fast(dtypes, "dtypes must be a dict or a sequence");
+    if (!seq) {
+        return false;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (!_csv_parser_grow_dtypes(p, n)) {
+        Py_DECREF(seq);
+        return false;
+    }
+    for (Py_ssize_t k = 0; k < n; k++) {
+        if (!_csv_dtype(p->st, PySequence_Fast_GET_ITEM(seq, k), &p->dtypes[k])) {
+            Py_DECREF(seq);
+            return false;
+        }
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+/*
+ * Infer the dtype of every column left _DT_AUTO from up to nrows rows
+ * starting at index: int if every non-empty cell is an int, float if
+ * every one is numeric, datetime if every one is a timestamp, str
+ * otherwise.
+ */
+static bool
+_csv_parser_infer(_CsvParser *p, const _Src *s, Py_ssize_t index, Py_ssize_t nrows) {
+    enum { CAN_INT = 1, CAN_FLOAT = 2, CAN_DATETIME = 4, SEEN = 8 };
+    unsigned char *seen = NULL;
+    Py_ssize_t nseen = 0;
+    bool ret = false;
+
+    for (Py_ssize_t row = 0; row < nrows && index < s->len; ) {
+        if (!_scan_csv_row(&index, s, p->d, &p->spans)) {
+            goto done;
+        }
+        if (!p->spans.len) {
+            continue;
+        }
+        row++;
+        if ((Py_ssize_t) p->spans.len > nseen) {
+            unsigned char *tmp = PyMem_Realloc(seen, p->spans.len);
+            if (!tmp) {
+                PyErr_NoMemory();
+                goto done;
+            }
+            memset(tmp + nseen, CAN_INT | CAN_FLOAT | CAN_DATETIME, p->spans.len - nseen);
+            seen = tmp;
+            nseen = p->spans.len;
+        }
+        for (size_t k = 0; k < p->spans.len; k++) {
+            const _Span *sp = &p->spans.data[k];
+            if (sp->beg == sp->end) {
+                continue;
+            }
+            seen[k] |= SEEN;
+            if (sp->flags & _SPAN_ESCAPED) {
+                seen[k] &= ~(CAN_INT | CAN_FLOAT | CAN_DATETIME);
+                continue;
+            }
+            if (seen[k] & CAN_DATETIME) {
+                _DateTime value;
+                if (!_span_to_datetime(s, sp->beg, sp->end, &value)) {
+                    seen[k] &= ~CAN_DATETIME;
+                }
+            }
+            int type = _span_type(s, sp->beg, sp->end);
+            if (type != _INT) {
+                seen[k] &= ~CAN_INT;
+            }
+            if (type == _STR && (seen[k] & CAN_FLOAT)) {
+                double value;
+                int r = _span_to_double(s, sp->beg, sp->end, &value);
+                if (r < 0) {
+                    goto done;
+                } else if (r == 0) {
+                    seen[k] &= ~CAN_FLOAT;
+                }
+            }
+        }
+    }
+
+    if (!_csv_parser_grow_dtypes(p, nseen)) {
+        goto done;
+    }
+    for (Py_ssize_t k = 0; k < nseen; k++) {
+        if (p->dtypes[k] != _DT_AUTO) {
+            continue;
+        }
+        if (!(seen[k] & SEEN)) {
+            p->dtypes[k] = _DT_STR;
+        } else if (seen[k] & CAN_INT) {
+            p->dtypes[k] = _DT_INT;
+        } else if (seen[k] & CAN_FLOAT) {
+            p->dtypes[k] = _DT_FLOAT;
+        } else if (seen[k] & CAN_DATETIME) {
+            p->dtypes[k] = _DT_DATETIME;
+        } else {
+            p->dtypes[k] = _DT_STR;
+        }
+    }
+
+    ret = true;
+done:
+    PyMem_Free(seen);
+    return ret;
+}
+
+static PyObject *
+_csv_bad_cell(_CsvParser *p, const _Src *s, Py_ssize_t col, unsigned char dt) {
+    const _Span *sp = &p->spans.data[col];
+    PyObject *text = _csv_field_to_str(s, sp, p->d, &p->buf);
+    if (!text) {
+        return NULL;
+    }
+    PyObject *column = p->keys ? Py_NewRef(PyTuple_GET_ITEM(p->keys, col)) : PyLong_FromSsize_t(col);
+    if (!column) {
+        Py_DECREF(text);
+        return NULL;
+    }
+
+    if (!p->bad_cells) {
+        PyErr_Format(PyExc_ValueError, "row %zd, column %R: cannot convert %R to %s",
+            p->row, column, text, _dt_names[dt]);
+        Py_DECREF(column);
+        Py_DECREF(text);
+        return NULL;
+    }
+
+    PyObject *cell = Py_BuildValue("(nNN)", p->row, column, text);
+    if (!cell) {
+        return NULL;
+    }
+    int r = PyList_Append(p->bad_cells, cell);
+    Py_DECREF(cell);
+    if (r < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * Convert the cell at column col of the current row.
+ */
+static PyObject *
+_csv_cell(_CsvParser *p, const _Src *s, Py_ssize_t col) {
+    const _Span *sp = &p->spans.data[col];
+    unsigned char dt = col < p->ndtypes ? p->dtypes[col] : _DT_AUTO;
+
+    switch (dt) {
+    case _DT_AUTO:
+        return _csv_field_to_obj(s, sp, p->d, &p->buf);
+    case _DT_STR:
+        return _csv_field_to_str(s, sp, p->d, &p->buf);
+    }
+
+    if (sp->beg == sp->end) {
+        Py_RETURN_NONE;
+    }
+    if (sp->flags & _SPAN_ESCAPED) {
+        return _csv_bad_cell(p, s, col, dt);
+    }
+
+    if (dt == _DT_DATETIME || dt == _DT_TIMESTAMP) {
+        _DateTime value;
+        if (!_span_to_datetime(s, sp->beg, sp->end, &value)) {
+            return _csv_bad_cell(p, s, col, dt);
+        }
+        if (dt == _DT_DATETIME) {
+            return _datetime_to_obj(p->st, &value);
+        }
+        return PyLong_FromLongLong(_datetime_to_epoch_us(&value));
+    }
+
+    int type = _span_type(s, sp->beg, sp->end);
+    if (dt == _DT_INT) {
+        if (type != _INT) {
+            return _csv_bad_cell(p, s, col, dt);
+        }
+        return _span_to_number(s, sp->beg, sp->end, _INT);
+    }
+
+    long long ivalue;
+    if (type == _INT && _span_ll(s, sp->beg, sp->end, &ivalue)) {
+        return PyFloat_FromDouble((double) ivalue);
+    }
+    double value;
+    int r = _span_to_double(s, sp->beg, sp->end, &value);
+    if (r < 0) {
+        return NULL;
+    } else if (r == 0) {
+        return _csv_bad_cell(p, s, col, dt);
+    }
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject *
+_csv_row(_CsvParser *p, const _Src *s) {
+    const _CsvSelect *sel = &p->sel;
+    Py_ssize_t n = sel->cols ? sel->ncols : (Py_ssize_t) p->spans.len;
+    PyObject *lis = PyList_New(n);
+    if (!lis) {
+        return NULL;
+    }
+    for (Py_ssize_t k = 0; k < n; k++) {
+        Py_ssize_t col = sel->cols ? sel->cols[k] : k;
+        PyObject *o;
+        if ((size_t) col < p->spans.len) {
+            o = _csv_cell(p, s, col);
+            if (!o) {
+                Py_DECREF(lis);
+                return NULL;
+            }
+        } else {
+            o = Py_NewRef(Py_None);
+        }
+        PyList_SET_ITEM(lis, k, o);
+    }
+    return lis;
+}
+
+/*
+ * array of n Py_ssize_t values. The array module has no 'n' typecode, so
+ * the typecode of the same width is used ('q' on 64-bit builds). The
+ * array type is imported once.
+ */
+static PyObject *
+_new_ssize_array(_ModState *st, const Py_ssize_t *data, Py_ssize_t n) {
+    const char *typecode = sizeof(Py_ssize_t) == sizeof(long long) ? "q"
+        : sizeof(Py_ssize_t) == sizeof(long) ? "l" : "i";
+    return PyObject_CallFunction(st->array_type, "sy#", typecode,
+        (const char *) data, n * (Py_ssize_t) sizeof(Py_ssize_t));
+}
+
+/*
+ * Offsets of the selected fields as array('q', [beg0, end0, beg1, ...])
+ * plus bytes with the span flags of each field (1 quoted, 2 escaped).
+ * Missing columns are (-1, -1).
+ */
+static PyObject *
+_csv_offsets(_CsvParser *p) {
+    const _CsvSelect *sel = &p->sel;
+    Py_ssize_t n = sel->cols ? sel->ncols : (Py_ssize_t) p->spans.len;
+    Py_ssize_t *pos = PyMem_Malloc((n ? n : 1) * 2 * sizeof(Py_ssize_t));
+    PyObject *flags = PyBytes_FromStringAndSize(NULL, n);
+    if (!pos || !flags) {
+        PyMem_Free(pos);
+        Py_XDECREF(flags);
+        return PyErr_NoMemory();
+    }
+    char *f = PyBytes_AS_STRING(flags);
+    for (Py_ssize_t k = 0; k < n; k++) {
+        Py_ssize_t col = sel->cols ? sel->cols[k] : k;
+        if ((size_t) col < p->spans.len) {
+            const _Span *sp = &p->spans.data[col];
+            pos[2*k] = sp->beg;
+            pos[2*k+1] = sp->end;
+            f[k] = (char) sp->flags;
+        } else {
+            pos[2*k] = pos[2*k+1] = -1;
+            f[k] = 0;
+        }
+    }
+    PyObject *arr = _new_ssize_array(p->st, pos, 2*n);
+    PyMem_Free(pos);
+    if (!arr) {
+        Py_DECREF(flags);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", arr, flags);
+}
+
+/*
+ * Parse one row into *row, which is set to None when the row is
+ * rejected by the predicate.
+ */
+#ifdef PU_STATS
+static void
+_csv_row_stats(const _Spans *spans, Py_ssize_t nchars) {
+    _STAT_ADD(chars_scanned, nchars);
+    _STAT_INC(csv_rows);
+    _STAT_ADD(csv_fields, spans->len);
+    for (size_t k = 0; k < spans->len; k++) {
+        if (spans->data[k].flags & _SPAN_QUOTED) {
+            _STAT_INC(csv_quoted_fields);
+        }
+        if (spans->data[k].flags & _SPAN_ESCAPED) {
+            _STAT_INC(csv_escaped_fields);
+        }
+    }
+}
+#endif
+
+static bool
+_parse_csv_line(Py_ssize_t *index, const _Src *s, _CsvParser *p, PyObject **row, bool offsets) {
+#ifdef PU_STATS
+    Py_ssize_t beg = *index;
+#endif
+    if (!_scan_csv_row(index, s, p->d, &p->spans)) {
+        return false;
+    }
+#ifdef PU_STATS
+    _csv_row_stats(&p->spans, *index - beg);
+#endif
+
+    int r = _csv_where(s, &p->spans, p->d, &p->sel, &p->buf);
+    if (r < 0) {
+        return false;
+    } else if (r == 0) {
+        _STAT_INC(csv_rows_rejected);
+        *row = Py_NewRef(Py_None);
+        return true;
+    }
+
+    *row = offsets ? _csv_offsets(p) : _csv_row(p, s);
+    return *row != NULL;
+}
+
+static CsvDialect _csv_default;
+
+/*
+ * Resolve the dialect of a CSV call. A sep string without a dialect
+ * compiles a temporary dialect into tmp; pass a CsvDialect to skip that.
+ */
+static bool
+_get_csv_dialect(_ModState *st, PyObject *odialect, PyObject *osep, CsvDialect *tmp, const CsvDialect **d) {
+    if (odialect && odialect != Py_None) {
+        if (!PyObject_TypeCheck(odialect, st->CsvDialectType)) {
+            PyErr_SetString(PyExc_TypeError, "dialect must be a CsvDialect");
+            return false;
+        }
+        *d = (const CsvDialect *) odialect;
+        return true;
+    }
+
+    if (!osep || osep == Py_None) {
+        *d = &_csv_default;
+        return true;
+    }
+
+    Py_UCS4 sep;
+    if (!_dialect_char(osep, "sep", false, &sep)) {
+        return false;
+    }
+    if (sep == _csv_default.sep) {
+        *d = &_csv_default;
+        return true;
+    }
+    _csv_dialect_init(tmp, sep);
+    *d = tmp;
+    return true;
+}
+
+static PyObject *
+parse_csv_line(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    Py_ssize_t i;
+    PyObject *src;
+    Py_ssize_t len;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *usecols = Py_None;
+    PyObject *where = Py_None;
+    PyObject *dtypes = Py_None;
+    PyObject *bad_cells = Py_None;
+    int offsets = 0;
+    static char *kwlist[] = {"index", "src", "len", "sep", "dialect", "usecols", "where", "dtypes", "bad_cells", "offsets", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nUn|OO$OOOOp", kwlist,
+        &i, &src, &len, &osep, &odialect, &usecols, &where, &dtypes, &bad_cells, &offsets)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
+        return NULL;
+    }
+
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+    if (!_csv_select_init(&p.sel, usecols, where, NULL) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_set_bad_cells(&p, bad_cells)) {
+        _csv_parser_free(&p);
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, len);
+    p.row = i;
+
+    PyObject *lis = NULL;
+    bool ok = _parse_csv_line(&i, &s, &p, &lis, offsets);
+    bool eof = ok && p.spans.len && i >= s.len &&
+        !(_CSV_CLS(d, PyUnicode_READ(s.kind, s.data, i-1)) & _CSV_NEWLINE);
+    _csv_parser_free(&p);
+    if (!ok) {
+        return NULL;
+    }
+    if (eof) {
+        i = s.len + 1;  // a last row without terminator reports len + 1
+    }
+
+    if (offsets) {
+        // (i, positions, flags), or (i, None, None) for a rejected row
+        PyObject *res = lis == Py_None
+            ? Py_BuildValue("(nOO)", i, Py_None, Py_None)
+            : Py_BuildValue("(nOO)", i, PyTuple_GET_ITEM(lis, 0), PyTuple_GET_ITEM(lis, 1));
+        Py_DECREF(lis);
+        return res;
+    }
+
+    PyObject *tuple = PyTuple_New(2);
+    if (!tuple) {
+        Py_DECREF(lis);
+        return NULL;
+    }
+
+    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
+    PyTuple_SET_ITEM(tuple, 1, lis);
+
+    return tuple;
+}
+
+static PyObject *
+_new_presized_dict(Py_ssize_t n) {
+#if PY_VERSION_HEX < 0x030D0000
+    return _PyDict_NewPresized(n);
+#else
+    (void) n;
+    return PyDict_New();
+#endif
+}
+
+/*
+ * Build one record dict from the current row. The header keys are
+ * shared by every record. Missing fields are None; without usecols,
+ * extra fields are collected into a list under the key None, as
+ * csv.DictReader does.
+ */
+static PyObject *
+_csv_record(_CsvParser *p, const _Src *s) {
+    const _CsvSelect *sel = &p->sel;
+    Py_ssize_t nkeys = sel->cols ? sel->ncols : PyTuple_GET_SIZE(p->keys);
+    PyObject *rec = _new_presized_dict(nkeys);
+    if (!rec) {
+        return NULL;
+    }
+
+    for (Py_ssize_t k = 0; k < nkeys; k++) {
+        Py_ssize_t col = sel->cols ? sel->cols[k] : k;
+        PyObject *o;
+        if ((size_t) col < p->spans.len) {
+            o = _csv_cell(p, s, col);
+            if (!o) {
+                goto error;
+            }
+        } else {
+            o = Py_NewRef(Py_None);
+        }
+        int r = PyDict_SetItem(rec, PyTuple_GET_ITEM(p->keys, col), o);
+        Py_DECREF(o);
+        if (r < 0) {
+            goto error;
+        }
+    }
+
+    if (!sel->cols && p->spans.len > (size_t) nkeys) {
+        PyObject *rest = PyList_New(p->spans.len - nkeys);
+        if (!rest) {
+            goto error;
+        }
+        for (size_t k = nkeys; k < p->spans.len; k++) {
+            PyObject *o = _csv_cell(p, s, k);
+            if (!o) {
+                Py_DECREF(rest);
+                goto error;
+            }
+            PyList_SET_ITEM(rest, k - nkeys, o);
+        }
+        int r = PyDict_SetItem(rec, Py_None, rest);
+        Py_DECREF(rest);
+        if (r < 0) {
+            goto error;
+        }
+    }
+
+    return rec;
+error:
+    Py_DECREF(rec);
+    return NULL;
+}
+
+/*
+ * Read the header, the first non-empty row, into p->keys.
+ */
+static bool
+_csv_parser_header(Py_ssize_t *index, const _Src *s, _CsvParser *p) {
+    while (*index < s->len) {
+        if (!_scan_csv_row(index, s, p->d, &p->spans)) {
+            return false;
+        }
+        if (p->spans.len) {
+            break;
+        }
+    }
+
+    p->keys = PyTuple_New(p->spans.len);
+    if (!p->keys) {
+        return false;
+    }
+    for (size_t k = 0; k < p->spans.len; k++) {
+        PyObject *key = _csv_field_to_str(s, &p->spans.data[k], p->d, &p->buf);
+        if (!key) {
+            return false;
+        }
+        PyUnicode_InternInPlace(&key);
+        PyTuple_SET_ITEM(p->keys, k, key);
+    }
+    return true;
+}
+
+/*
+ * CSV rows on the tape of "GIL-free scanning": every field span of a
+ * block in one list, indexed by row.
+ */
+typedef struct {
+    Py_ssize_t beg;  // offset of the row
+    Py_ssize_t end;  // after its terminator
+    size_t field;  // its first span in the tape
+    size_t nfields;
+} _TapeRow;
+
+typedef struct {
+    _TapeRow *rows;
+    size_t nrows;
+    size_t size;
+    _Spans spans;  // fields of every row
+    _Spans row;  // scratch of _scan_csv_row
+} _CsvTape;
+
+static void
+_csv_tape_init(_CsvTape *t) {
+    memset(t, 0, sizeof(*t));
+    _spans_init(&t->spans);
+    _spans_init(&t->row);
+    t->spans.nogil = t->row.nogil = true;
+}
+
+static void
+_csv_tape_free(_CsvTape *t) {
+    PyMem_RawFree(t->rows);
+    _spans_free(&t->spans);
+    _spans_free(&t->row);
+}
+
+/*
+ * Scan the non-empty rows from *index until a block is passed, max_rows
+ * are taken or the input ends. Unless final, a row that runs into the end
+ * of s is left at *index. Needs no GIL; returns false out of memory.
+ */
+static bool
+_csv_tape_scan(_CsvTape *t, Py_ssize_t *index, const _Src *s, const CsvDialect *d, Py_ssize_t max_rows, bool final) {
+    Py_ssize_t i = *index;
+    Py_ssize_t limit = s->len - i > _TAPE_BLOCK ? i + _TAPE_BLOCK : s->len;
+    bool ok = true;
+    t->nrows = 0;
+    t->spans.len = 0;
+
+    while (i < limit && (Py_ssize_t) t->nrows < max_rows) {
+        Py_ssize_t beg = i;
+        if (!_scan_csv_row(&i, s, d, &t->row)) {
+            ok = false;
+            break;
+        }
+        if (!final && i >= s->len) {
+            i = beg;  // the row may go on in the next block
+            break;
+        }
+        if (!t->row.len) {
+            continue;
+        }
+        if (t->nrows >= t->size) {
+            size_t size = t->size ? 2 * t->size : 1024;
+            _TapeRow *rows = PyMem_RawRealloc(t->rows, size * sizeof(_TapeRow));
+            if (!rows) {
+                ok = false;
+                break;
+            }
+            t->rows = rows;
+            t->size = size;
+        }
+        if (!_spans_reserve(&t->spans, t->row.len)) {
+            ok = false;
+            break;
+        }
+        t->rows[t->nrows++] = (_TapeRow) {beg, i, t->spans.len, t->row.len};
+        memcpy(t->spans.data + t->spans.len, t->row.data, t->row.len * sizeof(_Span));
+        t->spans.len += t->row.len;
+    }
+
+    *index = i;
+    return ok;
+}
+
+/*
+ * The next block of rows onto the tape, without the GIL if it is large.
+ */
+static bool
+_csv_tape_fill(_CsvTape *t, Py_ssize_t *index, const _Src *s, const CsvDialect *d, Py_ssize_t max_rows, bool final) {
+    bool ok;
+    if (s->len - *index >= _TAPE_NOGIL_MIN) {
+        Py_BEGIN_ALLOW_THREADS
+        ok = _csv_tape_scan(t, index, s, d, max_rows, final);
+        Py_END_ALLOW_THREADS
+    } else {
+        ok = _csv_tape_scan(t, index, s, d, max_rows, final);
+    }
+    if (!ok) {
+        PyErr_NoMemory();
+    }
+    return ok;
+}
+
+/*
+ * Put row r of the tape in p->spans for the row builders.
+ */
+static bool
+_csv_tape_load(_CsvParser *p, const _CsvTape *t, size_t r) {
+    const _TapeRow *row = &t->rows[r];
+    p->spans.len = 0;
+    if (!_spans_reserve(&p->spans, row->nfields)) {
+        return false;
+    }
+    memcpy(p->spans.data, t->spans.data + row->field, row->nfields * sizeof(_Span));
+    p->spans.len = row->nfields;
+#ifdef PU_STATS
+    _csv_row_stats(&p->spans, row->end - row->beg);
+#endif
+    return true;
+}
+
+/*
+ * Rows from *index on into records. Unless final, a row that runs into
+ * the end of text is left at *index for the next block of a stream.
+ */
+static bool
+_parse_csv_records(Py_ssize_t *index, const _Src *text, _CsvParser *p, PyObject *records, bool final) {
+    Py_ssize_t i = *index;
+    bool ret = false;
+    _CsvTape t;
+    _csv_tape_init(&t);
+    _Src view = *text;
+    const _Src *s = &view;
+    _LineMark mark;
+    _src_mark(&view, &mark);
+
+    while (i < s->len) {
+        Py_ssize_t beg = i;
+        if (!_csv_tape_fill(&t, &i, s, p->d, PY_SSIZE_T_MAX, final)) {
+            goto done;
+        }
+        for (size_t k = 0; k < t.nrows; k++) {
+            if (!_csv_tape_load(p, &t, k)) {
+                i = t.rows[k].beg;
+                goto done;
+            }
+            int r = _csv_where(s, &p->spans, p->d, &p->sel, &p->buf);
+            if (r == 0) {
+                _STAT_INC(csv_rows_rejected);
+            } else if (r > 0) {
+                PyObject *rec = _csv_record(p, s);
+                r = rec ? PyList_Append(records, rec) : -1;
+                Py_XDECREF(rec);
+            }
+            if (r < 0 && !_on_error(p->st, p->on_error, p->errors, s, t.rows[k].beg)) {
+                i = t.rows[k].end;
+                goto done;
+            }
+            p->row++;
+        }
+        if (i == beg) {
+            break;  // only an unfinished row is left
+        }
+    }
+
+    ret = true;
+done:
+    _csv_tape_free(&t);
+    *index = i;
+    return ret;
+}
+
+static PyObject *
+parse_csv_records(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *src;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *usecols = Py_None;
+    PyObject *where = Py_None;
+    PyObject *dtypes = Py_None;
+    Py_ssize_t infer_rows = 0;
+    PyObject *bad_cells = Py_None;
+    PyObject *oon_error = NULL;
+    static char *kwlist[] = {"src", "sep", "dialect", "usecols", "where", "dtypes", "infer_rows", "bad_cells", "on_error", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|OO$OOOnOO", kwlist,
+        &src, &osep, &odialect, &usecols, &where, &dtypes, &infer_rows, &bad_cells, &oon_error)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    int on_error = _ON_ERROR_RAISE;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d) ||
+        (oon_error && !_on_error_mode(oon_error, &on_error))) {
+        return NULL;
+    }
+
+    PyObject *records = PyList_New(0);
+    PyObject *errors = PyList_New(0);
+    if (!records || !errors) {
+        Py_XDECREF(records);
+        Py_XDECREF(errors);
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, PyUnicode_GET_LENGTH(src));
+    Py_ssize_t i = 0;
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+    p.on_error = on_error;
+    p.errors = errors;
+
+    if (!_csv_parser_header(&i, &s, &p) ||
+        !_csv_select_init(&p.sel, usecols, where, p.keys) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_set_bad_cells(&p, bad_cells) ||
+        (infer_rows > 0 && !_csv_parser_infer(&p, &s, i, infer_rows)) ||
+        !_parse_csv_records(&i, &s, &p, records, true)) {
+        Py_CLEAR(records);
+    }
+
+    _csv_parser_free(&p);
+    return _on_error_result(on_error, records, errors);
+}
+
+/*
+ * Row boundaries
+ *
+ * csv_row_starts() finds where every non-empty row begins with the
+ * quote-aware _csv_next_row(), so a quoted field spanning lines stays in
+ * its row and no object is created per row. parse_csv_rows() uses those
+ * offsets, or the same scan, to jump to a row without parsing the rows
+ * before it.
+ */
+
+static bool
+_push_offset(Py_ssize_t **data, size_t *len, size_t *size, Py_ssize_t off) {
+    if (*len >= *size) {
+        size_t n = *size ? *size * 2 : 1024;
+        Py_ssize_t *tmp = PyMem_Realloc(*data, n * sizeof(Py_ssize_t));
+        if (!tmp) {
+            PyErr_NoMemory();
+            return false;
+        }
+        *data = tmp;
+        *size = n;
+    }
+    (*data)[(*len)++] = off;
+    return true;
+}
+
+static PyObject *
+csv_row_starts(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *src;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    static char *kwlist[] = {"src", "sep", "dialect", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|OO", kwlist, &src, &osep, &odialect)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, PyUnicode_GET_LENGTH(src));
+    Py_ssize_t *offsets = NULL;
+    size_t len = 0, size = 0;
+    for (Py_ssize_t i = 0; i < s.len; ) {
+        Py_ssize_t row = i;
+        bool empty;
+        i = _csv_next_row(&s, d, i, &empty);
+        if (!empty && !_push_offset(&offsets, &len, &size, row)) {
+            PyMem_Free(offsets);
+            return NULL;
+        }
+    }
+    if (!_push_offset(&offsets, &len, &size, s.len)) {
+        PyMem_Free(offsets);
+        return NULL;
+    }
+
+    PyObject *arr = _new_ssize_array(st, offsets, len);
+    PyMem_Free(offsets);
+    return arr;
+}
+
+/*
+ * Offset of row n from a row_starts buffer, or by scanning from 0 when
+ * row_starts is NULL. Rows past the end map to the end of src.
+ */
+static bool
+_csv_row_offset(const _Src *s, const CsvDialect *d, const Py_buffer *row_starts, Py_ssize_t n, Py_ssize_t *off) {
+    if (row_starts) {
+        Py_ssize_t nrows = row_starts->len / (Py_ssize_t) sizeof(Py_ssize_t);
+        if (n >= nrows) {
+            *off = s->len;
+            return true;
+        }
+        *off = ((const Py_ssize_t *) row_starts->buf)[n];
+        if (*off < 0 || *off > s->len) {
+            PyErr_SetString(PyExc_ValueError, "row_starts does not match src");
+            return false;
+        }
+        return true;
+    }
+
+    Py_ssize_t i = 0;
+    while (i < s->len) {
+        Py_ssize_t row = i;
+        bool empty;
+        i = _csv_next_row(s, d, i, &empty);
+        if (!empty && n-- == 0) {
+            *off = row;
+            return true;
+        }
+    }
+    *off = s->len;
+    return true;
+}
+
+static PyObject *
+parse_csv_rows(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *src;
+    Py_ssize_t start_row = 0;
+    PyObject *ostop_row = Py_None;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *orow_starts = Py_None;
+    PyObject *usecols = Py_None;
+    PyObject *where = Py_None;
+    PyObject *dtypes = Py_None;
+    PyObject *bad_cells = Py_None;
+    PyObject *oon_error = NULL;
+    static char *kwlist[] = {"src", "start_row", "stop_row", "sep", "dialect",
+        "row_starts", "usecols", "where", "dtypes", "bad_cells", "on_error", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|nOOO$OOOOOO", kwlist,
+        &src, &start_row, &ostop_row, &osep, &odialect,
+        &orow_starts, &usecols, &where, &dtypes, &bad_cells, &oon_error)) {
+        return NULL;
+    }
+    int on_error = _ON_ERROR_RAISE;
+    if (oon_error && !_on_error_mode(oon_error, &on_error)) {
+        return NULL;
+    }
+    Py_ssize_t stop_row = PY_SSIZE_T_MAX;
+    if (ostop_row != Py_None) {
+        stop_row = PyNumber_AsSsize_t(ostop_row, PyExc_OverflowError);
+        if (stop_row == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (start_row < 0 || stop_row < 0) {
+        PyErr_SetString(PyExc_ValueError, "start_row and stop_row must be >= 0");
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
+        return NULL;
+    }
+
+    Py_buffer view;
+    const Py_buffer *row_starts = NULL;
+    if (orow_starts != Py_None) {
+        if (PyObject_GetBuffer(orow_starts, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+            return NULL;
+        }
+        if (view.itemsize != sizeof(Py_ssize_t) || !view.format || !strchr("qln", view.format[0]) || view.format[1]) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_TypeError, "row_starts must be an array returned by csv_row_starts()");
+            return NULL;
+        }
+        row_starts = &view;
+    }
+
+    _Src s;
+    _src_init(&s, src, PyUnicode_GET_LENGTH(src));
+    PyObject *rows = NULL;
+    PyObject *errors = NULL;
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+    p.on_error = on_error;
+    _CsvTape t;
+    _csv_tape_init(&t);
+    Py_ssize_t i;
+
+    if (!_csv_select_init(&p.sel, usecols, where, NULL) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_set_bad_cells(&p, bad_cells) ||
+        !_csv_row_offset(&s, d, row_starts, start_row, &i)) {
+        goto done;
+    }
+
+    rows = PyList_New(0);
+    errors = PyList_New(0);
+    if (!rows || !errors) {
+        Py_CLEAR(rows);
+        goto done;
+    }
+    p.errors = errors;
+    _LineMark mark;
+    _src_mark(&s, &mark);
+    for (p.row = start_row; p.row < stop_row && i < s.len; ) {
+        if (!_csv_tape_fill(&t, &i, &s, d, stop_row - p.row, true)) {
+            Py_CLEAR(rows);
+            goto done;
+        }
+        for (size_t k = 0; k < t.nrows; k++) {
+            if (!_csv_tape_load(&p, &t, k)) {
+                Py_CLEAR(rows);
+                goto done;
+            }
+            int r = _csv_where(&s, &p.spans, d, &p.sel, &p.buf);
+            if (r == 0) {
+                _STAT_INC(csv_rows_rejected);
+            } else if (r > 0) {
+                PyObject *row = _csv_row(&p, &s);
+                r = row ? PyList_Append(rows, row) : -1;
+                Py_XDECREF(row);
+            }
+            if (r < 0 && !_on_error(st, on_error, errors, &s, t.rows[k].beg)) {
+                Py_CLEAR(rows);
+                goto done;
+            }
+            p.row++;
+        }
+    }
+
+done:
+    _csv_tape_free(&t);
+    _csv_parser_free(&p);
+    if (row_starts) {
+        PyBuffer_Release(&view);
+    }
+    return _on_error_result(on_error, rows, errors);
+}
+
+/*
+ * CSV index
+ *
+ * build_csv_index() scans a UTF-8 CSV file once, without creating
+ * objects, and writes a sidecar file:
+ *
+ *     _CsvIndexHeader
+ *     dtypes      ncols bytes
+ *     path        path_size bytes, UTF-8 absolute source path
+ *     keys        keys_size bytes, per column a uint32 length and UTF-8
+ *     padding     to 8 bytes
+ *     offsets     uint64 [nrows + 1], byte offset of every non-empty
+ *                 data row, then the source size
+ *
+ * open_csv_index() maps the index and the source read-only, so row N is
+ * one lookup away and rows are decoded and parsed only when asked for.
+ * The index is rejected when the source size or mtime changed.
+ */
+
+#define _CSV_INDEX_MAGIC "PUCSVIX"
+#define _CSV_INDEX_VERSION 1
+#define _CSV_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t src_size;
+    int64_t src_mtime_ns;
+    uint64_t nrows;
+    uint64_t ncols;
+    uint64_t path_size;
+    uint64_t keys_size;
+    uint32_t sep;
+    uint32_t quote;
+    uint32_t escape;
+    uint32_t line_terminator;
+    uint8_t crlf;
+    uint8_t skip_initial_space;
+    uint8_t typed;
+    uint8_t doublequote;  // 0 in indexes written before doubled quotes
+    uint8_t pad[4];
+} _CsvIndexHeader;
+
+static size_t
+_csv_index_offsets_pos(const _CsvIndexHeader *h) {
+    size_t pos = sizeof(*h) + h->ncols + h->path_size + h->keys_size;
+    return (pos + 7) & ~(size_t) 7;
+}
+
+/*
+ * Map a file read-only through the mmap module. An empty file is not
+ * mapped; *map stays NULL and view is empty.
+ */
+static bool
+_map_file(PyObject *path, PyObject **map, Py_buffer *view) {
+    *map = NULL;
+    memset(view, 0, sizeof(*view));
+
+    PyObject *f = NULL;
+    PyObject *io = PyImport_ImportModule("io");
+    PyObject *mmap = PyImport_ImportModule("mmap");
+    if (!io || !mmap) {
+        goto error;
+    }
+    f = PyObject_CallMethod(io, "open", "Os", path, "rb");
+    if (!f) {
+        goto error;
+    }
+    PyObject *fileno = PyObject_CallMethod(f, "fileno", NULL);
+    if (!fileno) {
+        goto error;
+    }
+    PyObject *st = PyObject_CallMethod(f, "seek", "ii", 0, 2);
+    Py_DECREF(fileno);
+    if (!st) {
+        goto error;
+    }
+    Py_ssize_t size = PyLong_AsSsize_t(st);
+    Py_DECREF(st);
+    if (size < 0) {
+        goto error;
+    }
+    if (size > 0) {
+        fileno = PyObject_CallMethod(f, "fileno", NULL);
+        if (!fileno) {
+            goto error;
+        }
+        PyObject *access = PyObject_GetAttrString(mmap, "ACCESS_READ");
+        if (!access) {
+            Py_DECREF(fileno);
+            goto error;
+        }
+        PyObject *args = Py_BuildValue("(Oi)", fileno, 0);
+        PyObject *kwargs = Py_BuildValue("{sO}", "access", access);
+        PyObject *type = PyObject_GetAttrString(mmap, "mmap");
+        if (args && kwargs && type) {
+            *map = PyObject_Call(type, args, kwargs);
+        }
+        Py_XDECREF(type);
+        Py_XDECREF(kwargs);
+        Py_XDECREF(args);
+        Py_DECREF(access);
+        Py_DECREF(fileno);
+        if (!*map) {
+            goto error;
+        }
+        if (PyObject_GetBuffer(*map, view, PyBUF_SIMPLE) < 0) {
+            Py_CLEAR(*map);
+            goto error;
+        }
+    }
+
+    PyObject *r = PyObject_CallMethod(f, "close", NULL);
+    Py_DECREF(f);
+    Py_DECREF(mmap);
+    Py_DECREF(io);
+    if (!r) {
+        if (*map) {
+            PyBuffer_Release(view);
+            Py_CLEAR(*map);
+        }
+        return false;
+    }
+    Py_DECREF(r);
+    return true;
+
+error:
+    if (f) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        Py_XDECREF(PyObject_CallMethod(f, "close", NULL));
+        PyErr_Restore(type, value, tb);
+        Py_DECREF(f);
+    }
+    Py_XDECREF(mmap);
+    Py_XDECREF(io);
+    return false;
+}
+
+static void
+_unmap_file(PyObject **map, Py_buffer *view) {
+    if (!*map) {
+        return;
+    }
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    PyBuffer_Release(view);
+    PyObject *r = PyObject_CallMethod(*map, "close", NULL);
+    if (r) {
+        Py_DECREF(r);
+    } else {
+        PyErr_WriteUnraisable(*map);
+    }
+    Py_CLEAR(*map);
+    PyErr_Restore(type, value, tb);
+}
+
+/*
+ * Size and mtime of path in nanoseconds, from os.stat().
+ */
+static bool
+_file_stat(PyObject *path, uint64_t *size, int64_t *mtime_ns) {
+    PyObject *os = PyImport_ImportModule("os");
+    if (!os) {
+        return false;
+    }
+    PyObject *st = PyObject_CallMethod(os, "stat", "O", path);
+    Py_DECREF(os);
+    if (!st) {
+        return false;
+    }
+    PyObject *osize = PyObject_GetAttrString(st, "st_size");
+    PyObject *omtime = PyObject_GetAttrString(st, "st_mtime_ns");
+    Py_DECREF(st);
+    bool ok = osize && omtime;
+    if (ok) {
+        *size = PyLong_AsUnsignedLongLong(osize);
+        *mtime_ns = PyLong_AsLongLong(omtime);
+        ok = !PyErr_Occurred();
+    }
+    Py_XDECREF(osize);
+    Py_XDECREF(omtime);
+    return ok;
+}
+
+/*
+ * Growable byte buffer for the index file and the Arrow buffers. It uses
+ * raw memory, so an Arrow release callback can free it without the GIL.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} _Bytes;
+
+static bool
+_bytes_reserve(_Bytes *b, size_t n) {
+    if (b->len + n > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        while (size < b->len + n) {
+            size *= 2;
+        }
+        char *tmp = PyMem_RawRealloc(b->data, size);
+        if (!tmp) {
+            PyErr_NoMemory();
+            return false;
+        }
+        b->data = tmp;
+        b->size = size;
+    }
+    return true;
+}
+
+static bool
+_bytes_write(_Bytes *b, const void *data, size_t n) {
+    if (!_bytes_reserve(b, n)) {
+        return false;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return true;
+}
+
+static bool
+_write_file(PyObject *path, const _Bytes *b) {
+    PyObject *io = PyImport_ImportModule("io");
+    if (!io) {
+        return false;
+    }
+    PyObject *f = PyObject_CallMethod(io, "open", "Os", path, "wb");
+    Py_DECREF(io);
+    if (!f) {
+        return false;
+    }
+    PyObject *view = PyMemoryView_FromMemory(b->data, b->len, PyBUF_READ);
+    PyObject *r = view ? PyObject_CallMethod(f, "write", "O", view) : NULL;
+    Py_XDECREF(view);
+    Py_XDECREF(r);
+    if (!r) {
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        Py_XDECREF(PyObject_CallMethod(f, "close", NULL));
+        PyErr_Restore(type, value, tb);
+        Py_DECREF(f);
+        return false;
+    }
+    r = PyObject_CallMethod(f, "close", NULL);
+    Py_DECREF(f);
+    Py_XDECREF(r);
+    return r != NULL;
+}
+
+static PyObject *
+_abspath(PyObject *path) {
+    PyObject *str = NULL;
+    if (!PyUnicode_FSDecoder(path, &str)) {
+        return NULL;
+    }
+    PyObject *os_path = PyImport_ImportModule("os.path");
+    if (!os_path) {
+        Py_DECREF(str);
+        return NULL;
+    }
+    PyObject *abs = PyObject_CallMethod(os_path, "abspath", "O", str);
+    Py_DECREF(os_path);
+    Py_DECREF(str);
+    return abs;
+}
+
+static PyObject *
+build_csv_index(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *opath;
+    PyObject *out_path;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *dtypes = Py_None;
+    Py_ssize_t infer_rows = 1000;
+    static char *kwlist[] = {"path", "out_path", "sep", "dialect", "dtypes", "infer_rows", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OO$On", kwlist,
+        &opath, &out_path, &osep, &odialect, &dtypes, &infer_rows)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
+        return NULL;
+    }
+    if (d->sep >= 128 || d->quote >= 128 || d->escape >= 128 || d->line_terminator >= 128) {
+        PyErr_SetString(PyExc_ValueError, "an indexed dialect must use ASCII characters");
+        return NULL;
+    }
+
+    PyObject *path = _abspath(opath);
+    if (!path) {
+        return NULL;
+    }
+
+    PyObject *map = NULL;
+    Py_buffer view = {0};
+    PyObject *header = NULL;
+    Py_ssize_t *offsets = NULL;
+    size_t noffsets = 0, offsets_size = 0;
+    _Bytes out = {0};
+    PyObject *ret = NULL;
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+
+    _CsvIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    if (!_file_stat(path, &h.src_size, &h.src_mtime_ns) || !_map_file(path, &map, &view)) {
+        goto done;
+    }
+    _Src s = {
+        .kind = PyUnicode_1BYTE_KIND,
+        .data = view.buf,
+        .len = view.len,
+    };
+
+    // the header row is decoded and parsed as text, the rest as bytes
+    Py_ssize_t i = 0, beg = 0;
+    bool empty = true;
+    while (empty && i < s.len) {
+        beg = i;
+        i = _csv_next_row(&s, d, i, &empty);
+    }
+    header = PyUnicode_DecodeUTF8((const char *) s.data + beg, i - beg, "strict");
+    if (!header) {
+        goto done;
+    }
+    _Src hs;
+    Py_ssize_t hi = 0;
+    _src_init(&hs, header, PyUnicode_GET_LENGTH(header));
+    if (!_csv_parser_header(&hi, &hs, &p) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_infer(&p, &s, i, infer_rows > 0 ? infer_rows : 0) ||
+        !_csv_parser_grow_dtypes(&p, PyTuple_GET_SIZE(p.keys))) {
+        goto done;
+    }
+
+    while (i < s.len) {
+        Py_ssize_t row = i;
+        i = _csv_next_row(&s, d, i, &empty);
+        if (empty) {
+            continue;
+        }
+        if (noffsets >= offsets_size) {
+            size_t size = offsets_size ? offsets_size * 2 : 1024;
+            Py_ssize_t *tmp = PyMem_Realloc(offsets, size * sizeof(Py_ssize_t));
+            if (!tmp) {
+                PyErr_NoMemory();
+                goto done;
+            }
+            offsets = tmp;
+            offsets_size = size;
+        }
+        offsets[noffsets++] = row;
+    }
+
+    memcpy(h.magic, _CSV_INDEX_MAGIC, sizeof(h.magic));
+    h.version = _CSV_INDEX_VERSION;
+    h.byte_order = _CSV_INDEX_BYTE_ORDER;
+    h.nrows = noffsets;
+    h.ncols = PyTuple_GET_SIZE(p.keys);
+    h.sep = d->sep;
+    h.quote = d->quote;
+    h.escape = d->escape;
+    h.line_terminator = d->line_terminator;
+    h.crlf = d->crlf;
+    h.skip_initial_space = d->skip_initial_space;
+    h.typed = d->typed;
+    h.doublequote = d->doublequote;
+
+    Py_ssize_t path_size;
+    const char *upath = PyUnicode_AsUTF8AndSize(path, &path_size);
+    if (!upath) {
+        goto done;
+    }
+    h.path_size = path_size;
+    for (Py_ssize_t k = 0; k < PyTuple_GET_SIZE(p.keys); k++) {
+        Py_ssize_t n;
+        if (!PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(p.keys, k), &n)) {
+            goto done;
+        }
+        h.keys_size += sizeof(uint32_t) + n;
+    }
+
+    if (!_bytes_write(&out, &h, sizeof(h)) ||
+        !_bytes_write(&out, p.dtypes, h.ncols) ||
+        !_bytes_write(&out, upath, path_size)) {
+        goto done;
+    }
+    for (Py_ssize_t k = 0; k < PyTuple_GET_SIZE(p.keys); k++) {
+        Py_ssize_t n;
+        const char *key = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(p.keys, k), &n);
+        uint32_t n32 = (uint32_t) n;
+        if (!_bytes_write(&out, &n32, sizeof(n32)) || !_bytes_write(&out, key, n)) {
+            goto done;
+        }
+    }
+    static const char zeros[8] = {0};
+    if (!_bytes_write(&out, zeros, _csv_index_offsets_pos(&h) - out.len)) {
+        goto done;
+    }
+    for (size_t k = 0; k <= noffsets; k++) {
+        uint64_t off = k < noffsets ? (uint64_t) offsets[k] : (uint64_t) s.len;
+        if (!_bytes_write(&out, &off, sizeof(off))) {
+            goto done;
+        }
+    }
+    if (!_write_file(out_path, &out)) {
+        goto done;
+    }
+
+    ret = PyLong_FromSize_t(noffsets);
+done:
+    _csv_parser_free(&p);
+    _unmap_file(&map, &view);
+    PyMem_RawFree(out.data);
+    PyMem_Free(offsets);
+    Py_XDECREF(header);
+    Py_DECREF(path);
+    return ret;
+}
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *path;  // source path
+    PyObject *index_map;
+    Py_buffer index_view;
+    PyObject *src_map;
+    Py_buffer src_view;
+    const _CsvIndexHeader *h;
+    const unsigned char *dtypes;
+    const uint64_t *offsets;
+    CsvDialect *dialect;
+    PyObject *keys;
+} CsvIndex;
+
+/*
+ * The methods reading the maps hold a critical section on the index, so
+ * on free-threaded builds close() cannot unmap under a running rows().
+ */
+static void
+_csv_index_close(CsvIndex *self) {
+    Py_BEGIN_CRITICAL_SECTION(self);
+    _unmap_file(&self->src_map, &self->src_view);
+    _unmap_file(&self->index_map, &self->index_view);
+    self->h = NULL;
+    Py_END_CRITICAL_SECTION();
+}
+
+static void
+CsvIndex_dealloc(CsvIndex *self) {
+    _csv_index_close(self);
+    Py_XDECREF(self->path);
+    Py_XDECREF(self->dialect);
+    Py_XDECREF(self->keys);
+    PyTypeObject *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static bool
+_csv_index_check(CsvIndex *self) {
+    if (!self->h) {
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed CSV index");
+        return false;
+    }
+    return true;
+}
+
+static bool
+_csv_index_load(_ModState *st, CsvIndex *self, PyObject *index_path) {
+    if (!_map_file(index_path, &self->index_map, &self->index_view)) {
+        return false;
+    }
+    const char *buf = self->index_view.buf;
+    size_t size = self->index_view.len;
+    const _CsvIndexHeader *h = (const _CsvIndexHeader *) buf;
+    if (size < sizeof(*h) || memcmp(h->magic, _CSV_INDEX_MAGIC, sizeof(h->magic)) != 0) {
+        PyErr_Format(PyExc_ValueError, "%R is not a CSV index", index_path);
+        return false;
+    }
+    if (h->version != _CSV_INDEX_VERSION || h->byte_order != _CSV_INDEX_BYTE_ORDER) {
+        PyErr_Format(PyExc_ValueError, "%R was written by an incompatible build", index_path);
+        return false;
+    }
+    size_t pos = _csv_index_offsets_pos(h);
+    if (h->ncols > size || h->path_size > size || h->keys_size > size || h->nrows > size ||
+        pos + (h->nrows + 1) * sizeof(uint64_t) > size) {
+        PyErr_Format(PyExc_ValueError, "%R is truncated", index_path);
+        return false;
+    }
+
+    self->dtypes = (const unsigned char *) buf + sizeof(*h);
+    self->offsets = (const uint64_t *) (buf + pos);
+    self->path = PyUnicode_DecodeUTF8(buf + sizeof(*h) + h->ncols, h->path_size, "strict");
+    self->keys = PyTuple_New(h->ncols);
+    if (!self->path || !self->keys) {
+        return false;
+    }
+    const char *key = buf + sizeof(*h) + h->ncols + h->path_size;
+    const char *end = key + h->keys_size;
+    for (uint64_t k = 0; k < h->ncols; k++) {
+        uint32_t n;
+        if (key + sizeof(n) > end) {
+            PyErr_Format(PyExc_ValueError, "%R is truncated", index_path);
+            return false;
+        }
+        memcpy(&n, key, sizeof(n));
+        key += sizeof(n);
+        if (n > (size_t) (end - key)) {
+            PyErr_Format(PyExc_ValueError, "%R is truncated", index_path);
+            return false;
+        }
+        PyObject *okey = PyUnicode_DecodeUTF8(key, n, "strict");
+        if (!okey) {
+            return false;
+        }
+        PyUnicode_InternInPlace(&okey);
+        PyTuple_SET_ITEM(self->keys, k, okey);
+        key += n;
+    }
+    for (uint64_t k = 0; k < h->ncols; k++) {
+        if (self->dtypes[k] >= sizeof(_dt_names) / sizeof(_dt_names[0])) {
+            PyErr_Format(PyExc_ValueError, "%R has an unknown dtype", index_path);
+            return false;
+        }
+    }
+
+    uint64_t src_size;
+    int64_t src_mtime_ns;
+    if (!_file_stat(self->path, &src_size, &src_mtime_ns)) {
+        return false;
+    }
+    if (src_size != h->src_size || src_mtime_ns != h->src_mtime_ns) {
+        PyErr_Format(PyExc_ValueError, "CSV index is stale: %R changed", self->path);
+        return false;
+    }
+    if (!_map_file(self->path, &self->src_map, &self->src_view)) {
+        return false;
+    }
+    if ((uint64_t) self->src_view.len != h->src_size || self->offsets[h->nrows] != h->src_size) {
+        PyErr_Format(PyExc_ValueError, "CSV index is stale: %R changed", self->path);
+        return false;
+    }
+    // rows() slices the mapped source at these, so none may point past it
+    // or before the previous row
+    for (uint64_t k = 0; k < h->nrows; k++) {
+        if (self->offsets[k] > self->offsets[k + 1]) {
+            PyErr_Format(PyExc_ValueError, "%R is truncated", index_path);
+            return false;
+        }
+    }
+
+    self->dialect = (CsvDialect *) st->CsvDialectType->tp_alloc(st->CsvDialectType, 0);
+    if (!self->dialect) {
+        return false;
+    }
+    if (h->sep >= 128 || h->quote >= 128 || h->escape >= 128 || h->line_terminator >= 128) {
+        PyErr_Format(PyExc_ValueError, "%R has an invalid dialect", index_path);
+        return false;
+    }
+    self->dialect->sep = h->sep;
+    self->dialect->quote = h->quote;
+    self->dialect->escape = h->escape;
+    self->dialect->line_terminator = h->line_terminator;
+    self->dialect->crlf = h->crlf;
+    self->dialect->skip_initial_space = h->skip_initial_space;
+    self->dialect->typed = h->typed;
+    self->dialect->doublequote = h->doublequote;
+    _csv_dialect_compile(self->dialect);
+
+    self->h = h;
+    return true;
+}
+
+static PyObject *
+open_csv_index(PyObject *self, PyObject *args) {
+    PyObject *index_path;
+    if (!PyArg_ParseTuple(args, "O", &index_path)) {
+        return NULL;
+    }
+
+    _ModState *st = _get_state(self);
+    CsvIndex *idx = (CsvIndex *) st->CsvIndexType->tp_alloc(st->CsvIndexType, 0);
+    if (!idx) {
+        return NULL;
+    }
+    if (!_csv_index_load(st, idx, index_path)) {
+        Py_DECREF(idx);
+        return NULL;
+    }
+    return (PyObject *) idx;
+}
+
+static Py_ssize_t
+CsvIndex_len(CsvIndex *self) {
+    Py_ssize_t n = -1;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (_csv_index_check(self)) {
+        n = (Py_ssize_t) self->h->nrows;
+    }
+    Py_END_CRITICAL_SECTION();
+    return n;
+}
+
+/*
+ * Clamp [start, stop) to the rows like a slice.
+ */
+static bool
+_csv_index_range(CsvIndex *self, PyObject *ostart, PyObject *ostop, Py_ssize_t *start, Py_ssize_t *stop) {
+    if (!_csv_index_check(self)) {
+        return false;
+    }
+    *start = 0;
+    *stop = PY_SSIZE_T_MAX;
+    if (ostart != Py_None) {
+        *start = PyNumber_AsSsize_t(ostart, NULL);
+        if (*start == -1 && PyErr_Occurred()) {
+            return false;
+        }
+    }
+    if (ostop != Py_None) {
+        *stop = PyNumber_AsSsize_t(ostop, NULL);
+        if (*stop == -1 && PyErr_Occurred()) {
+            return false;
+        }
+    }
+    PySlice_AdjustIndices((Py_ssize_t) self->h->nrows, start, stop, 1);
+    if (*stop < *start) {
+        *stop = *start;
+    }
+    return true;
+}
+
+static PyObject *
+CsvIndex_offset(CsvIndex *self, PyObject *arg) {
+    Py_ssize_t n = PyNumber_AsSsize_t(arg, PyExc_IndexError);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    PyObject *ret = NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (_csv_index_check(self)) {
+        if (n < 0) {
+            n += self->h->nrows;
+        }
+        if (n < 0 || (uint64_t) n > self->h->nrows) {
+            PyErr_SetString(PyExc_IndexError, "row out of range");
+        } else {
+            ret = PyLong_FromUnsignedLongLong(self->offsets[n]);
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+/*
+ * Decode rows [start, stop) from the mapped source and parse them with
+ * the indexed dtypes into lists, or dicts with records.
+ */
+static PyObject *
+_csv_index_rows(CsvIndex *self, PyObject *args, PyObject *kwargs, bool records) {
+    PyObject *ostart = Py_None;
+    PyObject *ostop = Py_None;
+    PyObject *bad_cells = Py_None;
+    static char *kwlist[] = {"start", "stop", "bad_cells", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO$O", kwlist, &ostart, &ostop, &bad_cells)) {
+        return NULL;
+    }
+    _ModState *st = PyType_GetModuleState(Py_TYPE(self));
+    _CsvParser p;
+    _csv_parser_init(&p, st, self->dialect);
+    p.keys = Py_NewRef(self->keys);
+    if (!_csv_parser_set_bad_cells(&p, bad_cells)) {
+        _csv_parser_free(&p);
+        return NULL;
+    }
+    Py_ssize_t start, stop;
+    PyObject *text = NULL;
+    // the header and the dtypes live in the index mapping, which close()
+    // may unmap as soon as the section ends
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (_csv_index_range(self, ostart, ostop, &start, &stop) &&
+        _csv_parser_grow_dtypes(&p, self->h->ncols)) {
+        memcpy(p.dtypes, self->dtypes, self->h->ncols);
+        uint64_t beg = self->offsets[start];
+        uint64_t end = self->offsets[stop];
+        text = PyUnicode_DecodeUTF8((const char *) self->src_view.buf + beg, end - beg, "strict");
+    }
+    Py_END_CRITICAL_SECTION();
+    if (!text) {
+        _csv_parser_free(&p);
+        return NULL;
+    }
+    PyObject *rows = PyList_New(0);
+    if (!rows) {
+        _csv_parser_free(&p);
+        Py_DECREF(text);
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, text, PyUnicode_GET_LENGTH(text));
+
+    Py_ssize_t i = 0;
+    for (p.row = start; i < s.len; ) {
+        if (!_scan_csv_row(&i, &s, p.d, &p.spans)) {
+            goto error;
+        }
+        if (!p.spans.len) {
+            continue;
+        }
+        PyObject *row = records ? _csv_record(&p, &s) : _csv_row(&p, &s);
+        if (!row) {
+            goto error;
+        }
+        int r = PyList_Append(rows, row);
+        Py_DECREF(row);
+        if (r < 0) {
+            goto error;
+        }
+        p.row++;
+    }
+
+    _csv_parser_free(&p);
+    Py_DECREF(text);
+    return rows;
+error:
+    _csv_parser_free(&p);
+    Py_DECREF(text);
+    Py_DECREF(rows);
+    return NULL;
+}
+
+static PyObject *
+CsvIndex_rows(CsvIndex *self, PyObject *args, PyObject *kwargs) {
+    return _csv_index_rows(self, args, kwargs, false);
+}
+
+static PyObject *
+CsvIndex_records(CsvIndex *self, PyObject *args, PyObject *kwargs) {
+    return _csv_index_rows(self, args, kwargs, true);
+}
+
+static PyObject *
+CsvIndex_close(CsvIndex *self, PyObject *unused) {
+    _csv_index_close(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CsvIndex_enter(CsvIndex *self, PyObject *unused) {
+    return Py_NewRef(self);
+}
+
+static PyObject *
+CsvIndex_exit(CsvIndex *self, PyObject *args) {
+    _csv_index_close(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CsvIndex_get_path(CsvIndex *self, void *closure) {
+    return Py_NewRef(self->path);
+}
+
+static PyObject *
+CsvIndex_get_columns(CsvIndex *self, void *closure) {
+    return Py_NewRef(self->keys);
+}
+
+static PyObject *
+CsvIndex_get_dtypes(CsvIndex *self, void *closure) {
+    PyObject *dict = PyDict_New();
+    if (!dict) {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_csv_index_check(self)) {
+        Py_CLEAR(dict);
+    }
+    for (uint64_t k = 0; dict && k < self->h->ncols; k++) {
+        PyObject *name = PyUnicode_FromString(_dt_names[self->dtypes[k]]);
+        if (!name || PyDict_SetItem(dict, PyTuple_GET_ITEM(self->keys, k), name) < 0) {
+            Py_CLEAR(dict);
+        }
+        Py_XDECREF(name);
+    }
+    Py_END_CRITICAL_SECTION();
+    return dict;
+}
+
+static PyObject *
+CsvIndex_get_dialect(CsvIndex *self, void *closure) {
+    return Py_NewRef(self->dialect);
+}
+
+static PyMethodDef CsvIndex_methods[] = {
+    {"offset", (PyCFunction) CsvIndex_offset, METH_O, "Byte offset of row n in the source; offset(len(index)) is the source size."},
+    {"rows", (PyCFunction) CsvIndex_rows, METH_VARARGS | METH_KEYWORDS, "rows(start=None, stop=None, *, bad_cells=None)\n\nParse rows [start, stop) into lists."},
+    {"records", (PyCFunction) CsvIndex_records, METH_VARARGS | METH_KEYWORDS, "records(start=None, stop=None, *, bad_cells=None)\n\nParse rows [start, stop) into dicts keyed by the header."},
+    {"close", (PyCFunction) CsvIndex_close, METH_NOARGS, "Unmap the index and the source."},
+    {"__enter__", (PyCFunction) CsvIndex_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) CsvIndex_exit, METH_VARARGS, NULL},
+    {NULL}
+};
+
+static PyGetSetDef CsvIndex_getset[] = {
+    {"path", (getter) CsvIndex_get_path, NULL, "Absolute source path.", NULL},
+    {"columns", (getter) CsvIndex_get_columns, NULL, "Header names.", NULL},
+    {"dtypes", (getter) CsvIndex_get_dtypes, NULL, "Dtype name of every column.", NULL},
+    {"dialect", (getter) CsvIndex_get_dialect, NULL, "Dialect the index was built with.", NULL},
+    {NULL}
+};
+
+static PyType_Slot CsvIndex_slots[] = {
+    {Py_tp_doc, "Memory-mapped CSV index returned by open_csv_index()."},
+    {Py_tp_dealloc, CsvIndex_dealloc},
+    {Py_tp_methods, CsvIndex_methods},
+    {Py_tp_getset, CsvIndex_getset},
+    {Py_sq_length, CsvIndex_len},
+    {0, NULL}
+};
+
+static PyType_Spec CsvIndex_spec = {
+    .name = "parseutils.CsvIndex",
+    .basicsize = sizeof(CsvIndex),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = CsvIndex_slots,
+};
+
+/*
+ * Streamed file input
+ *
+ * parse_csv_file() and parse_ini_file() read a plain, gzip or zstd file
+ * in blocks of block_size bytes, picked by the magic bytes rather than
+ * the name. Every block is decoded and appended to the unparsed tail of
+ * the previous one; the complete rows or lines are parsed and dropped,
+ * so memory follows the block size and the longest row instead of the
+ * file size. gzip goes through the gzip module, zstd through
+ * compression.zstd (3.14+) or the zstandard package.
+ *
+ * With prefetch one executor thread reads and decompresses the next
+ * block while the current one is parsed. It is on by default only on a
+ * free-threaded build: with the GIL the parse keeps the reader waiting
+ * until the next block is asked for, so nothing overlaps.
+ */
+
+#define _GZIP_MAGIC "\x1f\x8b"
+#define _ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+
+typedef struct {
+    PyObject *raw;  // the file as opened
+    PyObject *reader;  // raw or a decompressor reading from it
+    PyObject *read;  // bound reader.read
+    PyObject *decoder;  // incremental decoder of the encoding
+    PyObject *pool;  // ThreadPoolExecutor with prefetch, else NULL
+    PyObject *next;  // Future of the next block, or NULL
+    Py_ssize_t block_size;
+    PyObject *text;  // decoded and not parsed yet
+    Py_ssize_t base;  // offset of text in the decoded file
+    Py_ssize_t base_line;  // newlines before text
+    bool eof;
+} _Stream;
+
+static PyObject *
+_stream_zstd_reader(PyObject *raw) {
+    PyObject *zstd = PyImport_ImportModule("compression.zstd");
+    if (zstd) {
+        PyObject *reader = PyObject_CallMethod(zstd, "ZstdFile", "O", raw);
+        Py_DECREF(zstd);
+        return reader;
+    }
+    if (!PyErr_ExceptionMatches(PyExc_ImportError)) {
+        return NULL;
+    }
+    PyErr_Clear();
+    zstd = PyImport_ImportModule("zstandard");
+    if (!zstd) {
+        return NULL;
+    }
+    PyObject *dctx = PyObject_CallMethod(zstd, "ZstdDecompressor", NULL);
+    Py_DECREF(zstd);
+    if (!dctx) {
+        return NULL;
+    }
+    PyObject *reader = PyObject_CallMethod(dctx, "stream_reader", "O", raw);
+    Py_DECREF(dctx);
+    return reader;
+}
+
+static void
+_stream_close(_Stream *f) {
+    PyObject *type, *value, *tb;
+    PyErr_Fetch(&type, &value, &tb);
+    if (f->pool) {
+        // waits for a pending read before the file goes away
+        PyObject *r = PyObject_CallMethod(f->pool, "shutdown", NULL);
+        if (r) {
+            Py_DECREF(r);
+        } else {
+            PyErr_WriteUnraisable(f->pool);
+        }
+    }
+    PyObject *files[] = {f->reader, f->raw};
+    for (size_t k = 0; k < 2; k++) {
+        if (files[k] && (k == 0 || files[k] != f->reader)) {
+            PyObject *r = PyObject_CallMethod(files[k], "close", NULL);
+            if (r) {
+                Py_DECREF(r);
+            } else {
+                PyErr_WriteUnraisable(files[k]);
+            }
+        }
+    }
+    Py_CLEAR(f->next);
+    Py_CLEAR(f->pool);
+    Py_CLEAR(f->decoder);
+    Py_CLEAR(f->read);
+    Py_CLEAR(f->reader);
+    Py_CLEAR(f->raw);
+    Py_CLEAR(f->text);
+    PyErr_Restore(type, value, tb);
+}
+
+/*
+ * Drop the first consumed characters of f->text and append the next
+ * block. f->eof is set once the last block is in.
+ *
+ * The callers rescan what is left over, so a row longer than a block
+ * makes the reads grow to the size of that tail: it then doubles on
+ * every read and the rescans add up to linear time.
+ */
+static bool
+_stream_read(_Stream *f, Py_ssize_t consumed) {
+    Py_ssize_t size = PyUnicode_GET_LENGTH(f->text) - consumed;
+    if (size < f->block_size) {
+        size = f->block_size;
+    }
+    PyObject *block;
+    if (f->next) {
+        block = PyObject_CallMethod(f->next, "result", NULL);
+        Py_CLEAR(f->next);
+    } else {
+        block = PyObject_CallFunction(f->read, "n", size);
+    }
+    if (!block) {
+        return false;
+    }
+    if (!PyBytes_Check(block)) {
+        PyErr_Format(PyExc_TypeError, "read() returned %.200s, not bytes", Py_TYPE(block)->tp_name);
+        Py_DECREF(block);
+        return false;
+    }
+    f->eof = PyBytes_GET_SIZE(block) == 0;
+    if (!f->eof && f->pool) {
+        f->next = PyObject_CallMethod(f->pool, "submit", "On", f->read, size);
+        if (!f->next) {
+            Py_DECREF(block);
+            return false;
+        }
+    }
+    PyObject *text = PyObject_CallMethod(f->decoder, "decode", "OO", block, f->eof ? Py_True : Py_False);
+    Py_DECREF(block);
+    if (!text) {
+        return false;
+    }
+
+    for (Py_ssize_t k = _find_newline(f->text, 0, consumed); k >= 0; k = _find_newline(f->text, k + 1, consumed)) {
+        f->base_line++;
+    }
+    f->base += consumed;
+    PyObject *rest = PyUnicode_Substring(f->text, consumed, PyUnicode_GET_LENGTH(f->text));
+    PyObject *joined = rest ? PyUnicode_Concat(rest, text) : NULL;
+    Py_XDECREF(rest);
+    Py_DECREF(text);
+    if (!joined) {
+        return false;
+    }
+    Py_SETREF(f->text, joined);
+    return true;
+}
+
+/*
+ * Open path and read its first block. prefetch < 0 picks the default.
+ */
+static bool
+_stream_open(_Stream *f, PyObject *path, const char *encoding, Py_ssize_t block_size, int prefetch) {
+    memset(f, 0, sizeof(*f));
+    if (block_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be positive");
+        return false;
+    }
+    f->block_size = block_size;
+    f->text = PyUnicode_New(0, 0);
+    f->decoder = PyCodec_IncrementalDecoder(encoding, "strict");
+    if (!f->text || !f->decoder) {
+        goto error;
+    }
+
+    PyObject *io = PyImport_ImportModule("io");
+    if (!io) {
+        goto error;
+    }
+    f->raw = PyObject_CallMethod(io, "open", "Os", path, "rb");
+    Py_DECREF(io);
+    if (!f->raw) {
+        goto error;
+    }
+    PyObject *magic = PyObject_CallMethod(f->raw, "read", "i", 4);
+    if (!magic) {
+        goto error;
+    }
+    if (!PyBytes_Check(magic)) {
+        PyErr_SetString(PyExc_TypeError, "read() did not return bytes");
+        Py_DECREF(magic);
+        goto error;
+    }
+    const char *m = PyBytes_AS_STRING(magic);
+    Py_ssize_t n = PyBytes_GET_SIZE(magic);
+    bool gz = n >= 2 && memcmp(m, _GZIP_MAGIC, 2) == 0;
+    bool zst = n >= 4 && memcmp(m, _ZSTD_MAGIC, 4) == 0;
+    Py_DECREF(magic);
+    PyObject *r = PyObject_CallMethod(f->raw, "seek", "i", 0);
+    if (!r) {
+        goto error;
+    }
+    Py_DECREF(r);
+
+    if (gz) {
+        PyObject *gzip = PyImport_ImportModule("gzip");
+        if (!gzip) {
+            goto error;
+        }
+        PyObject *kwargs = Py_BuildValue("{sO}", "fileobj", f->raw);
+        PyObject *type = PyObject_GetAttrString(gzip, "GzipFile");
+        PyObject *args = PyTuple_New(0);
+        if (kwargs && type && args) {
+            f->reader = PyObject_Call(type, args, kwargs);
+        }
+        Py_XDECREF(args);
+        Py_XDECREF(type);
+        Py_XDECREF(kwargs);
+        Py_DECREF(gzip);
+    } else if (zst) {
+        f->reader = _stream_zstd_reader(f->raw);
+    } else {
+        f->reader = Py_NewRef(f->raw);
+    }
+    if (!f->reader) {
+        goto error;
+    }
+    f->read = PyObject_GetAttrString(f->reader, "read");
+    if (!f->read) {
+        goto error;
+    }
+
+#ifdef Py_GIL_DISABLED
+    if (prefetch < 0) {
+        prefetch = 1;
+    }
+#endif
+    if (prefetch > 0) {
+        PyObject *futures = PyImport_ImportModule("concurrent.futures");
+        if (!futures) {
+            goto error;
+        }
+        f->pool = PyObject_CallMethod(futures, "ThreadPoolExecutor", "i", 1);
+        Py_DECREF(futures);
+        if (!f->pool) {
+            goto error;
+        }
+    }
+    if (_stream_read(f, 0)) {
+        return true;
+    }
+
+error:
+    _stream_close(f);
+    return false;
+}
+
+static void
+_stream_src(const _Stream *f, _Src *s) {
+    _src_init(s, f->text, PyUnicode_GET_LENGTH(f->text));
+    s->base = f->base;
+    s->base_line = f->base_line;
+}
+
+/*
+ * Read on until f->text holds nrows complete non-empty CSV rows after
+ * index, or the whole file. Returns the end of the last complete row, or
+ * -1 with an exception set.
+ */
+static Py_ssize_t
+_csv_stream_rows(_Stream *f, const CsvDialect *d, Py_ssize_t index, Py_ssize_t nrows) {
+    for (;;) {
+        _Src s;
+        _stream_src(f, &s);
+        if (f->eof) {
+            return s.len;
+        }
+        Py_ssize_t end = index;
+        Py_ssize_t n = 0;
+        for (Py_ssize_t i = index; n < nrows && i < s.len; ) {
+            bool empty;
+            i = _csv_next_row(&s, d, i, &empty);
+            if (i >= s.len) {
+                break;
+            }
+            end = i;
+            n += !empty;
+        }
+        if (n == nrows) {
+            return end;
+        }
+        if (!_stream_read(f, 0)) {
+            return -1;
+        }
+    }
+}
+
+static PyObject *
+parse_csv_file(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *path;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *usecols = Py_None;
+    PyObject *where = Py_None;
+    PyObject *dtypes = Py_None;
+    Py_ssize_t infer_rows = 0;
+    PyObject *bad_cells = Py_None;
+    PyObject *oon_error = NULL;
+    const char *encoding = "utf-8";
+    Py_ssize_t block_size = 1 << 20;
+    int prefetch = -1;
+    static char *kwlist[] = {"path", "sep", "dialect", "usecols", "where", "dtypes", "infer_rows", "bad_cells",
+        "on_error", "encoding", "block_size", "prefetch", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO$OOOnOOsnp", kwlist,
+        &path, &osep, &odialect, &usecols, &where, &dtypes, &infer_rows, &bad_cells, &oon_error,
+        &encoding, &block_size, &prefetch)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    int on_error = _ON_ERROR_RAISE;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d) ||
+        (oon_error && !_on_error_mode(oon_error, &on_error))) {
+        return NULL;
+    }
+
+    _Stream f;
+    if (!_stream_open(&f, path, encoding, block_size, prefetch)) {
+        return NULL;
+    }
+    PyObject *records = PyList_New(0);
+    PyObject *errors = PyList_New(0);
+    if (!records || !errors) {
+        Py_XDECREF(records);
+        Py_XDECREF(errors);
+        _stream_close(&f);
+        return NULL;
+    }
+
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+    p.on_error = on_error;
+    p.errors = errors;
+
+    _Src s;
+    Py_ssize_t i = 0;
+    Py_ssize_t end = _csv_stream_rows(&f, d, 0, 1);
+    if (end < 0) {
+        goto error;
+    }
+    _stream_src(&f, &s);
+    s.len = end;
+    if (!_csv_parser_header(&i, &s, &p) ||
+        !_csv_select_init(&p.sel, usecols, where, p.keys) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_set_bad_cells(&p, bad_cells)) {
+        goto error;
+    }
+    if (infer_rows > 0) {
+        end = _csv_stream_rows(&f, d, i, infer_rows);
+        if (end < 0) {
+            goto error;
+        }
+        _stream_src(&f, &s);
+        s.len = end;
+        if (!_csv_parser_infer(&p, &s, i, infer_rows)) {
+            goto error;
+        }
+    }
+
+    for (;;) {
+        _stream_src(&f, &s);
+        if (!_parse_csv_records(&i, &s, &p, records, f.eof)) {
+            goto error;
+        }
+        if (f.eof) {
+            break;
+        }
+        if (!_stream_read(&f, i)) {
+            goto error;
+        }
+        i = 0;
+    }
+
+    _csv_parser_free(&p);
+    _stream_close(&f);
+    return _on_error_result(on_error, records, errors);
+error:
+    _csv_parser_free(&p);
+    _stream_close(&f);
+    Py_DECREF(records);
+    Py_DECREF(errors);
+    return NULL;
+}
+
+static PyObject *
+parse_ini_file(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *path;
+    PyObject *odialect = Py_None;
+    PyObject *oon_error = NULL;
+    const char *encoding = "utf-8";
+    Py_ssize_t block_size = 1 << 20;
+    int prefetch = -1;
+    static char *kwlist[] = {"path", "dialect", "on_error", "encoding", "block_size", "prefetch", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$Osnp", kwlist,
+        &path, &odialect, &oon_error, &encoding, &block_size, &prefetch)) {
+        return NULL;
+    }
+    _IniParser p = {.st = st, .on_error = _ON_ERROR_RAISE};
+    if (!_get_ini_dialect(st, odialect, &p.d) ||
+        (oon_error && !_on_error_mode(oon_error, &p.on_error))) {
+        return NULL;
+    }
+
+    _Stream f;
+    if (!_stream_open(&f, path, encoding, block_size, prefetch)) {
+        return NULL;
+    }
+    p.doc = PyDict_New();
+    p.errors = PyList_New(0);
+    if (!p.doc || !p.errors) {
+        Py_XDECREF(p.doc);
+        Py_XDECREF(p.errors);
+        _stream_close(&f);
+        return NULL;
+    }
+
+    _buf_init(&p.buf);
+    for (;;) {
+        _Src s;
+        _stream_src(&f, &s);
+        Py_ssize_t i = 0;
+        if (!_parse_ini_lines(&i, f.text, &s, &p, f.eof)) {
+            Py_CLEAR(p.doc);
+            break;
+        }
+        if (f.eof) {
+            break;
+        }
+        if (!_stream_read(&f, i)) {
+            Py_CLEAR(p.doc);
+            break;
+        }
+    }
+    _buf_free(&p.buf);
+    _stream_close(&f);
+    return _on_error_result(p.on_error, p.doc, p.errors);
+}
+
+/*
+ * Arrow output
+ *
+ * parse_csv_arrow() appends every cell to typed column buffers instead
+ * of building an object for it, and returns an ArrowBatch exporting the
+ * columns through the Arrow PyCapsule interface as a struct array with
+ * one child per column. pyarrow.record_batch(), polars.from_arrow() and
+ * other Arrow consumers import it without a copy; no Arrow library is
+ * linked. Columns are int64, float64, large_utf8 or timestamp[us] (UTC
+ * once any value had an offset) and nullable through a validity bitmap.
+ * Every export shares the buffers, which go with the last release; a
+ * release may run on any thread, without the GIL.
+ */
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif
+
+typedef struct {
+    char *name;  // UTF-8
+    unsigned char dt;  // _DT_INT, _DT_FLOAT, _DT_STR or _DT_DATETIME
+    bool aware;  // a timestamp had an offset
+    int64_t null_count;
+    _Bytes validity;  // a bit per row, set when valid
+    _Bytes offsets;  // int64 per row plus one, strings only
+    _Bytes data;
+} _ArrowColumn;
+
+typedef struct {
+    PyThread_type_lock lock;  // guards refs
+    Py_ssize_t refs;
+    int64_t nrows;
+    Py_ssize_t ncols;
+    _ArrowColumn *cols;
+} _ArrowData;
+
+static void
+_arrow_data_decref(_ArrowData *a) {
+    PyThread_acquire_lock(a->lock, WAIT_LOCK);
+    Py_ssize_t refs = --a->refs;
+    PyThread_release_lock(a->lock);
+    if (refs) {
+        return;
+    }
+    for (Py_ssize_t k = 0; k < a->ncols; k++) {
+        _ArrowColumn *col = &a->cols[k];
+        PyMem_RawFree(col->name);
+        PyMem_RawFree(col->validity.data);
+        PyMem_RawFree(col->offsets.data);
+        PyMem_RawFree(col->data.data);
+    }
+    PyMem_RawFree(a->cols);
+    PyThread_free_lock(a->lock);
+    PyMem_RawFree(a);
+}
+
+static _ArrowData *
+_arrow_data_incref(_ArrowData *a) {
+    PyThread_acquire_lock(a->lock, WAIT_LOCK);
+    a->refs++;
+    PyThread_release_lock(a->lock);
+    return a;
+}
+
+static _ArrowData *
+_arrow_data_new(Py_ssize_t ncols) {
+    _ArrowData *a = PyMem_RawCalloc(1, sizeof(*a));
+    if (!a) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    a->refs = 1;
+    a->lock = PyThread_allocate_lock();
+    a->cols = PyMem_RawCalloc(ncols ? ncols : 1, sizeof(*a->cols));
+    if (!a->lock || !a->cols) {
+        if (a->lock) {
+            PyThread_free_lock(a->lock);
+        }
+        PyMem_RawFree(a->cols);
+        PyMem_RawFree(a);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    a->ncols = ncols;
+    return a;
+}
+
+/*
+ * A new row of col is null unless valid. Every buffer is allocated even
+ * when empty, as consumers may not accept NULL for a zero-length one.
+ */
+static bool
+_arrow_validity(_ArrowColumn *col, int64_t row, bool valid) {
+    if (row % 8 == 0) {
+        char zero = 0;
+        if (!_bytes_write(&col->validity, &zero, 1)) {
+            return false;
+        }
+    }
+    if (valid) {
+        col->validity.data[row / 8] |= (char) (1 << (row % 8));
+    } else {
+        col->null_count++;
+    }
+    return true;
+}
+
+static bool
+_bytes_write_utf8(_Bytes *b, const _Src *s, Py_ssize_t beg, Py_ssize_t end) {
+    if (!_bytes_reserve(b, (size_t) (end - beg) * (s->kind == PyUnicode_1BYTE_KIND ? 2 : 4))) {
+        return false;
+    }
+    unsigned char *out = (unsigned char *) b->data + b->len;
+    for (Py_ssize_t i = beg; i < end; i++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+        if (c < 0x80) {
+            *out++ = (unsigned char) c;
+        } else if (c < 0x800) {
+            *out++ = (unsigned char) (0xc0 | (c >> 6));
+            *out++ = (unsigned char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            *out++ = (unsigned char) (0xe0 | (c >> 12));
+            *out++ = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+            *out++ = (unsigned char) (0x80 | (c & 0x3f));
+        } else {
+            *out++ = (unsigned char) (0xf0 | (c >> 18));
+            *out++ = (unsigned char) (0x80 | ((c >> 12) & 0x3f));
+            *out++ = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+            *out++ = (unsigned char) (0x80 | (c & 0x3f));
+        }
+    }
+    b->len = (char *) out - b->data;
+    return true;
+}
+
+/*
+ * Append cell col of the scanned row, or a null when the row is short.
+ */
+static bool
+_arrow_cell(_CsvParser *p, const _Src *s, _ArrowColumn *out, int64_t row, Py_ssize_t col) {
+    const _Span *sp = (size_t) col < p->spans.len ? &p->spans.data[col] : NULL;
+    if (out->dt == _DT_STR) {
+        bool ok;
+        if (!sp) {
+            ok = true;
+        } else if (sp->flags & _SPAN_ESCAPED) {
+            PyObject *text = _csv_field_to_str(s, sp, p->d, &p->buf);
+            Py_ssize_t n;
+            const char *utf8 = text ? PyUnicode_AsUTF8AndSize(text, &n) : NULL;
+            ok = utf8 && _bytes_write(&out->data, utf8, n);
+            Py_XDECREF(text);
+        } else {
+            ok = _bytes_write_utf8(&out->data, s, sp->beg, sp->end);
+        }
+        int64_t end = (int64_t) out->data.len;
+        return ok && _arrow_validity(out, row, sp != NULL) && _bytes_write(&out->offsets, &end, sizeof(end));
+    }
+
+    bool valid = false;
+    int64_t ivalue = 0;
+    double fvalue = 0;
+    if (sp && sp->beg < sp->end && !(sp->flags & _SPAN_ESCAPED)) {
+        if (out->dt == _DT_DATETIME) {
+            _DateTime dt;
+            if (_span_to_datetime(s, sp->beg, sp->end, &dt)) {
+                ivalue = _datetime_to_epoch_us(&dt);
+                out->aware |= dt.aware;
+                valid = true;
+            }
+        } else {
+            int type = _span_type(s, sp->beg, sp->end);
+            long long ll;
+            if (type == _INT && _span_ll(s, sp->beg, sp->end, &ll)) {
+                ivalue = ll;
+                fvalue = (double) ll;
+                valid = true;
+            } else if (out->dt == _DT_FLOAT) {
+                int r = _span_to_double(s, sp->beg, sp->end, &fvalue);
+                if (r < 0) {
+                    return false;
+                }
+                valid = r > 0;
+            }
+        }
+        if (!valid) {
+            PyObject *o = _csv_bad_cell(p, s, col, out->dt);
+            if (!o) {
+                return false;
+            }
+            Py_DECREF(o);
+        }
+    }
+    if (out->dt == _DT_FLOAT) {
+        return _arrow_validity(out, row, valid) && _bytes_write(&out->data, &fvalue, sizeof(fvalue));
+    }
+    return _arrow_validity(out, row, valid) && _bytes_write(&out->data, &ivalue, sizeof(ivalue));
+}
+
+static const char *
+_arrow_format(const _ArrowColumn *col) {
+    switch (col->dt) {
+    case _DT_INT:
+        return "l";
+    case _DT_FLOAT:
+        return "g";
+    case _DT_DATETIME:
+        return col->aware ? "tsu:UTC" : "tsu:";
+    default:
+        return "U";
+    }
+}
+
+static void
+_arrow_child_schema_release(struct ArrowSchema *schema) {
+    _arrow_data_decref(schema->private_data);
+    schema->release = NULL;
+}
+
+static void
+_arrow_schema_release(struct ArrowSchema *schema) {
+    for (int64_t k = 0; k < schema->n_children; k++) {
+        struct ArrowSchema *child = schema->children[k];
+        if (child->release) {
+            child->release(child);
+        }
+    }
+    PyMem_RawFree(schema->children);
+    _arrow_data_decref(schema->private_data);
+    schema->release = NULL;
+}
+
+/*
+ * children is one block: the pointers, then the structs they point to.
+ */
+static bool
+_arrow_export_schema(_ArrowData *a, struct ArrowSchema *out) {
+    struct ArrowSchema **children = PyMem_RawMalloc((a->ncols ? a->ncols : 1) * (sizeof(void *) + sizeof(**children)));
+    if (!children) {
+        PyErr_NoMemory();
+        return false;
+    }
+    struct ArrowSchema *structs = (struct ArrowSchema *) (children + a->ncols);
+    for (Py_ssize_t k = 0; k < a->ncols; k++) {
+        children[k] = &structs[k];
+        structs[k] = (struct ArrowSchema) {
+            .format = _arrow_format(&a->cols[k]),
+            .name = a->cols[k].name,
+            .flags = ARROW_FLAG_NULLABLE,
+            .release = _arrow_child_schema_release,
+            .private_data = _arrow_data_incref(a),
+        };
+    }
+    *out = (struct ArrowSchema) {
+        .format = "+s",
+        .name = "",
+        .n_children = a->ncols,
+        .children = children,
+        .release = _arrow_schema_release,
+        .private_data = _arrow_data_incref(a),
+    };
+    return true;
+}
+
+/*
+ * A child owns its buffer list, so it outlives the parent once a
+ * consumer moves it out.
+ */
+typedef struct {
+    _ArrowData *a;
+    const void *buffers[3];
+} _ArrowChild;
+
+static void
+_arrow_child_array_release(struct ArrowArray *array) {
+    _ArrowChild *child = array->private_data;
+    _arrow_data_decref(child->a);
+    PyMem_RawFree(child);
+    array->release = NULL;
+}
+
+static void
+_arrow_array_release(struct ArrowArray *array) {
+    for (int64_t k = 0; k < array->n_children; k++) {
+        struct ArrowArray *child = array->children[k];
+        if (child->release) {
+            child->release(child);
+        }
+    }
+    PyMem_RawFree(array->children);
+    _arrow_data_decref(array->private_data);
+    array->release = NULL;
+}
+
+static bool
+_arrow_export_array(_ArrowData *a, struct ArrowArray *out) {
+    // the pointers, the structs, then the parent's one NULL buffer
+    struct ArrowArray **children = PyMem_RawCalloc(1,
+        a->ncols * (sizeof(void *) + sizeof(**children)) + sizeof(void *));
+    if (!children) {
+        PyErr_NoMemory();
+        return false;
+    }
+    struct ArrowArray *structs = (struct ArrowArray *) (children + a->ncols);
+    const void **buffers = (const void **) (structs + a->ncols);
+    for (Py_ssize_t k = 0; k < a->ncols; k++) {
+        _ArrowColumn *col = &a->cols[k];
+        _ArrowChild *child = PyMem_RawMalloc(sizeof(*child));
+        if (!child) {
+            for (Py_ssize_t j = 0; j < k; j++) {
+                structs[j].release(&structs[j]);
+            }
+            PyMem_RawFree(children);
+            PyErr_NoMemory();
+            return false;
+        }
+        child->a = _arrow_data_incref(a);
+        child->buffers[0] = col->null_count ? col->validity.data : NULL;
+        child->buffers[1] = col->dt == _DT_STR ? col->offsets.data : col->data.data;
+        child->buffers[2] = col->data.data;
+        children[k] = &structs[k];
+        structs[k] = (struct ArrowArray) {
+            .length = a->nrows,
+            .null_count = col->null_count,
+            .n_buffers = col->dt == _DT_STR ? 3 : 2,
+            .buffers = child->buffers,
+            .release = _arrow_child_array_release,
+            .private_data = child,
+        };
+    }
+    *out = (struct ArrowArray) {
+        .length = a->nrows,
+        .n_buffers = 1,
+        .buffers = buffers,
+        .n_children = a->ncols,
+        .children = children,
+        .release = _arrow_array_release,
+        .private_data = _arrow_data_incref(a),
+    };
+    return true;
+}
+
+static void
+_arrow_schema_capsule_free(PyObject *capsule) {
+    struct ArrowSchema *schema = PyCapsule_GetPointer(capsule, "arrow_schema");
+    if (schema->release) {
+        schema->release(schema);
+    }
+    PyMem_Free(schema);
+}
+
+static void
+_arrow_array_capsule_free(PyObject *capsule) {
+    struct ArrowArray *array = PyCapsule_GetPointer(capsule, "arrow_array");
+    if (array->release) {
+        array->release(array);
+    }
+    PyMem_Free(array);
+}
+
+typedef struct {
+    PyObject_HEAD
+    _ArrowData *a;
+    PyObject *columns;  // tuple of names
+} ArrowBatch;
+
+static void
+ArrowBatch_dealloc(ArrowBatch *self) {
+    if (self->a) {
+        _arrow_data_decref(self->a);
+    }
+    Py_XDECREF(self->columns);
+    PyTypeObject *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+ArrowBatch_schema(ArrowBatch *self, PyObject *unused) {
+    struct ArrowSchema *schema = PyMem_Malloc(sizeof(*schema));
+    if (!schema) {
+        return PyErr_NoMemory();
+    }
+    schema->release = NULL;
+    if (!_arrow_export_schema(self->a, schema)) {
+        PyMem_Free(schema);
+        return NULL;
+    }
+    return PyCapsule_New(schema, "arrow_schema", _arrow_schema_capsule_free);
+}
+
+static PyObject *
+ArrowBatch_array(ArrowBatch *self, PyObject *args, PyObject *kwargs) {
+    PyObject *requested = Py_None;
+    static char *kwlist[] = {"requested_schema", NULL};
+
+    // the columns have one type each, so a requested schema is not honored
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &requested)) {
+        return NULL;
+    }
+    PyObject *schema = ArrowBatch_schema(self, NULL);
+    if (!schema) {
+        return NULL;
+    }
+    struct ArrowArray *array = PyMem_Malloc(sizeof(*array));
+    if (!array) {
+        Py_DECREF(schema);
+        return PyErr_NoMemory();
+    }
+    array->release = NULL;
+    if (!_arrow_export_array(self->a, array)) {
+        PyMem_Free(array);
+        Py_DECREF(schema);
+        return NULL;
+    }
+    PyObject *capsule = PyCapsule_New(array, "arrow_array", _arrow_array_capsule_free);
+    if (!capsule) {
+        array->release(array);
+        PyMem_Free(array);
+        Py_DECREF(schema);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", schema, capsule);
+}
+
+static PyObject *
+ArrowBatch_get_columns(ArrowBatch *self, void *closure) {
+    return Py_NewRef(self->columns);
+}
+
+static PyObject *
+ArrowBatch_get_dtypes(ArrowBatch *self, void *closure) {
+    PyObject *dtypes = PyDict_New();
+    for (Py_ssize_t k = 0; dtypes && k < self->a->ncols; k++) {
+        const char *name = _dt_names[self->a->cols[k].dt];
+        PyObject *o = PyUnicode_FromString(name);
+        if (!o || PyDict_SetItem(dtypes, PyTuple_GET_ITEM(self->columns, k), o) < 0) {
+            Py_CLEAR(dtypes);
+        }
+        Py_XDECREF(o);
+    }
+    return dtypes;
+}
+
+static Py_ssize_t
+ArrowBatch_len(ArrowBatch *self) {
+    return (Py_ssize_t) self->a->nrows;
+}
+
+static PyMethodDef ArrowBatch_methods[] = {
+    {"__arrow_c_schema__", (PyCFunction) ArrowBatch_schema, METH_NOARGS, "Export the schema as an arrow_schema capsule."},
+    {"__arrow_c_array__", (PyCFunction) ArrowBatch_array, METH_VARARGS | METH_KEYWORDS, "Export the columns as (arrow_schema, arrow_array) capsules."},
+    {NULL}
+};
+
+static PyGetSetDef ArrowBatch_getset[] = {
+    {"columns", (getter) ArrowBatch_get_columns, NULL, "Column names.", NULL},
+    {"dtypes", (getter) ArrowBatch_get_dtypes, NULL, "Dtype name of every column.", NULL},
+    {NULL}
+};
+
+static PyType_Slot ArrowBatch_slots[] = {
+    {Py_tp_doc, "CSV columns in Arrow layout returned by parse_csv_arrow()."},
+    {Py_tp_dealloc, ArrowBatch_dealloc},
+    {Py_tp_methods, ArrowBatch_methods},
+    {Py_tp_getset, ArrowBatch_getset},
+    {Py_sq_length, ArrowBatch_len},
+    {0, NULL}
+};
+
+static PyType_Spec ArrowBatch_spec = {
+    .name = "parseutils.ArrowBatch",
+    .basicsize = sizeof(ArrowBatch),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = ArrowBatch_slots,
+};
+
+/*
+ * One output column per selected header column. Columns without a dtype
+ * take the inferred one; str where nothing could be inferred.
+ */
+static bool
+_arrow_columns(_CsvParser *p, _ArrowData *a, PyObject *columns) {
+    for (Py_ssize_t k = 0; k < a->ncols; k++) {
+        Py_ssize_t col = p->sel.cols ? p->sel.cols[k] : k;
+        _ArrowColumn *out = &a->cols[k];
+        unsigned char dt = col < p->ndtypes ? p->dtypes[col] : _DT_AUTO;
+        out->dt = dt == _DT_AUTO ? _DT_STR : dt == _DT_TIMESTAMP ? _DT_DATETIME : dt;
+
+        PyObject *name = PyTuple_GET_ITEM(p->keys, col);
+        PyTuple_SET_ITEM(columns, k, Py_NewRef(name));
+        Py_ssize_t n;
+        const char *utf8 = PyUnicode_AsUTF8AndSize(name, &n);
+        if (!utf8) {
+            return false;
+        }
+        out->name = PyMem_RawMalloc(n + 1);
+        if (!out->name) {
+            PyErr_NoMemory();
+            return false;
+        }
+        memcpy(out->name, utf8, n + 1);
+
+        int64_t zero = 0;
+        if (!_bytes_reserve(&out->validity, 1) || !_bytes_reserve(&out->data, 1) ||
+            (out->dt == _DT_STR && !_bytes_write(&out->offsets, &zero, sizeof(zero)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static PyObject *
+parse_csv_arrow(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *src;
+    PyObject *osep = Py_None;
+    PyObject *odialect = Py_None;
+    PyObject *usecols = Py_None;
+    PyObject *where = Py_None;
+    PyObject *dtypes = Py_None;
+    Py_ssize_t infer_rows = 1000;
+    PyObject *bad_cells = Py_None;
+    static char *kwlist[] = {"src", "sep", "dialect", "usecols", "where", "dtypes", "infer_rows", "bad_cells", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|OO$OOOnO", kwlist,
+        &src, &osep, &odialect, &usecols, &where, &dtypes, &infer_rows, &bad_cells)) {
+        return NULL;
+    }
+
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
+        return NULL;
+    }
+
+    _Src s;
+    _src_init(&s, src, PyUnicode_GET_LENGTH(src));
+    Py_ssize_t i = 0;
+    _CsvParser p;
+    _csv_parser_init(&p, st, d);
+    ArrowBatch *batch = NULL;
+
+    if (!_csv_parser_header(&i, &s, &p) ||
+        !_csv_select_init(&p.sel, usecols, where, p.keys) ||
+        !_csv_parser_set_dtypes(&p, dtypes) ||
+        !_csv_parser_set_bad_cells(&p, bad_cells) ||
+        (infer_rows > 0 && !_csv_parser_infer(&p, &s, i, infer_rows))) {
+        goto error;
+    }
+
+    batch = (ArrowBatch *) st->ArrowBatchType->tp_alloc(st->ArrowBatchType, 0);
+    if (!batch) {
+        goto error;
+    }
+    Py_ssize_t ncols = p.sel.cols ? p.sel.ncols : PyTuple_GET_SIZE(p.keys);
+    batch->a = _arrow_data_new(ncols);
+    batch->columns = PyTuple_New(ncols);
+    if (!batch->a || !batch->columns || !_arrow_columns(&p, batch->a, batch->columns)) {
+        goto error;
+    }
+
+    _ArrowData *a = batch->a;
+    while (i < s.len) {
+        if (!_scan_csv_row(&i, &s, d, &p.spans)) {
+            goto error;
+        }
+        if (!p.spans.len) {
+            continue;
+        }
+        int r = _csv_where(&s, &p.spans, d, &p.sel, &p.buf);
+        if (r < 0) {
+            goto error;
+        }
+        if (r > 0) {
+            for (Py_ssize_t k = 0; k < a->ncols; k++) {
+                Py_ssize_t col = p.sel.cols ? p.sel.cols[k] : k;
+                if (!_arrow_cell(&p, &s, &a->cols[k], a->nrows, col)) {
+                    goto error;
+                }
+            }
+            a->nrows++;
+        } else {
+            _STAT_INC(csv_rows_rejected);
+        }
+        p.row++;
+    }
+
+    _csv_parser_free(&p);
+    return (PyObject *) batch;
+error:
+    _csv_parser_free(&p);
+    Py_XDECREF(batch);
+    return NULL;
+}
+
+/*
+ * Incremental documents
+ *
+ * IniDocument and CssDocument hold the text of a file under edit as a
+ * run of blocks: an INI section from its header line up to the next
+ * header, or one top-level CSS rule or declaration with the space before
+ * it. Each block is parsed on its own. edit() parses again from the block
+ * the edit starts in until a block ends where an old block began past
+ * the edit. The text from there on is unchanged and neither parser
+ * carries state over a block boundary, so the old blocks are kept with
+ * their offsets shifted, and an edit costs the blocks it touches plus one
+ * pass over the offsets whatever the size of the file.
+ */
+
+typedef struct {
+    Py_ssize_t beg;
+    Py_ssize_t end;
+    Py_ssize_t lines;  // newlines in [beg, end), INI only
+    PyObject *key;  // section name, prelude or property; NULL for none
+    PyObject *value;  // section dict, rule dict or declaration value
+    PyObject *errors;  // ParseErrors located in the block alone, or NULL
+} _DocBlock;
+
+typedef struct {
+    PyObject_HEAD
+    _ModState *st;
+    PyObject *text;
+    _DocBlock *blocks;
+    Py_ssize_t nblocks;
+    Py_ssize_t cap;
+    PyObject *dialect;  // the IniDialect of d, or NULL
+    const IniDialect *d;  // NULL for a CssDocument
+} Document;
+
+static void
+_doc_block_clear(_DocBlock *b) {
+    Py_CLEAR(b->key);
+    Py_CLEAR(b->value);
+    Py_CLEAR(b->errors);
+}
+
+/*
+ * Take the only item of a one-block parse result, if any.
+ */
+static void
+_doc_block_item(_DocBlock *b, PyObject *dict) {
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    if (PyDict_Next(dict, &pos, &key, &value)) {
+        b->key = Py_NewRef(key);
+        b->value = Py_NewRef(value);
+    }
+}
+
+/*
+ * First non-space character of the line at i, or its newline.
+ */
+static Py_ssize_t
+_line_indent(const _Src *s, Py_ssize_t i) {
+    while (i < s->len) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+        if (c == '\n' || !_IS_SPACE(c)) {
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+/*
+ * The INI block at line start i: its first line and every following line
+ * up to the next section header. It is parsed from a copy so that errors
+ * locate within the block.
+ */
+static bool
+_ini_doc_block(Document *self, PyObject *text, const _Src *s, Py_ssize_t i, _DocBlock *b) {
+    Py_ssize_t end = i;
+    Py_ssize_t lines = 0;
+    for (;;) {
+        Py_ssize_t nl = _find_newline(text, end, s->len);
+        if (nl < 0) {
+            end = s->len;
+            break;
+        }
+        end = nl + 1;
+        lines++;
+        Py_ssize_t c = _line_indent(s, end);
+        if (c < s->len && PyUnicode_READ(s->kind, s->data, c) == self->d->section_begin) {
+            break;
+        }
+    }
+
+    PyObject *sub = PyUnicode_Substring(text, i, end);
+    if (!sub) {
+        return false;
+    }
+    _IniParser p = {.st = self->st, .d = self->d, .on_error = _ON_ERROR_COLLECT};
+    p.doc = PyDict_New();
+    p.errors = PyList_New(0);
+    _buf_init(&p.buf);
+    _Src ss;
+    _src_init(&ss, sub, end - i);
+    Py_ssize_t k = 0;
+    bool ok = p.doc && p.errors && _parse_ini_lines(&k, sub, &ss, &p, true);
+    if (ok) {
+        _doc_block_item(b, p.doc);
+        if (PyList_GET_SIZE(p.errors) > 0) {
+            b->errors = Py_NewRef(p.errors);
+        }
+        b->beg = i;
+        b->end = end;
+        b->lines = lines;
+    }
+    _buf_free(&p.buf);
+    Py_XDECREF(p.doc);
+    Py_XDECREF(p.errors);
+    Py_DECREF(sub);
+    return ok;
+}
+
+/*
+ * One pass of the top-level loop of _parse_css_rules() from *index.
+ */
+static bool
+_css_doc_step(Py_ssize_t *index, const _Src *s, _Buf *buf, PyObject *dict) {
+    _css_skip_sp(index, s);
+    if (*index >= s->len) {
+        return true;
+    }
+    if (PyUnicode_READ(s->kind, s->data, *index) == '}') {
+        (*index)++;  // stray '}'
+        return true;
+    }
+    return _parse_css_rule(index, s, buf, dict);
+}
+
+static bool
+_css_doc_block(const _Src *s, Py_ssize_t i, _Buf *buf, _DocBlock *b) {
+    PyObject *dict = PyDict_New();
+    if (!dict) {
+        return false;
+    }
+    Py_ssize_t end = i;
+    bool ok = _css_doc_step(&end, s, buf, dict);
+    if (ok) {
+        _doc_block_item(b, dict);
+        b->beg = i;
+        b->end = end;
+    }
+    Py_DECREF(dict);
+    return ok;
+}
+
+static PyObject *
+_doc_splice(PyObject *text, Py_ssize_t start, Py_ssize_t end, PyObject *new_text) {
+    PyObject *head = PyUnicode_Substring(text, 0, start);
+    PyObject *tail = PyUnicode_Substring(text, end, PyUnicode_GET_LENGTH(text));
+    PyObject *mid = head && tail ? PyUnicode_Concat(head, new_text) : NULL;
+    PyObject *ret = mid ? PyUnicode_Concat(mid, tail) : NULL;
+    Py_XDECREF(head);
+    Py_XDECREF(tail);
+    Py_XDECREF(mid);
+    return ret;
+}
+
+/*
+ * Replace text[start:end] with new_text. Blocks are parsed again from
+ * the last one beginning before start (an INI header the edit reaches
+ * into takes its predecessor along) until one ends at an old block
+ * boundary at or after the end of the inserted text. On error the
+ * document is left as it was. Returns the re-parsed range.
+ */
+static PyObject *
+_doc_edit(Document *self, Py_ssize_t start, Py_ssize_t end, PyObject *new_text) {
+    Py_ssize_t len = PyUnicode_GET_LENGTH(self->text);
+    if (start < 0 || start > end || end > len) {
+        PyErr_SetString(PyExc_IndexError, "edit range out of bounds");
+        return NULL;
+    }
+    PyObject *text = _doc_splice(self->text, start, end, new_text);
+    if (!text) {
+        return NULL;
+    }
+    Py_ssize_t delta = PyUnicode_GET_LENGTH(new_text) - (end - start);
+    Py_ssize_t new_end = start + PyUnicode_GET_LENGTH(new_text);
+
+    Py_ssize_t lo = 0, hi = self->nblocks;
+    while (lo < hi) {
+        Py_ssize_t mid = lo + (hi - lo) / 2;
+        if (self->blocks[mid].beg < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    Py_ssize_t first = lo > 0 ? lo - 1 : 0;
+    if (self->d && first > 0) {
+        _Src old;
+        _src_init(&old, self->text, len);
+        if (start <= _line_indent(&old, self->blocks[first].beg)) {
+            first--;
+        }
+    }
+
+    _Src s;
+    _src_init(&s, text, len + delta);
+    _Buf buf;
+    _buf_init(&buf);
+    _DocBlock *fresh = NULL;
+    Py_ssize_t nfresh = 0, cap = 0;
+    Py_ssize_t from = self->nblocks ? self->blocks[first].beg : 0;
+    Py_ssize_t pos = from;
+    Py_ssize_t stop = self->nblocks;  // old blocks [first, stop) are replaced
+    Py_ssize_t m = first;
+    bool ok = true;
+    while (pos < s.len) {
+        if (pos >= new_end) {
+            while (m < self->nblocks && self->blocks[m].beg + delta < pos) {
+                m++;
+            }
+            if (m < self->nblocks && self->blocks[m].beg + delta == pos) {
+                stop = m;
+                break;
+            }
+        }
+        if (nfresh == cap) {
+            cap = cap ? 2 * cap : 4;
+            _DocBlock *tmp = PyMem_Realloc(fresh, cap * sizeof(_DocBlock));
+            if (!tmp) {
+                PyErr_NoMemory();
+                ok = false;
+                break;
+            }
+            fresh = tmp;
+        }
+        _DocBlock *b = &fresh[nfresh];
+        memset(b, 0, sizeof(*b));
+        ok = self->d ? _ini_doc_block(self, text, &s, pos, b) : _css_doc_block(&s, pos, &buf, b);
+        if (!ok) {
+            _doc_block_clear(b);
+            break;
+        }
+        nfresh++;
+        pos = b->end;
+    }
+    _buf_free(&buf);
+
+    Py_ssize_t n = self->nblocks - (stop - first) + nfresh;
+    if (ok && n > self->cap) {
+        Py_ssize_t ncap = n > 2 * self->cap ? n : 2 * self->cap;
+        _DocBlock *tmp = PyMem_Realloc(self->blocks, ncap * sizeof(_DocBlock));
+        if (tmp) {
+            self->blocks = tmp;
+            self->cap = ncap;
+        } else {
+            PyErr_NoMemory();
+            ok = false;
+        }
+    }
+    if (!ok) {
+        for (Py_ssize_t k = 0; k < nfresh; k++) {
+            _doc_block_clear(&fresh[k]);
+        }
+        PyMem_Free(fresh);
+        Py_DECREF(text);
+        return NULL;
+    }
+
+    for (Py_ssize_t k = first; k < stop; k++) {
+        _doc_block_clear(&self->blocks[k]);
+    }
+    memmove(&self->blocks[first + nfresh], &self->blocks[stop], (self->nblocks - stop) * sizeof(_DocBlock));
+    for (Py_ssize_t k = first + nfresh; k < n; k++) {
+        self->blocks[k].beg += delta;
+        self->blocks[k].end += delta;
+    }
+    if (nfresh > 0) {
+        memcpy(&self->blocks[first], fresh, nfresh * sizeof(_DocBlock));
+    }
+    PyMem_Free(fresh);
+    self->nblocks = n;
+    Py_SETREF(self->text, text);
+    return Py_BuildValue("(nn)", from, pos);
+}
+
+static Document *
+_doc_new(PyTypeObject *type, PyObject *src, PyObject *dialect, const IniDialect *d) {
+    Document *self = (Document *) type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    self->st = PyType_GetModuleState(type);
+    self->dialect = Py_XNewRef(dialect);
+    self->d = d;
+    self->text = PyUnicode_New(0, 0);
+    PyObject *range = self->text ? _doc_edit(self, 0, 0, src) : NULL;
+    if (!range) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_DECREF(range);
+    return self;
+}
+
+static void
+Document_dealloc(Document *self) {
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        _doc_block_clear(&self->blocks[k]);
+    }
+    PyMem_Free(self->blocks);
+    Py_XDECREF(self->text);
+    Py_XDECREF(self->dialect);
+    PyTypeObject *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+Document_edit(Document *self, PyObject *args) {
+    Py_ssize_t start, end;
+    PyObject *new_text;
+
+    if (!PyArg_ParseTuple(args, "nnU", &start, &end, &new_text)) {
+        return NULL;
+    }
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = _doc_edit(self, start, end, new_text);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+static PyObject *
+Document_get_text(Document *self, void *closure) {
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = Py_NewRef(self->text);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+static PyObject *
+_doc_spans(Document *self) {
+    PyObject *spans = PyList_New(self->nblocks);
+    if (!spans) {
+        return NULL;
+    }
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        const _DocBlock *b = &self->blocks[k];
+        PyObject *span = Py_BuildValue("(Onn)", b->key ? b->key : Py_None, b->beg, b->end);
+        if (!span) {
+            Py_DECREF(spans);
+            return NULL;
+        }
+        PyList_SET_ITEM(spans, k, span);
+    }
+    return spans;
+}
+
+static PyObject *
+Document_get_spans(Document *self, void *closure) {
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = _doc_spans(self);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+/*
+ * Sections of the same name merge into one dict, later keys winning, as
+ * in parse_ini().
+ */
+static PyObject *
+_ini_doc_value(Document *self) {
+    PyObject *doc = PyDict_New();
+    if (!doc) {
+        return NULL;
+    }
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        const _DocBlock *b = &self->blocks[k];
+        if (!b->key) {
+            continue;
+        }
+        PyObject *section = PyDict_GetItemWithError(doc, b->key);
+        int rc;
+        if (section) {
+            rc = PyDict_Update(section, b->value);
+        } else if (PyErr_Occurred()) {
+            rc = -1;
+        } else {
+            section = PyDict_Copy(b->value);
+            rc = section ? PyDict_SetItem(doc, b->key, section) : -1;
+            Py_XDECREF(section);
+        }
+        if (rc < 0) {
+            Py_DECREF(doc);
+            return NULL;
+        }
+    }
+    return doc;
+}
+
+static PyObject *
+IniDocument_get_doc(Document *self, void *closure) {
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = _ini_doc_value(self);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+/*
+ * The block errors placed in the whole text.
+ */
+static PyObject *
+_ini_doc_errors(Document *self) {
+    PyObject *errors = PyList_New(0);
+    if (!errors) {
+        return NULL;
+    }
+    _Src s;
+    _src_init(&s, self->text, PyUnicode_GET_LENGTH(self->text));
+    Py_ssize_t line = 0;
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        const _DocBlock *b = &self->blocks[k];
+        _Src view = {
+            .kind = s.kind,
+            .data = (const char *) s.data + b->beg * s.kind,
+            .len = b->end - b->beg,
+            .base = b->beg,
+            .base_line = line,
+        };
+        _LineMark mark;
+        _src_mark(&view, &mark);
+        for (Py_ssize_t e = 0; b->errors && e < PyList_GET_SIZE(b->errors); e++) {
+            PyObject *exc = PyList_GET_ITEM(b->errors, e);
+            PyObject *ooffset = PyObject_GetAttrString(exc, "offset");
+            PyObject *oexpected = ooffset ? PyObject_GetAttrString(exc, "expected") : NULL;
+            Py_ssize_t offset = oexpected ? PyLong_AsSsize_t(ooffset) : -1;
+            const char *expected = offset >= 0 ? PyUnicode_AsUTF8(oexpected) : NULL;
+            PyObject *placed = expected ? _new_parse_error(self->st, &view, offset, expected, NULL) : NULL;
+            int rc = placed ? PyList_Append(errors, placed) : -1;
+            Py_XDECREF(placed);
+            Py_XDECREF(oexpected);
+            Py_XDECREF(ooffset);
+            if (rc < 0) {
+                Py_DECREF(errors);
+                return NULL;
+            }
+        }
+        line += b->lines;
+    }
+    return errors;
+}
+
+static PyObject *
+IniDocument_get_errors(Document *self, void *closure) {
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = _ini_doc_errors(self);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+static PyObject *
+_css_copy(PyObject *dict) {
+    if (Py_EnterRecursiveCall(" while copying CSS")) {
+        return NULL;
+    }
+    PyObject *copy = PyDict_New();
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (copy && PyDict_Next(dict, &pos, &key, &value)) {
+        PyObject *item = PyDict_Check(value) ? _css_copy(value) : Py_NewRef(value);
+        if (!item || PyDict_SetItem(copy, key, item) < 0) {
+            Py_CLEAR(copy);
+        }
+        Py_XDECREF(item);
+    }
+    Py_LeaveRecursiveCall();
+    return copy;
+}
+
+/*
+ * Blocks whose key is unique are copied. Repeated keys merge rule into
+ * rule and let a declaration replace a rule, so their blocks are parsed
+ * again in order into the result, exactly as parse_css_blocks() goes.
+ */
+static PyObject *
+_css_doc_value(Document *self) {
+    PyObject *seen = PySet_New(NULL);
+    PyObject *repeated = PySet_New(NULL);
+    PyObject *doc = PyDict_New();
+    _Src s;
+    _src_init(&s, self->text, PyUnicode_GET_LENGTH(self->text));
+    _Buf buf;
+    _buf_init(&buf);
+    if (!seen || !repeated || !doc) {
+        goto error;
+    }
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        PyObject *key = self->blocks[k].key;
+        if (!key) {
+            continue;
+        }
+        int rc = PySet_Contains(seen, key);
+        if (rc < 0 || PySet_Add(rc ? repeated : seen, key) < 0) {
+            goto error;
+        }
+    }
+    for (Py_ssize_t k = 0; k < self->nblocks; k++) {
+        const _DocBlock *b = &self->blocks[k];
+        if (!b->key) {
+            continue;
+        }
+        int rc = PySet_Contains(repeated, b->key);
+        if (rc < 0) {
+            goto error;
+        } else if (rc) {
+            Py_ssize_t i = b->beg;
+            if (!_css_doc_step(&i, &s, &buf, doc)) {
+                goto error;
+            }
+            continue;
+        }
+        PyObject *value = PyDict_Check(b->value) ? _css_copy(b->value) : Py_NewRef(b->value);
+        rc = value ? PyDict_SetItem(doc, b->key, value) : -1;
+        Py_XDECREF(value);
+        if (rc < 0) {
+            goto error;
+        }
+    }
+    _buf_free(&buf);
+    Py_DECREF(seen);
+    Py_DECREF(repeated);
+    return doc;
+error:
+    _buf_free(&buf);
+    Py_XDECREF(seen);
+    Py_XDECREF(repeated);
+    Py_XDECREF(doc);
+    return NULL;
+}
+
+static PyObject *
+CssDocument_get_doc(Document *self, void *closure) {
+    PyObject *ret;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    ret = _css_doc_value(self);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+static PyObject *
+IniDocument_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    PyObject *src;
+    PyObject *odialect = Py_None;
+    static char *kwlist[] = {"src", "dialect", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|O", kwlist, &src, &odialect)) {
+        return NULL;
+    }
+    _ModState *st = PyType_GetModuleState(type);
+    const IniDialect *d;
+    if (!_get_ini_dialect(st, odialect, &d)) {
+        return NULL;
+    }
+    return (PyObject *) _doc_new(type, src, odialect == Py_None ? NULL : odialect, d);
+}
+
+static PyObject *
+CssDocument_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    PyObject *src;
+    static char *kwlist[] = {"src", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U", kwlist, &src)) {
+        return NULL;
+    }
+    return (PyObject *) _doc_new(type, src, NULL, NULL);
+}
+
+static PyMethodDef Document_methods[] = {
+    {"edit", (PyCFunction) Document_edit, METH_VARARGS, "edit(start, end, new_text)\n\nReplace text[start:end] with new_text and return the (beg, end) range of the new text parsed again."},
+    {NULL}
+};
+
+static PyGetSetDef IniDocument_getset[] = {
+    {"text", (getter) Document_get_text, NULL, "Current text.", NULL},
+    {"spans", (getter) Document_get_spans, NULL, "(section, beg, end) of every block; section is None for a block without one.", NULL},
+    {"doc", (getter) IniDocument_get_doc, NULL, "{section: {key: value}} as parse_ini() returns it.", NULL},
+    {"errors", (getter) IniDocument_get_errors, NULL, "ParseErrors of the malformed lines, as parse_ini(on_error='collect') returns them.", NULL},
+    {NULL}
+};
+
+static PyType_Slot IniDocument_slots[] = {
+    {Py_tp_doc, "IniDocument(src, dialect=None)\n\nINI text that edit() parses again section by section."},
+    {Py_tp_new, IniDocument_new},
+    {Py_tp_dealloc, Document_dealloc},
+    {Py_tp_methods, Document_methods},
+    {Py_tp_getset, IniDocument_getset},
+    {0, NULL}
+};
+
+static PyType_Spec IniDocument_spec = {
+    .name = "parseutils.IniDocument",
+    .basicsize = sizeof(Document),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = IniDocument_slots,
+};
+
+static PyGetSetDef CssDocument_getset[] = {
+    {"text", (getter) Document_get_text, NULL, "Current text.", NULL},
+    {"spans", (getter) Document_get_spans, NULL, "(key, beg, end) of every block, key being the rule prelude or declared property, or None.", NULL},
+    {"doc", (getter) CssDocument_get_doc, NULL, "{prelude: block} as parse_css_blocks() returns it.", NULL},
+    {NULL}
+};
+
+static PyType_Slot CssDocument_slots[] = {
+    {Py_tp_doc, "CssDocument(src)\n\nCSS text that edit() parses again rule by rule."},
+    {Py_tp_new, CssDocument_new},
+    {Py_tp_dealloc, Document_dealloc},
+    {Py_tp_methods, Document_methods},
+    {Py_tp_getset, CssDocument_getset},
+    {0, NULL}
+};
+
+static PyType_Spec CssDocument_spec = {
+    .name = "parseutils.CssDocument",
+    .basicsize = sizeof(Document),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = CssDocument_slots,
+};
+
+/*
+ * Worker pool
+ *
+ * submit() hands a call to an executor of up to four threads owned by the
+ * module state and returns its concurrent.futures.Future; asyncio code
+ * awaits it through asyncio.wrap_future(). The executor is started on
+ * first use. Since the whole-document parsers scan outside the GIL and
+ * release it between blocks, a large parse there leaves an event loop
+ * thread free to run.
+ */
+
+#define _POOL_MAX_WORKERS 4
+
+static PyObject *
+_get_pool(PyObject *module) {
+    _ModState *st = _get_state(module);
+    PyObject *pool = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(module);
+    if (st->pool) {
+        pool = Py_NewRef(st->pool);
+    } else {
+        PyObject *os = PyImport_ImportModule("os");
+        PyObject *ncpu = os ? PyObject_CallMethod(os, "cpu_count", NULL) : NULL;
+        long workers = ncpu && ncpu != Py_None ? PyLong_AsLong(ncpu) : 1;
+        if (workers > _POOL_MAX_WORKERS) {
+            workers = _POOL_MAX_WORKERS;
+        } else if (workers < 1) {
+            workers = 1;
+        }
+        PyObject *futures = ncpu && !PyErr_Occurred() ? PyImport_ImportModule("concurrent.futures") : NULL;
+        pool = futures ? PyObject_CallMethod(futures, "ThreadPoolExecutor", "ls", workers, "parseutils") : NULL;
+        Py_XDECREF(futures);
+        Py_XDECREF(ncpu);
+        Py_XDECREF(os);
+        if (pool && !st->pool) {
+            st->pool = Py_NewRef(pool);
+        } else if (pool) {
+            Py_SETREF(pool, Py_NewRef(st->pool));  // another thread won while this one imported
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return pool;
+}
+
+static PyObject *
+submit(PyObject *self, PyObject *args, PyObject *kwargs) {
+    if (PyTuple_GET_SIZE(args) < 1 || !PyCallable_Check(PyTuple_GET_ITEM(args, 0))) {
+        PyErr_SetString(PyExc_TypeError, "submit() needs a callable first argument");
+        return NULL;
+    }
+    PyObject *pool = _get_pool(self);
+    if (!pool) {
+        return NULL;
+    }
+    PyObject *method = PyObject_GetAttrString(pool, "submit");
+    Py_DECREF(pool);
+    if (!method) {
+        return NULL;
+    }
+    PyObject *future = PyObject_Call(method, args, kwargs);
+    Py_DECREF(method);
+    return future;
+}
+
+/*
+ * Serializers
+ *
+ * dump_csv(), dump_list(), dump_dict() and dump_ini() write text that
+ * the matching parsers read back into equal values, and refuse values
+ * that would not survive the trip (a negative number in a list reads
+ * back as a str). Output goes to one growable buffer. A CSV field is
+ * quoted only when the dialect class table or its numeric look calls for
+ * it; list, dict and INI strings are always quoted.
+ */
+
+static PyObject *
+_buf_to_str(const _Buf *buf) {
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buf->data, buf->len);
+}
+
+static bool
+_dump_int(_Buf *buf, PyObject *o) {
+    int overflow;
+    long long v = PyLong_AsLongLongAndOverflow(o, &overflow);
+    if (v == -1 && PyErr_Occurred()) {
+        return false;
+    }
+    if (!overflow) {
+        char tmp[32];
+        int n = PyOS_snprintf(tmp, sizeof(tmp), "%lld", v);
+        return _buf_write_ascii(buf, tmp, n);
+    }
+
+    PyObject *text = PyNumber_ToBase(o, 10);
+    if (!text) {
+        return false;
+    }
+    _Src s;
+    _src_init(&s, text, PyUnicode_GET_LENGTH(text));
+    bool ok = _buf_write_src(buf, &s, 0, s.len);
+    Py_DECREF(text);
+    return ok;
+}
+
+/*
+ * Shortest repr of a finite double in positional notation: the parsers
+ * read "1e-07" as a str, so the exponent is folded into the digits.
+ */
+static bool
+_dump_float(_Buf *buf, double v) {
+    char *r = PyOS_double_to_string(v, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+    if (!r) {
+        return false;
+    }
+    const char *e = strchr(r, 'e');
+    bool ok = true;
+    if (!e) {
+        ok = _buf_write_ascii(buf, r, strlen(r));
+    } else {
+        const char *p = r;
+        if (*p == '-') {
+            ok = _buf_push(buf, '-');
+            p++;
+        }
+        char digits[32];
+        int nd = 0;
+        for (; p < e && nd < (int) sizeof(digits); p++) {
+            if (*p != '.') {
+                digits[nd++] = *p;
+            }
+        }
+        int point = 1 + atoi(e + 1);  // digits before the decimal point
+        if (point <= 0) {
+            ok = ok && _buf_write_ascii(buf, "0.", 2);
+            for (int k = point; ok && k < 0; k++) {
+                ok = _buf_push(buf, '0');
+            }
+            ok = ok && _buf_write_ascii(buf, digits, nd);
+        } else {
+            for (int k = 0; ok && k < point; k++) {
+                ok = _buf_push(buf, k < nd ? digits[k] : '0');
+            }
+            ok = ok && _buf_push(buf, '.') &&
+                (point < nd ? _buf_write_ascii(buf, digits + point, nd - point) : _buf_push(buf, '0'));
+        }
+    }
+    PyMem_Free(r);
+    return ok;
+}
+
+/*
+ * Write s[beg:end] between quotes, quote_escape put before every quote
+ * and escape before every escape character. quote_escape is the quote
+ * itself for doubled quotes.
+ */
+static bool
+_dump_quoted(_Buf *buf, const _Src *s, Py_ssize_t beg, Py_ssize_t end, Py_UCS4 quote, Py_UCS4 escape,
+    Py_UCS4 quote_escape) {
+    if (!_buf_reserve(buf, end - beg + 2)) {
+        return false;
     }
-
-    if (!_parse_list(&i, src, len, lis, '[', ']')) {
-        Py_DECREF(lis);
-        return NULL;
+    buf->data[buf->len++] = quote;
+    Py_ssize_t run = beg;
+    for (Py_ssize_t i = beg; i < end; i++) {
+        Py_UCS4 c = PyUnicode_READ(s->kind, s->data, i);
+        if (c == quote || (c == escape && escape)) {
+            if (!_buf_write_src(buf, s, run, i) || !_buf_push(buf, c == quote ? quote_escape : escape)) {
+                return false;
+            }
+            run = i;
+        }
     }
+    return _buf_write_src(buf, s, run, end) && _buf_push(buf, quote);
+}
 
-    PyObject *tuple = PyTuple_New(2);
-    if (!tuple) {
-        Py_DECREF(lis);
-        return NULL;
-    }
+static bool
+_dump_str(_Buf *buf, PyObject *o) {
+    _Src s;
+    _src_init(&s, o, PyUnicode_GET_LENGTH(o));
+    return _dump_quoted(buf, &s, 0, s.len, '"', '\\', '\\');
+}
 
-    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
-    PyTuple_SET_ITEM(tuple, 1, lis);
+static bool
+_dump_ovalue(_Buf *buf, PyObject *o);
 
-    return tuple;
+static bool
+_dump_list(_Buf *buf, PyObject *o) {
+    if (Py_EnterRecursiveCall(" while dumping a list")) {
+        return false;
+    }
+    bool ok = _buf_push(buf, '[');
+    Py_BEGIN_CRITICAL_SECTION(o);
+    Py_ssize_t n = PyList_Check(o) ? PyList_GET_SIZE(o) : PyTuple_GET_SIZE(o);
+    PyObject **items = PyList_Check(o) ? ((PyListObject *) o)->ob_item : ((PyTupleObject *) o)->ob_item;
+    for (Py_ssize_t k = 0; ok && k < n; k++) {
+        ok = (k == 0 || _buf_write_ascii(buf, ", ", 2)) && _dump_ovalue(buf, items[k]);
+    }
+    Py_END_CRITICAL_SECTION();
+    ok = ok && _buf_push(buf, ']');
+    Py_LeaveRecursiveCall();
+    return ok;
 }
 
 static bool
-_parse_dict(Py_ssize_t *index, PyObject *src, Py_ssize_t len, PyObject *dict, int beg_brace, int end_brace) {
-    Py_ssize_t i = *index;
-    #undef _BUF_SIZE
-    #define _BUF_SIZE 1024
-    Py_UCS4 val[_BUF_SIZE] = {0};
-    size_t val_len = 0;
-
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        if (c == beg_brace) {
-            i++;
-            _skip_sp(&i, src, len);
+_dump_dict(_Buf *buf, PyObject *o) {
+    if (Py_EnterRecursiveCall(" while dumping a dict")) {
+        return false;
+    }
+    bool ok = _buf_push(buf, '{');
+    Py_BEGIN_CRITICAL_SECTION(o);
+    Py_ssize_t pos = 0;
+    PyObject *key, *val;
+    for (bool first = true; ok && PyDict_Next(o, &pos, &key, &val); first = false) {
+        if (!PyUnicode_Check(key)) {
+            PyErr_Format(PyExc_TypeError, "dict keys must be str, not %.200s", Py_TYPE(key)->tp_name);
+            ok = false;
             break;
         }
+        ok = (first || _buf_write_ascii(buf, ", ", 2)) &&
+            _dump_str(buf, key) && _buf_write_ascii(buf, ": ", 2) && _dump_ovalue(buf, val);
     }
+    Py_END_CRITICAL_SECTION();
+    ok = ok && _buf_push(buf, '}');
+    Py_LeaveRecursiveCall();
+    return ok;
+}
 
-    for (; i < len; i++) {
-        int c = PyUnicode_READ_CHAR(src, i);
-        _skip_sp(&i, src, len);
-
-        if (!_parse_string(&i, src, len, val, _BUF_SIZE, &val_len)) {
-            return false;
-        }
-
-        // read key
-        PyObject *okey = PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, val, val_len);
-        if (!okey) {
+/*
+ * A list or dict item as parse_list() and parse_dict() read it: only
+ * str, non-negative int and float, list, tuple and dict survive.
+ */
+static bool
+_dump_ovalue(_Buf *buf, PyObject *o) {
+    if (PyUnicode_Check(o)) {
+        return _dump_str(buf, o);
+    } else if (PyLong_Check(o) && !PyBool_Check(o)) {
+        int overflow;
+        long long v = PyLong_AsLongLongAndOverflow(o, &overflow);
+        if (v == -1 && PyErr_Occurred()) {
             return false;
         }
-
-        _skip_sp(&i, src, len);
-        c = PyUnicode_READ_CHAR(src, i);
-        if (c == ':') {
-            i++;
-        } else {
+        if (overflow < 0 || (!overflow && v < 0)) {
+            PyErr_Format(PyExc_ValueError, "cannot dump %R: negative numbers read back as str", o);
             return false;
         }
-
-        // read value
-        PyObject *oval = _parse_ovalue(&i, src, len, ",}");
-        if (!oval) {
+        return _dump_int(buf, o);
+    } else if (PyFloat_Check(o)) {
+        double v = PyFloat_AS_DOUBLE(o);
+        if (!isfinite(v) || signbit(v)) {
+            PyErr_Format(PyExc_ValueError, "cannot dump %R: negative and non-finite numbers read back as str", o);
             return false;
         }
+        return _dump_float(buf, v);
+    } else if (PyList_Check(o) || PyTuple_Check(o)) {
+        return _dump_list(buf, o);
+    } else if (PyDict_Check(o)) {
+        return _dump_dict(buf, o);
+    }
+    PyErr_Format(PyExc_TypeError, "cannot dump %.200s", Py_TYPE(o)->tp_name);
+    return false;
+}
 
-        // set key and value
-        if (PyDict_SetItem(dict, okey, oval) < 0) {
-            Py_DECREF(okey);
-            Py_DECREF(oval);
-            return false;
-        }
+static PyObject *
+dump_list(PyObject *self, PyObject *arg) {
+    if (!PyList_Check(arg) && !PyTuple_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "expected a list or tuple, not %.200s", Py_TYPE(arg)->tp_name);
+        return NULL;
+    }
+    _Buf buf;
+    _buf_init(&buf);
+    PyObject *ret = _dump_list(&buf, arg) ? _buf_to_str(&buf) : NULL;
+    _buf_free(&buf);
+    return ret;
+}
 
-        _skip_sp(&i, src, len);
-        c = PyUnicode_READ_CHAR(src, i);
-        if (c == ',') {
-            i++;
-            _skip_sp(&i, src, len);
-        } else if (c == end_brace) {
-            i++;
-            goto done;
-        }
+static PyObject *
+dump_dict(PyObject *self, PyObject *arg) {
+    if (!PyDict_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "expected a dict, not %.200s", Py_TYPE(arg)->tp_name);
+        return NULL;
+    }
+    _Buf buf;
+    _buf_init(&buf);
+    PyObject *ret = _dump_dict(&buf, arg) ? _buf_to_str(&buf) : NULL;
+    _buf_free(&buf);
+    return ret;
+}
 
-        i--;
+/*
+ * A str CSV field. It is quoted when it holds a separator or a line
+ * break, starts with the quote, has spaces the reader would strip or
+ * looks like a number to a typed dialect.
+ */
+static bool
+_dump_csv_str(_Buf *buf, PyObject *o, const CsvDialect *d) {
+    _Src s;
+    _src_init(&s, o, PyUnicode_GET_LENGTH(o));
+    bool quote = false;
+    if (s.len) {
+        Py_UCS4 first = PyUnicode_READ(s.kind, s.data, 0);
+        Py_UCS4 last = PyUnicode_READ(s.kind, s.data, s.len - 1);
+        quote = (_CSV_CLS(d, first) & _CSV_QUOTE) ||
+            (d->skip_initial_space && ((_CSV_CLS(d, first) | _CSV_CLS(d, last)) & _CSV_SPACE)) ||
+            (d->typed && _span_type(&s, 0, s.len) != _STR);
+    }
+    for (Py_ssize_t i = 0; !quote && i < s.len; i++) {
+        quote = _CSV_CLS(d, PyUnicode_READ(s.kind, s.data, i)) & (_CSV_SEP | _CSV_NEWLINE);
+    }
+    if (!quote) {
+        return _buf_write_src(buf, &s, 0, s.len);
     }
 
-done:
-    *index = i;
-    return true;
+    if (!d->quote) {
+        PyErr_Format(PyExc_ValueError, "cannot dump %R: it needs quoting and the dialect has no quote", o);
+        return false;
+    }
+    if (!d->doublequote && !d->escape && PyUnicode_FindChar(o, d->quote, 0, s.len, 1) >= 0) {
+        PyErr_Format(PyExc_ValueError, "cannot dump %R: it holds the quote and the dialect has no escape", o);
+        return false;
+    }
+    return _dump_quoted(buf, &s, 0, s.len, d->quote, d->escape, d->doublequote ? d->quote : d->escape);
 }
 
-PyObject *
-parse_dict(PyObject *self, PyObject *args) {
-    Py_ssize_t i;
-    PyObject *src;
-    Py_ssize_t len;
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
-        return NULL;
+static bool
+_dump_csv_field(_Buf *buf, PyObject *o, const CsvDialect *d) {
+    if (PyUnicode_Check(o)) {
+        return _dump_csv_str(buf, o, d);
+    } else if (o == Py_None) {
+        return true;
+    } else if (PyLong_CheckExact(o)) {
+        return _dump_int(buf, o);
+    } else if (PyFloat_CheckExact(o) && isfinite(PyFloat_AS_DOUBLE(o))) {
+        return _dump_float(buf, PyFloat_AS_DOUBLE(o));
     }
+    PyObject *text = PyObject_Str(o);
+    if (!text) {
+        return false;
+    }
+    bool ok = _dump_csv_str(buf, text, d);
+    Py_DECREF(text);
+    return ok;
+}
 
-    PyObject *dict = PyDict_New();
-    if (!dict) {
+static PyObject *
+dump_csv(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *rows;
+    PyObject *osep = NULL;
+    PyObject *odialect = NULL;
+    static char *kwlist[] = {"rows", "sep", "dialect", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$O", kwlist, &rows, &osep, &odialect)) {
         return NULL;
     }
-
-    if (!_parse_dict(&i, src, len, dict, '{', '}')) {
-        Py_DECREF(dict);
+    CsvDialect tmp;
+    const CsvDialect *d;
+    if (!_get_csv_dialect(st, odialect, osep, &tmp, &d)) {
         return NULL;
     }
-
-    PyObject *tuple = PyTuple_New(2);
-    if (!tuple) {
-        Py_DECREF(dict);
+    PyObject *it = PyObject_GetIter(rows);
+    if (!it) {
         return NULL;
     }
 
-    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
-    PyTuple_SET_ITEM(tuple, 1, dict);
+    _Buf buf;
+    _buf_init(&buf);
+    PyObject *row;
+    bool ok = true;
+    while (ok && (row = PyIter_Next(it))) {
+        PyObject *seq = PySequence_Fast(row, "rows must be sequences");
+        Py_DECREF(row);
+        if (!seq) {
+            ok = false;
+            break;
+        }
+        Py_BEGIN_CRITICAL_SECTION(seq);
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        size_t start = buf.len;
+        for (Py_ssize_t k = 0; ok && k < n; k++) {
+            ok = (k == 0 || _buf_push(&buf, d->sep)) &&
+                _dump_csv_field(&buf, PySequence_Fast_GET_ITEM(seq, k), d);
+        }
+        if (ok && n == 1 && buf.len == start && d->quote) {
+            // a lone empty field would make an empty line, which readers skip
+            ok = _buf_push(&buf, d->quote) && _buf_push(&buf, d->quote);
+        }
+        Py_END_CRITICAL_SECTION();
+        Py_DECREF(seq);
+        ok = ok && _buf_push(&buf, d->line_terminator);
+    }
+    Py_DECREF(it);
 
-    return tuple;
+    PyObject *ret = ok && !PyErr_Occurred() ? _buf_to_str(&buf) : NULL;
+    _buf_free(&buf);
+    return ret;
 }
 
+/*
+ * An INI value as parse_key_value() and parse_ini() read it: bare when
+ * it is one word, quoted otherwise. Line breaks cannot be written.
+ */
 static bool
-_parse_csv_line(Py_ssize_t *index, PyObject *src, Py_ssize_t len, int sep, PyObject *lis) {
-    Py_ssize_t i = *index;
-
-    for (; i < len; i++) {
-        int c1, c2;
-        c1 = c2 = 0;
-
-        c1 = PyUnicode_READ_CHAR(src, i);
-        if (i+1 < len) {
-            c2 = PyUnicode_READ_CHAR(src, i+1);
+_dump_ini_value(_Buf *buf, PyObject *o) {
+    PyObject *text = PyUnicode_Check(o) ? Py_NewRef(o) : PyObject_Str(o);
+    if (!text) {
+        return false;
+    }
+    _Src s;
+    _src_init(&s, text, PyUnicode_GET_LENGTH(text));
+    bool quote = s.len == 0 || (_CTYPE(PyUnicode_READ(s.kind, s.data, 0)) & _C_QUOTE);
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < s.len; i++) {
+        Py_UCS4 c = PyUnicode_READ(s.kind, s.data, i);
+        if (c == '\n' || c == '\r') {
+            PyErr_Format(PyExc_ValueError, "cannot dump %R: INI values are one line", text);
+            ok = false;
+            break;
         }
+        quote = quote || _IS_SPACE(c);
+    }
+    ok = ok && (quote ? _dump_quoted(buf, &s, 0, s.len, '"', '\\', '\\') : _buf_write_src(buf, &s, 0, s.len));
+    Py_DECREF(text);
+    return ok;
+}
 
-        if (c1 == '\r' && c2 == '\n') {
-            i += 2;
-            break;
-        } else if (c1 == '\n') {
-            i++;
-            break;
-        } else {
-            PyObject *o = _parse_ovalue(&i, src, len, ",\n");
-            if (!o) {
-                return false;
-            }
-            if (PyList_Append(lis, o) < 0) {
+static bool
+_dump_ini_section(_Buf *buf, PyObject *name, PyObject *section, const IniDialect *d) {
+    if (!PyDict_Check(section)) {
+        PyErr_Format(PyExc_TypeError, "section %R must be a dict, not %.200s", name, Py_TYPE(section)->tp_name);
+        return false;
+    }
+    bool ok = true;
+    Py_ssize_t n = PyUnicode_GET_LENGTH(name);
+    if (n) {
+        for (Py_ssize_t i = 0; i < n; i++) {
+            Py_UCS4 c = PyUnicode_READ_CHAR(name, i);
+            if (_IS_SPACE(c) || c == d->section_end) {
+                PyErr_Format(PyExc_ValueError, "cannot dump section %R: names are one word without %c",
+                    name, (int) d->section_end);
                 return false;
             }
-
-            for (; i < len; i++) {
-                c1 = PyUnicode_READ_CHAR(src, i);
-                if (c1 == sep) {
-                    break;
-                } else if (c1 == '\r' || c1 == '\n') {
-                    i--;
-                    break;
-                }
-            }
         }
+        _Src s;
+        _src_init(&s, name, n);
+        ok = (buf->len == 0 || _buf_push(buf, '\n')) && _buf_push(buf, d->section_begin) &&
+            _buf_write_src(buf, &s, 0, n) && _buf_push(buf, d->section_end) && _buf_push(buf, '\n');
     }
 
-    *index = i;
-    return true;
+    Py_BEGIN_CRITICAL_SECTION(section);
+    Py_ssize_t pos = 0;
+    PyObject *key, *val;
+    while (ok && PyDict_Next(section, &pos, &key, &val)) {
+        Py_ssize_t klen = PyUnicode_Check(key) ? PyUnicode_GET_LENGTH(key) : 0;
+        bool ident = klen > 0 && klen < 1024 && _is_ident_head(PyUnicode_READ_CHAR(key, 0));
+        for (Py_ssize_t i = 1; ident && i < klen; i++) {
+            ident = _is_ident(PyUnicode_READ_CHAR(key, i));
+        }
+        if (!ident) {
+            PyErr_Format(PyExc_ValueError, "cannot dump key %R: keys are identifiers", key);
+            ok = false;
+            break;
+        }
+        _Src s;
+        _src_init(&s, key, klen);
+        ok = _buf_write_src(buf, &s, 0, klen) &&
+            (d->sep == '=' ? _buf_write_ascii(buf, " = ", 3) : _buf_push(buf, d->sep) && _buf_push(buf, ' ')) &&
+            _dump_ini_value(buf, val) && _buf_push(buf, '\n');
+    }
+    Py_END_CRITICAL_SECTION();
+    return ok;
 }
 
-PyObject *
-parse_csv_line(PyObject *self, PyObject *args, PyObject *kwargs) {
-    Py_ssize_t i;
-    PyObject *src;
-    Py_ssize_t len;
-    PyObject *osep = Py_None;
-    static char *kwlist[] = {"index", "src", "len", "sep", NULL};
+static PyObject *
+dump_ini(PyObject *self, PyObject *args, PyObject *kwargs) {
+    _ModState *st = _get_state(self);
+    PyObject *sections;
+    PyObject *odialect = Py_None;
+    static char *kwlist[] = {"sections", "dialect", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nOn|O", kwlist, &i, &src, &len, &osep)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|O", kwlist, &PyDict_Type, &sections, &odialect)) {
         return NULL;
     }
-
-    PyObject *lis = PyList_New(0);
-    if (!lis) {
+    const IniDialect *d;
+    if (!_get_ini_dialect(st, odialect, &d)) {
         return NULL;
     }
 
-    const char *ssep;
-    if (osep == Py_None) {
-        ssep = ",";
-    } else {
-        ssep = PyUnicode_AsUTF8(osep);
-    }
-    if (!_parse_csv_line(&i, src, len, ssep[0], lis)) {
-        Py_DECREF(lis);
-        return NULL;
+    _Buf buf;
+    _buf_init(&buf);
+    bool ok = true;
+    // keys of the '' section come before any header
+    PyObject *empty = PyUnicode_New(0, 0);
+    PyObject *top = empty ? PyDict_GetItemWithError(sections, empty) : NULL;
+    if (top) {
+        ok = _dump_ini_section(&buf, empty, top, d);
     }
-
-    PyObject *tuple = PyTuple_New(2);
-    if (!tuple) {
-        Py_DECREF(lis);
-        return NULL;
+    ok = ok && empty && !PyErr_Occurred();
+
+    Py_BEGIN_CRITICAL_SECTION(sections);
+    Py_ssize_t pos = 0;
+    PyObject *name, *section;
+    while (ok && PyDict_Next(sections, &pos, &name, &section)) {
+        if (!PyUnicode_Check(name)) {
+            PyErr_Format(PyExc_TypeError, "section names must be str, not %.200s", Py_TYPE(name)->tp_name);
+            ok = false;
+        } else if (PyUnicode_GET_LENGTH(name)) {
+            ok = _dump_ini_section(&buf, name, section, d);
+        }
     }
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(empty);
 
-    PyTuple_SET_ITEM(tuple, 0, PyLong_FromSsize_t(i));
-    PyTuple_SET_ITEM(tuple, 1, lis);
-
-    return tuple;
+    PyObject *ret = ok ? _buf_to_str(&buf) : NULL;
+    _buf_free(&buf);
+    return ret;
 }
 
+/*
+ * Move past the next line break. "\r\n" ends with '\n' too, so the line
+ * ends after the first '\n'; a lone '\r' is not a line break.
+ */
 static void
 _skip_at_newline(Py_ssize_t *index, PyObject *src, Py_ssize_t len) {
-    Py_ssize_t i = *index;
-
-    for (; i < len; i++) {
-        int c1, c2;
-        c1 = c2 = 0;
-        c1 = PyUnicode_READ_CHAR(src, i);
-        if (i+1 < len) {
-            c2 = PyUnicode_READ_CHAR(src, i+1);
-        }
-
-        if (c1 == '\r' && c2 == '\n') {
-            i += 2;
-            break;
-        } else if (c1 == '\n') {
-            i++;
-            break;
-        }
-    }
-
-    *index = i;
+    Py_ssize_t k = _find_newline(src, *index, len);
+    *index = k < 0 ? (*index > len ? *index : len) : k + 1;
 }
 
-PyObject *
+static PyObject *
 skip_at_newline(PyObject *self, PyObject *args) {
     Py_ssize_t i;
     PyObject *src;
     Py_ssize_t len;
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    if (!PyArg_ParseTuple(args, "nUn", &i, &src, &len) ||
+        !_check_cursor(src, i, &len)) {
         return NULL;
     }
 
@@ -1451,12 +8754,40 @@ skip_at_newline(PyObject *self, PyObject *args) {
     return PyLong_FromSsize_t(i);
 }
 
-PyObject *
+/*
+ * Start offset of every line: 0 and each offset after a '\n' short of
+ * the end, so a final line break opens no empty line. One memchr pass
+ * over 1-byte strings.
+ */
+static PyObject *
+find_line_starts(PyObject *self, PyObject *src) {
+    _ModState *st = _get_state(self);
+    if (!PyUnicode_Check(src)) {
+        PyErr_Format(PyExc_TypeError, "src must be a str, not %.200s", Py_TYPE(src)->tp_name);
+        return NULL;
+    }
+    Py_ssize_t len = PyUnicode_GET_LENGTH(src);
+    Py_ssize_t *offsets = NULL;
+    size_t n = 0;
+    size_t size = 0;
+
+    bool ok = _push_offset(&offsets, &n, &size, 0);
+    for (Py_ssize_t k = _find_newline(src, 0, len); ok && k >= 0 && k + 1 < len; k = _find_newline(src, k + 1, len)) {
+        ok = _push_offset(&offsets, &n, &size, k + 1);
+    }
+
+    PyObject *arr = ok ? _new_ssize_array(st, offsets, n) : NULL;
+    PyMem_Free(offsets);
+    return arr;
+}
+
+static PyObject *
 skip_spaces(PyObject *self, PyObject *args) {
     Py_ssize_t i;
     PyObject *src;
     Py_ssize_t len;
-    if (!PyArg_ParseTuple(args, "nOn", &i, &src, &len)) {
+    if (!PyArg_ParseTuple(args, "nUn", &i, &src, &len) ||
+        !_check_cursor(src, i, &len)) {
         return NULL;
     }
 
@@ -1465,28 +8796,355 @@ skip_spaces(PyObject *self, PyObject *args) {
     return PyLong_FromSsize_t(i);
 }
 
+static PyObject *
+stats(PyObject *self, PyObject *unused) {
+    PyObject *dict = PyDict_New();
+    if (!dict) {
+        return NULL;
+    }
+#ifdef PU_STATS
+    #define _STAT_ITEM(name) \
+        { \
+            PyObject *o = PyLong_FromUnsignedLongLong( \
+                atomic_load_explicit(&_stats.name, memory_order_relaxed)); \
+            if (!o || PyDict_SetItemString(dict, #name, o) < 0) { \
+                Py_XDECREF(o); \
+                Py_DECREF(dict); \
+                return NULL; \
+            } \
+            Py_DECREF(o); \
+        }
+    _STAT_FIELDS(_STAT_ITEM)
+    #undef _STAT_ITEM
+#endif
+    return dict;
+}
+
+static PyObject *
+reset_stats(PyObject *self, PyObject *unused) {
+#ifdef PU_STATS
+    #define _STAT_RESET(name) atomic_store_explicit(&_stats.name, 0, memory_order_relaxed);
+    _STAT_FIELDS(_STAT_RESET)
+    #undef _STAT_RESET
+#endif
+    Py_RETURN_NONE;
+}
+
+/*
+ * C API
+ *
+ * The capsule parseutils._C_API holds a PyParseutils_CAPI table of thin
+ * wrappers around the scanners; parseutils.h documents it. PU_Text,
+ * PU_Span and the value types mirror _Src, _Span and _STR/_INT/_FLOAT.
+ */
+
+_Static_assert(sizeof(PU_Span) == sizeof(_Span) && offsetof(PU_Span, flags) == offsetof(_Span, flags),
+    "PU_Span must match _Span");
+_Static_assert(PU_SPAN_QUOTED == _SPAN_QUOTED && PU_SPAN_ESCAPED == _SPAN_ESCAPED, "span flags");
+_Static_assert(PU_STR == _STR && PU_INT == _INT && PU_FLOAT == _FLOAT, "value types");
+_Static_assert(PU_TAG_BEGIN == BEGIN && PU_TAG_END == END, "tag kinds");
+
+struct PU_Scanner {
+    PyObject *module;  // keeps st alive
+    _ModState *st;
+    PyObject *dialect;  // the CsvDialect of d, or NULL for the default
+    const CsvDialect *d;
+    _Spans spans;
+    _Buf buf;
+};
+
+static void
+_src_from_text(_Src *s, const PU_Text *text) {
+    s->kind = text->kind;
+    s->data = text->data;
+    s->len = text->len;
+    s->base = 0;
+    s->base_line = 0;
+    s->mark = NULL;
+}
+
+static void
+_capi_scanner_free(PU_Scanner *sc) {
+    if (!sc) {
+        return;
+    }
+    _spans_free(&sc->spans);
+    _buf_free(&sc->buf);
+    Py_XDECREF(sc->dialect);
+    Py_XDECREF(sc->module);
+    PyMem_Free(sc);
+}
+
+static PU_Scanner *
+_capi_scanner_new(PyObject *dialect) {
+    PU_Scanner *sc = PyMem_Calloc(1, sizeof(*sc));
+    if (!sc) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    _spans_init(&sc->spans);
+    _buf_init(&sc->buf);
+    // the module of the calling interpreter
+    sc->module = PyImport_ImportModule("parseutils");
+    if (!sc->module) {
+        _capi_scanner_free(sc);
+        return NULL;
+    }
+    sc->st = _get_state(sc->module);
+    CsvDialect tmp;
+    if (!_get_csv_dialect(sc->st, dialect, NULL, &tmp, &sc->d)) {
+        _capi_scanner_free(sc);
+        return NULL;
+    }
+    if (sc->d != &_csv_default) {
+        sc->dialect = Py_NewRef(dialect);
+    }
+    return sc;
+}
+
+static Py_ssize_t
+_capi_csv_row(PU_Scanner *sc, const PU_Text *text, Py_ssize_t *index, PU_FieldCallback callback, void *ctx) {
+    _Src s;
+    _src_from_text(&s, text);
+    if (!_scan_csv_row(index, &s, sc->d, &sc->spans)) {
+        return -1;
+    }
+    for (size_t k = 0; k < sc->spans.len; k++) {
+        if (callback(ctx, (Py_ssize_t) k, (const PU_Span *) &sc->spans.data[k])) {
+            return -1;
+        }
+    }
+    return (Py_ssize_t) sc->spans.len;
+}
+
+static Py_ssize_t
+_capi_csv_next_row(PU_Scanner *sc, const PU_Text *text, Py_ssize_t index, int *empty) {
+    _Src s;
+    _src_from_text(&s, text);
+    bool e;
+    Py_ssize_t end = _csv_next_row(&s, sc->d, index, &e);
+    *empty = e;
+    return end;
+}
+
+static PyObject *
+_capi_csv_field_str(PU_Scanner *sc, const PU_Text *text, const PU_Span *field) {
+    _Src s;
+    _src_from_text(&s, text);
+    return _csv_field_to_str(&s, (const _Span *) field, sc->d, &sc->buf);
+}
+
+static int
+_capi_css_item(PU_Scanner *sc, const PU_Text *text, Py_ssize_t *index,
+    const Py_UCS4 **item, Py_ssize_t *item_len, Py_ssize_t *colon) {
+    _Src s;
+    _src_from_text(&s, text);
+    _css_skip_sp(index, &s);
+    int term = _parse_css_item(index, &s, &sc->buf, colon);
+    if (term < 0) {
+        return -1;
+    }
+    *item = sc->buf.data;
+    *item_len = (Py_ssize_t) sc->buf.len;
+    return term;
+}
+
+static int
+_capi_value(PyObject *src, Py_ssize_t *index, Py_ssize_t len, unsigned end, int *type, PU_Span *value) {
+    unsigned cls = ((end & PU_END_LIST) ? _C_END_LIST : 0) |
+        ((end & PU_END_DICT) ? _C_END_DICT : 0) |
+        ((end & PU_END_TAG) ? _C_END_TAG : 0);
+    size_t val_len = 0;
+    return _parse_value(index, src, len, NULL, 0, &val_len, cls, type, (_Span *) value);
+}
+
+static int
+_capi_key_value(PyObject *src, Py_ssize_t *index, Py_ssize_t len, Py_UCS4 sep, PU_Span *key, PU_Span *value) {
+    size_t key_len, val_len;
+    return _parse_key_value(index, src, len, NULL, 0, &key_len, NULL, 0, &val_len,
+        sep, 0, (_Span *) key, (_Span *) value);
+}
+
+static int
+_capi_tag(PU_Scanner *sc, PyObject *src, Py_ssize_t *index, Py_ssize_t len,
+    PU_Span *name, PyObject *attrs, int *kind) {
+    size_t tag_name_len = 0;
+    *name = (PU_Span) {*index, *index, 0};
+    // with a name span the name is only located, never copied
+    return _parse_tag(sc->st, index, src, len, NULL, 0, &tag_name_len,
+        attrs, kind, (_Span *) name, NULL) ? 0 : -1;
+}
+
+static const PyParseutils_CAPI _capi = {
+    .version = PyParseutils_API_VERSION,
+    .size = sizeof(PyParseutils_CAPI),
+    .Scanner_New = _capi_scanner_new,
+    .Scanner_Free = _capi_scanner_free,
+    .CsvRow = _capi_csv_row,
+    .CsvNextRow = _capi_csv_next_row,
+    .CsvFieldStr = _capi_csv_field_str,
+    .CssItem = _capi_css_item,
+    .Value = _capi_value,
+    .KeyValue = _capi_key_value,
+    .Tag = _capi_tag,
+};
+
 static PyMethodDef MyMethods[] = {
-    {"parse_key_value", parse_key_value, METH_VARARGS, "Parse key and value."},
+    {"parse_key_value", (PyCFunction) parse_key_value, METH_VARARGS | METH_KEYWORDS, "Parse key and value."},
+    {"parse_key_value_many", (PyCFunction) parse_key_value_many, METH_VARARGS | METH_KEYWORDS, "Parse a sequence of key/value strings into (key, value) tuples."},
     {"parse_css_block", parse_css_block, METH_VARARGS, "Parse CSS block."},
     {"parse_css_blocks", parse_css_blocks, METH_VARARGS, "Parse CSS blocks."},
-    {"parse_tag", parse_tag, METH_VARARGS, "Parse tag."},
-    {"parse_section", parse_section, METH_VARARGS, "Parse section."},
+    {"parse_tag", (PyCFunction) parse_tag, METH_VARARGS | METH_KEYWORDS, "Parse tag."},
+    {"parse_tags", (PyCFunction) parse_tags, METH_VARARGS | METH_KEYWORDS, "Parse every tag of a document."},
+    {"parse_section", (PyCFunction) parse_section, METH_VARARGS | METH_KEYWORDS, "Parse section."},
+    {"parse_ini", (PyCFunction) parse_ini, METH_VARARGS | METH_KEYWORDS, "Parse an INI document into {section: {key: value}}."},
     {"parse_list", parse_list, METH_VARARGS, "Parse list."},
-    {"parse_dict", parse_dict, METH_VARARGS, "Parse list."},
+    {"parse_dict", (PyCFunction) parse_dict, METH_VARARGS | METH_KEYWORDS, "Parse list."},
+    {"extract", (PyCFunction) extract, METH_VARARGS | METH_KEYWORDS, "Values at key paths of a dict or list document, building nothing else."},
+    {"parse_dict_many", (PyCFunction) parse_dict_many, METH_VARARGS | METH_KEYWORDS, "Parse a sequence of dict strings into dicts."},
     {"parse_csv_line", (PyCFunction) parse_csv_line, METH_VARARGS | METH_KEYWORDS, "Parse CSV line."},
+    {"parse_csv_records", (PyCFunction) parse_csv_records, METH_VARARGS | METH_KEYWORDS, "Parse CSV with a header line into dicts."},
+    {"csv_row_starts", (PyCFunction) csv_row_starts, METH_VARARGS | METH_KEYWORDS, "Offsets of every non-empty CSV row, then len(src)."},
+    {"parse_csv_rows", (PyCFunction) parse_csv_rows, METH_VARARGS | METH_KEYWORDS, "Parse CSV rows [start_row, stop_row) into lists."},
+    {"build_csv_index", (PyCFunction) build_csv_index, METH_VARARGS | METH_KEYWORDS, "Write a row offset and dtype index of a CSV file."},
+    {"open_csv_index", open_csv_index, METH_VARARGS, "Open an index written by build_csv_index()."},
+    {"parse_csv_arrow", (PyCFunction) parse_csv_arrow, METH_VARARGS | METH_KEYWORDS, "Parse CSV with a header line into Arrow columns."},
+    {"parse_csv_file", (PyCFunction) parse_csv_file, METH_VARARGS | METH_KEYWORDS, "Parse a plain, gzip or zstd CSV file with a header line into dicts, block by block."},
+    {"parse_ini_file", (PyCFunction) parse_ini_file, METH_VARARGS | METH_KEYWORDS, "Parse a plain, gzip or zstd INI file block by block."},
+    {"submit", (PyCFunction) submit, METH_VARARGS | METH_KEYWORDS, "submit(func, /, *args, **kwargs)\n\nRun func(*args, **kwargs) on the module's worker threads and return a concurrent.futures.Future."},
+    {"stats", stats, METH_NOARGS, "Parse counters; empty unless built with PU_STATS=1."},
+    {"reset_stats", reset_stats, METH_NOARGS, "Zero the parse counters."},
+    {"dump_csv", (PyCFunction) dump_csv, METH_VARARGS | METH_KEYWORDS, "Write rows as CSV that parse_csv_line reads back."},
+    {"dump_list", dump_list, METH_O, "Write a list that parse_list reads back."},
+    {"dump_dict", dump_dict, METH_O, "Write a dict that parse_dict reads back."},
+    {"dump_ini", (PyCFunction) dump_ini, METH_VARARGS | METH_KEYWORDS, "Write {section: {key: value}} as INI that parse_ini reads back."},
     {"skip_at_newline", skip_at_newline, METH_VARARGS, "Parse list."},
+    {"find_line_starts", find_line_starts, METH_O, "Offsets of every line start as an array."},
     {"skip_spaces", skip_spaces, METH_VARARGS, "Parse list."},
     {NULL, NULL, 0, NULL}
 };
 
+static int
+parseutils_exec(PyObject *m) {
+    _ModState *st = _get_state(m);
+
+    _ctype_init();
+    _csv_dialect_init(&_csv_default, ',');
+    // PyDateTime_IMPORT would store it in the process-wide static that
+    // datetime.h declares, which every interpreter importing the module
+    // overwrites, and clears when its import fails
+    (void) PyDateTimeAPI;
+    st->datetime = PyCapsule_Import(PyDateTime_CAPSULE_NAME, 0);
+    if (!st->datetime) {
+        return -1;
+    }
+
+    st->ParseError = PyErr_NewExceptionWithDoc("parseutils.ParseError",
+        "Malformed input. offset, line and column (1-based) locate the error, "
+        "expected names the missing token.",
+        PyExc_ValueError, NULL);
+    if (!st->ParseError) {
+        return -1;
+    }
+    st->CsvDialectType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &CsvDialect_spec, NULL);
+    st->IniDialectType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &IniDialect_spec, NULL);
+    st->CsvIndexType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &CsvIndex_spec, NULL);
+    st->ArrowBatchType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &ArrowBatch_spec, NULL);
+    st->IniDocumentType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &IniDocument_spec, NULL);
+    st->CssDocumentType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &CssDocument_spec, NULL);
+    if (!st->CsvDialectType || !st->IniDialectType || !st->CsvIndexType || !st->ArrowBatchType ||
+        !st->IniDocumentType || !st->CssDocumentType) {
+        return -1;
+    }
+    PyObject *array = PyImport_ImportModule("array");
+    if (!array) {
+        return -1;
+    }
+    st->array_type = PyObject_GetAttrString(array, "array");
+    Py_DECREF(array);
+    if (!st->array_type) {
+        return -1;
+    }
+
+    if (PyModule_AddObjectRef(m, "CsvDialect", (PyObject *) st->CsvDialectType) < 0 ||
+        PyModule_AddObjectRef(m, "IniDialect", (PyObject *) st->IniDialectType) < 0 ||
+        PyModule_AddObjectRef(m, "CsvIndex", (PyObject *) st->CsvIndexType) < 0 ||
+        PyModule_AddObjectRef(m, "ArrowBatch", (PyObject *) st->ArrowBatchType) < 0 ||
+        PyModule_AddObjectRef(m, "IniDocument", (PyObject *) st->IniDocumentType) < 0 ||
+        PyModule_AddObjectRef(m, "CssDocument", (PyObject *) st->CssDocumentType) < 0 ||
+        PyModule_AddObjectRef(m, "ParseError", st->ParseError) < 0) {
+        return -1;
+    }
+    PyObject *capi = PyCapsule_New((void *) &_capi, PyParseutils_CAPSULE_NAME, NULL);
+    int rc = capi ? PyModule_AddObjectRef(m, "_C_API", capi) : -1;
+    Py_XDECREF(capi);
+    return rc;
+}
+
+static int
+parseutils_traverse(PyObject *m, visitproc visit, void *arg) {
+    _ModState *st = _get_state(m);
+    Py_VISIT(st->ParseError);
+    Py_VISIT(st->CsvDialectType);
+    Py_VISIT(st->IniDialectType);
+    Py_VISIT(st->CsvIndexType);
+    Py_VISIT(st->ArrowBatchType);
+    Py_VISIT(st->IniDocumentType);
+    Py_VISIT(st->CssDocumentType);
+    Py_VISIT(st->array_type);
+    Py_VISIT(st->pool);
+    return 0;
+}
+
+static int
+parseutils_clear(PyObject *m) {
+    _ModState *st = _get_state(m);
+    Py_CLEAR(st->ParseError);
+    Py_CLEAR(st->CsvDialectType);
+    Py_CLEAR(st->IniDialectType);
+    Py_CLEAR(st->CsvIndexType);
+    Py_CLEAR(st->ArrowBatchType);
+    Py_CLEAR(st->IniDocumentType);
+    Py_CLEAR(st->CssDocumentType);
+    Py_CLEAR(st->array_type);
+    Py_CLEAR(st->pool);
+    for (size_t k = 0; k < sizeof(st->tz_cache) / sizeof(st->tz_cache[0]); k++) {
+        Py_CLEAR(st->tz_cache[k]);
+    }
+    return 0;
+}
+
+static void
+parseutils_free(void *m) {
+    parseutils_clear((PyObject *) m);
+}
+
+static PyModuleDef_Slot parseutils_slots[] = {
+    {Py_mod_exec, parseutils_exec},
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#elif PY_VERSION_HEX >= 0x030C0000
+    // _datetime only loads into an interpreter with its own GIL from 3.13
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
 static struct PyModuleDef mymodule = {
     PyModuleDef_HEAD_INIT,
-    "parseutils",
-    "Utility for parse strings.",
-    -1,
-    MyMethods
+    .m_name = "parseutils",
+    .m_doc = "Utility for parse strings.",
+    .m_size = sizeof(_ModState),
+    .m_methods = MyMethods,
+    .m_slots = parseutils_slots,
+    .m_traverse = parseutils_traverse,
+    .m_clear = parseutils_clear,
+    .m_free = parseutils_free,
 };
 
 PyMODINIT_FUNC PyInit_parseutils(void) {
-    return PyModule_Create(&mymodule);
+    return PyModuleDef_Init(&mymodule);
 }
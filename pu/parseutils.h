@@ -0,0 +1,149 @@
+/*
+ * C API of the parseutils extension.
+ *
+ * Other extensions reach the scanners through a function table exported
+ * as the capsule parseutils._C_API:
+ *
+ *     #include "parseutils.h"
+ *
+ *     if (PyParseutils_IMPORT() < 0) {
+ *         return -1;  // in the module exec function
+ *     }
+ *     PU_Scanner *sc = PyParseutilsAPI->Scanner_New(NULL);
+ *     PU_Text text = {PyUnicode_KIND(s), PyUnicode_DATA(s), PyUnicode_GET_LENGTH(s)};
+ *     Py_ssize_t i = 0;
+ *     while (i < text.len && PyParseutilsAPI->CsvRow(sc, &text, &i, on_field, ctx) >= 0) {
+ *     }
+ *     PyParseutilsAPI->Scanner_Free(sc);
+ *
+ * Text is a kind/data/len view as in PyUnicode_KIND() and friends. Raw
+ * bytes are 1-byte text read as Latin-1; UTF-8 scans the same as long as
+ * the dialect characters are ASCII. Offsets and spans are in characters
+ * of the text, a span excluding the quotes of a quoted field.
+ *
+ * Every function needs the GIL except Value and KeyValue, which only
+ * read the str and write spans. Functions returning -1 or NULL have an
+ * exception set. Entries are only ever appended to the table; check
+ * size before using one added after version 1.
+ */
+
+#ifndef PARSEUTILS_H
+#define PARSEUTILS_H
+
+#include <Python.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PyParseutils_CAPSULE_NAME "parseutils._C_API"
+#define PyParseutils_API_VERSION 1
+
+typedef struct {
+    int kind;  // PyUnicode_1BYTE_KIND, PyUnicode_2BYTE_KIND or PyUnicode_4BYTE_KIND
+    const void *data;
+    Py_ssize_t len;
+} PU_Text;
+
+#define PU_SPAN_QUOTED 1
+#define PU_SPAN_ESCAPED 2  // contains escapes, doubled quotes or text after the closing quote, see CsvFieldStr
+
+typedef struct {
+    Py_ssize_t beg;
+    Py_ssize_t end;
+    int flags;  // PU_SPAN_*
+} PU_Span;
+
+// Value types of Value
+#define PU_STR 0
+#define PU_INT 1
+#define PU_FLOAT 2
+
+// Terminators of Value: the characters that end a scalar besides space
+#define PU_END_LIST 1  // ',' and ']'
+#define PU_END_DICT 2  // ',' and '}'
+#define PU_END_TAG 4  // '>'
+
+// Tag kinds of Tag
+#define PU_TAG_BEGIN 0
+#define PU_TAG_END 1
+
+/*
+ * Scratch space and CSV dialect of one caller; not shared between
+ * threads. Reusing it keeps the row scanners from allocating.
+ */
+typedef struct PU_Scanner PU_Scanner;
+
+/*
+ * Called for every field of a CSV row with its 0-based column. A
+ * nonzero return stops the row; CsvRow then returns -1, so set an
+ * exception first.
+ */
+typedef int (*PU_FieldCallback)(void *ctx, Py_ssize_t column, const PU_Span *field);
+
+typedef struct {
+    unsigned int version;  // PyParseutils_API_VERSION of the module
+    size_t size;  // sizeof the table of the module
+
+    // dialect is a parseutils.CsvDialect, or NULL or None for the default
+    PU_Scanner *(*Scanner_New)(PyObject *dialect);
+    void (*Scanner_Free)(PU_Scanner *sc);
+
+    // One CSV row from *index, moved past its line break. Returns the
+    // number of fields, 0 for a blank line.
+    Py_ssize_t (*CsvRow)(PU_Scanner *sc, const PU_Text *text, Py_ssize_t *index,
+        PU_FieldCallback callback, void *ctx);
+    // End of the CSV row at index without reading its fields
+    Py_ssize_t (*CsvNextRow)(PU_Scanner *sc, const PU_Text *text, Py_ssize_t index, int *empty);
+    // A field as str with escapes and doubled quotes resolved
+    PyObject *(*CsvFieldStr)(PU_Scanner *sc, const PU_Text *text, const PU_Span *field);
+
+    // One CSS item from *index (a declaration or a rule prelude), with
+    // comments dropped and whitespace collapsed into UCS4 text valid
+    // until the next call. *colon is the position of its first
+    // top-level ':' or -1. Returns the character ending the item ('{',
+    // ';' or '}', not consumed) or 0 at the end.
+    int (*CssItem)(PU_Scanner *sc, const PU_Text *text, Py_ssize_t *index,
+        const Py_UCS4 **item, Py_ssize_t *item_len, Py_ssize_t *colon);
+
+    // A list/dict scalar at *index ended by the PU_END_* characters in
+    // end, or 0. Returns 0 for malformed input, with *index at the error
+    // and no exception set.
+    int (*Value)(PyObject *src, Py_ssize_t *index, Py_ssize_t len, unsigned end,
+        int *type, PU_Span *value);
+    // "key sep value" at *index, as in parse_key_value
+    int (*KeyValue)(PyObject *src, Py_ssize_t *index, Py_ssize_t len, Py_UCS4 sep,
+        PU_Span *key, PU_Span *value);
+    // The tag at or after *index. attrs is a list receiving the offset
+    // tuples of parse_tag(offsets=True). Returns -1 with ParseError set
+    // for malformed input, *index then at the error.
+    int (*Tag)(PU_Scanner *sc, PyObject *src, Py_ssize_t *index, Py_ssize_t len,
+        PU_Span *name, PyObject *attrs, int *kind);
+} PyParseutils_CAPI;
+
+#ifndef PARSEUTILS_MODULE
+
+static PyParseutils_CAPI *PyParseutilsAPI = NULL;
+
+static inline int
+PyParseutils_IMPORT(void) {
+    PyParseutils_CAPI *api = (PyParseutils_CAPI *) PyCapsule_Import(PyParseutils_CAPSULE_NAME, 0);
+    if (!api) {
+        return -1;
+    }
+    if (api->version != PyParseutils_API_VERSION) {
+        PyErr_Format(PyExc_ImportError, "parseutils C API version %u, expected %d",
+            api->version, PyParseutils_API_VERSION);
+        return -1;
+    }
+    PyParseutilsAPI = api;
+    return 0;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,17 @@
+import os
 from setuptools import setup, Extension
 
+# PU_STATS=1 compiles in the counters behind parseutils.stats()
+define_macros = []
+if os.environ.get('PU_STATS', '') not in ('', '0'):
+    define_macros.append(('PU_STATS', '1'))
+
 module = Extension('parseutils',
-                  sources=['pu/main.c'])
+                  sources=['pu/main.c'],
+                  define_macros=define_macros)
 
 setup(name='parseutils',
       version='0.1',
       description='Utility for parse strings.',
+      headers=['pu/parseutils.h'],
       ext_modules=[module])
@@ -1,6 +1,31 @@
+import asyncio
+import concurrent.futures
+import csv
+import ctypes
+import datetime
+import gzip
+import io
+import os
+import struct
+import sys
+import tempfile
+import textwrap
 import parseutils as pu
 import unittest
 
+try:
+	import _interpreters as subinterpreters
+except ImportError:
+	try:
+		import _xxsubinterpreters as subinterpreters
+	except ImportError:
+		subinterpreters = None
+
+try:
+	import pyarrow
+except ImportError:
+	pyarrow = None
+
 class Test(unittest.TestCase):
 	def test_skip_spaces(self):
 		src = '    123'
@@ -11,6 +36,14 @@ class Test(unittest.TestCase):
 		src = '123\n223'
 		j = pu.skip_at_newline(0, src, len(src))
 		self.assertEqual(j, 4)
+		src = 'a\r\nb\rc\n\u4e00'
+		self.assertEqual([pu.skip_at_newline(i, src, len(src)) for i in range(len(src) + 1)], [3, 3, 3, 7, 7, 7, 7, 8, 8])
+
+	def test_find_line_starts(self):
+		self.assertEqual(pu.find_line_starts('').tolist(), [0])
+		self.assertEqual(pu.find_line_starts('a\r\nb\n\nc\n').tolist(), [0, 3, 5, 6])
+		self.assertEqual(pu.find_line_starts('\u4e00\nx').tolist(), [0, 2])
+		self.assertRaises(TypeError, pu.find_line_starts, b'a\n')
 
 	def test_parse_csv_line(self):
 		src = '123\n223\r\n323'
@@ -52,6 +85,105 @@ abc,def,ghi
 		self.assertEqual(rows[2][2], 'ghi')
 
 
+	def test_parse_csv_records(self):
+		src = 'id,name,score\n1,"a b",2.5\n\n2,c\n3,d,4,5\n'
+		records = pu.parse_csv_records(src)
+		self.assertEqual(len(records), 3)
+		self.assertEqual(records[0], {'id': 1, 'name': 'a b', 'score': 2.5})
+		self.assertEqual(records[1], {'id': 2, 'name': 'c', 'score': None})
+		self.assertEqual(records[2], {'id': 3, 'name': 'd', 'score': 4, None: [5]})
+		keys = [next(iter(r)) for r in records]
+		self.assertIs(keys[0], keys[1])
+
+		records = pu.parse_csv_records('a;b\n1;2', sep=';')
+		self.assertEqual(records, [{'a': 1, 'b': 2}])
+		self.assertEqual(pu.parse_csv_records(''), [])
+
+	def test_csv_usecols_where(self):
+		src = '1,abc,2.5,x\n'
+		j, row = pu.parse_csv_line(0, src, len(src), usecols=[2, 0, 9])
+		self.assertEqual(row, [2.5, 1, None])
+		j, row = pu.parse_csv_line(0, src, len(src), where=(1, '==', 'abc'))
+		self.assertEqual(row, [1, 'abc', 2.5, 'x'])
+		j, row = pu.parse_csv_line(0, src, len(src), where=(2, '>', 3))
+		self.assertEqual(j, len(src))
+		self.assertIsNone(row)
+
+		src = 'id,name,score\n1,a,2.5\n2,b,7\n3,c,x\n'
+		records = pu.parse_csv_records(src, usecols=['score', 'id'], where=('score', '>=', 2.5))
+		self.assertEqual(records, [{'score': 2.5, 'id': 1}, {'score': 7, 'id': 2}])
+		records = pu.parse_csv_records(src, usecols=[1], where=('score', '!=', 7))
+		self.assertEqual(records, [{'name': 'a'}, {'name': 'c'}])
+		with self.assertRaises(ValueError):
+			pu.parse_csv_records(src, usecols=['nope'])
+		with self.assertRaises(ValueError):
+			pu.parse_csv_records(src, where=('id', '~', 1))
+
+	def test_csv_dtypes(self):
+		src = 'id,code,score\n1,007,2.5\n-2,010,x\n3,1.2.3,4\n'
+		bad = []
+		records = pu.parse_csv_records(src, dtypes={'code': str, 'score': float}, bad_cells=bad)
+		self.assertEqual([r['id'] for r in records], [1, -2, 3])
+		self.assertEqual([r['code'] for r in records], ['007', '010', '1.2.3'])
+		self.assertEqual([r['score'] for r in records], [2.5, None, 4.0])
+		self.assertEqual(bad, [(1, 'score', 'x')])
+		with self.assertRaises(ValueError):
+			pu.parse_csv_records(src, dtypes={'score': float})
+
+		bad = []
+		records = pu.parse_csv_records(src, infer_rows=1, bad_cells=bad)
+		self.assertEqual([r['code'] for r in records], [7, 10, None])
+		self.assertEqual(bad, [(1, 'score', 'x'), (2, 'code', '1.2.3')])
+
+		src = '1e3, ,-7'
+		j, row = pu.parse_csv_line(0, src, len(src), dtypes=[float, int, 'int'])
+		self.assertEqual(row, [1000.0, None, -7])
+
+	def test_csv_datetime(self):
+		src = 'ts\n2024-02-29T12:34:56.1234567Z\n2024-03-01 09:00+09:00\n2024-03-01\n2023-02-29\n'
+		bad = []
+		records = pu.parse_csv_records(src, dtypes={'ts': datetime.datetime}, bad_cells=bad)
+		utc = datetime.timezone.utc
+		jst = datetime.timezone(datetime.timedelta(hours=9))
+		self.assertEqual(records[0]['ts'], datetime.datetime(2024, 2, 29, 12, 34, 56, 123456, tzinfo=utc))
+		self.assertIs(records[0]['ts'].tzinfo, utc)
+		self.assertEqual(records[1]['ts'], datetime.datetime(2024, 3, 1, 9, 0, tzinfo=jst))
+		self.assertEqual(records[2]['ts'], datetime.datetime(2024, 3, 1))
+		self.assertIsNone(records[3]['ts'])
+		self.assertEqual(bad, [(3, 'ts', '2023-02-29')])
+
+		records = pu.parse_csv_records(src, dtypes={'ts': 'timestamp_us'}, bad_cells=[])
+		self.assertEqual(records[1]['ts'], 1709251200000000)
+
+	def test_csv_dialect(self):
+		d = pu.CsvDialect(sep=';')
+		self.assertEqual(d.sep, ';')
+		src = 'a;b c;"x;y";1.5;007\r\nnext'
+		j, row = pu.parse_csv_line(0, src, len(src), dialect=d)
+		self.assertEqual(j, 21)
+		self.assertEqual(row, ['a', 'b c', 'x;y', 1.5, 7])
+		j, row = pu.parse_csv_line(0, src, len(src), sep=';')
+		self.assertEqual(row, ['a', 'b c', 'x;y', 1.5, 7])
+
+		d = pu.CsvDialect(sep='\t', quote=None, typed=False)
+		src = '1\t"2"\t\t3'
+		j, row = pu.parse_csv_line(0, src, len(src), dialect=d)
+		self.assertEqual(row, ['1', '"2"', '', '3'])
+
+		with self.assertRaises(TypeError):
+			pu.CsvDialect(sep=';;')
+		with self.assertRaises(ValueError):
+			pu.CsvDialect(sep='"')
+
+	def test_ini_dialect(self):
+		d = pu.IniDialect(sep=':', section_begin='<', section_end='>')
+		src = '< abc >'
+		j, name = pu.parse_section(0, src, len(src), dialect=d)
+		self.assertEqual(name, 'abc')
+		src = 'key : value'
+		j, key, val = pu.parse_key_value(0, src, len(src), dialect=d)
+		self.assertEqual((key, val), ('key', 'value'))
+
 	def test_parse_dict(self):
 		src = '{ "hige": 123, \'moe\': \'223\'}'
 		j, d = pu.parse_dict(0, src, len(src))
@@ -71,6 +203,18 @@ abc,def,ghi
 		self.assertEqual(d['moe']['aaa'], 1)
 		self.assertEqual(d['moe']['bbb'], 2)
 
+	def test_extract(self):
+		src = '{"a": {"b": [1, {"c": "x}]"}], "d": 2.5}, "e": [[3]], "a.b": 4}'
+		self.assertEqual(pu.extract(src, ['a.b[1].c', 'a.d', 'e[0][0]', 'a.b', 'a.b[0]', 'a.x', 'e[5]', ('a.b',)], default=0),
+			['x}]', 2.5, 3, [1, {'c': 'x}]'}], 1, 0, 0, 4])
+		self.assertEqual(pu.extract('[1, {"a": 2}]', ['[1].a', '']), [2, [1, {'a': 2}]])
+		self.assertEqual(pu.extract('{"a": 1, broken', ['a']), [1])
+		self.assertRaises(pu.ParseError, pu.extract, '{"a" 1}', ['b'])
+		self.assertRaises(pu.ParseError, pu.extract, '1', ['a'])
+		for path in ['a..b', '.a', 'a[', 'a[-1]', ('a', -1)]:
+			self.assertRaises(ValueError, pu.extract, src, [path])
+		self.assertRaises(TypeError, pu.extract, src, 'a')
+
 	def test_parse_list(self):
 		src = '[1, 3.14, "abc", \'def\']'
 		j, lis = pu.parse_list(0, src, len(src))
@@ -158,6 +302,16 @@ hoge = moge
 		self.assertEqual(tag_name, 'a')
 		self.assertEqual(tag_type, 'end')
 
+		self.assertEqual(pu.parse_tag(0, '<input disabled>', 16), (16, 'input', 'begin', {'disabled': ''}))
+		src = '<input disabled type="x">'
+		self.assertEqual(pu.parse_tag(0, src, len(src))[3], {'disabled': '', 'type': 'x'})
+		src = '<a b c="d">'
+		self.assertEqual(pu.parse_tag(0, src, len(src))[3], {'b': '', 'c': 'd'})
+		src = '<br clear/>'
+		self.assertEqual(pu.parse_tag(0, src, len(src)), (11, 'br', 'begin', {'clear': ''}))
+		self.assertEqual(pu.parse_tags('<p><input disabled></p>'),
+			pu.parse_tags('<p><input disabled=""></p>'))
+
 	def test_parse_css_blocks(self):
 		src = """
 :root > #hoge {
@@ -207,6 +361,30 @@ header {
 		self.assertEqual(blocks['p']['font-size'], '1rem')
 		self.assertEqual(blocks['header']['background'], 'var(--color-bg)')
 
+	def test_parse_css_blocks_robust(self):
+		src = """
+/* header; { } */
+@supports (display: grid) {
+	@media screen and (min-width: 10px) {
+		a:hover, b > c {
+			content: "x;}";
+			color : red /* note */ !important;
+		}
+	}
+}
+.icon { background: url(data:image/png;base64,AAAA); }
+div { margin: 0 }
+div { padding: 1px; }
+"""
+		j, blocks = pu.parse_css_blocks(0, src, len(src))
+		self.assertEqual(j, len(src))
+		inner = blocks['@supports (display: grid)']['@media screen and (min-width: 10px)']['a:hover, b > c']
+		self.assertEqual(inner['content'], '"x;}"')
+		self.assertEqual(inner['color'], 'red !important')
+		self.assertEqual(blocks['.icon']['background'], 'url(data:image/png;base64,AAAA)')
+		self.assertEqual(blocks['div']['margin'], '0')
+		self.assertEqual(blocks['div']['padding'], '1px')
+
 	def test_parse_css_block(self):
 		src = """a {}    """
 		j, ident, block = pu.parse_css_block(0, src, len(src))
@@ -225,6 +403,16 @@ header {
 		self.assertEqual(block['background'], 'red')
 		self.assertEqual(block['padding'], '1rem 2rem')
 
+	def test_unicode_classes(self):
+		# U+012C would be truncated to ',' by a char-based terminator test
+		src = '[1, \u012cx, abc.def, 12abc, 2.5]'
+		j, lis = pu.parse_list(0, src, len(src))
+		self.assertEqual(lis, [1, '\u012cx', 'abc.def', '12abc', 2.5])
+		self.kv_eq('\u540d\u524d = \u5024', 6, '\u540d\u524d', '\u5024')
+		src = '<div \u30c7\u30fc\u30bf="x">'
+		j, tag_name, tag_type, attrs = pu.parse_tag(0, src, len(src))
+		self.assertEqual(attrs['\u30c7\u30fc\u30bf'], 'x')
+
 	def kv_eq(self, src, i, key, val):
 		j, k, v = pu.parse_key_value(0, src, len(src))
 		self.assertEqual(j, i)
@@ -244,5 +432,407 @@ header {
 		self.kv_eq('abc="  \\"def  "', 15, 'abc', '  "def  ')
 		self.kv_eq("abc='def'", 9, 'abc', 'def')
 
+	def test_csv_doublequote(self):
+		src = 'a,"say ""hi""",1\r\n"x\r\ny","",""""\r\n'
+		self.assertEqual(pu.parse_csv_rows(src), [['a', 'say "hi"', 1], ['x\r\ny', '', '"']])
+		self.assertEqual(pu.csv_row_starts(src).tolist(), [0, 18, len(src)])
+		backslash = pu.CsvDialect(escape='\\', doublequote=False)
+		self.assertEqual(pu.parse_csv_rows('"a\\"b",""', dialect=backslash), [['a"b', '']])
+		self.assertTrue(pu.CsvDialect(escape='"').doublequote)
+		self.assertIsNone(pu.CsvDialect().escape)
+		src = 'h1,h2\n"ab"cd,e\n"a\\"b",c\n"x"y""z,"1"2\n'
+		self.assertEqual(pu.parse_csv_rows(src), list(csv.reader(io.StringIO(src))))
+		self.assertEqual(pu.parse_csv_rows('"x"  ,"y" z\n'), [['x', 'y z']])
+		rows = [['say "hi"', '"q', 'a\\b', 'x\ny']]
+		for d in [pu.CsvDialect(), backslash, pu.CsvDialect(escape='\\')]:
+			self.assertEqual(pu.parse_csv_rows(pu.dump_csv(rows, dialect=d), dialect=d), rows)
+		self.assertEqual(pu.dump_csv(rows), 'say "hi","""q",a\\b,"x\ny"\n')
+
+	def test_offsets(self):
+		src = 'a, "b""c",1\nx'
+		j, pos, flags = pu.parse_csv_line(0, src, len(src), offsets=True)
+		self.assertEqual(j, 12)
+		self.assertEqual(list(pos), [0, 1, 4, 8, 10, 11])
+		self.assertEqual(flags, b'\x00\x03\x00')
+		j, pos, flags = pu.parse_csv_line(0, src, len(src), offsets=True, usecols=[2, 5])
+		self.assertEqual(list(pos), [10, 11, -1, -1])
+		src = 'key = "v\\"x"'
+		j, k, v = pu.parse_key_value(0, src, len(src), offsets=True)
+		self.assertEqual((j, k, v), (12, (0, 3), (7, 11, True)))
+		src = '<a href="x y" id=1>'
+		j, name, tag_type, attrs = pu.parse_tag(0, src, len(src), offsets=True)
+		self.assertEqual(name, (1, 2))
+		self.assertEqual([(src[a:b], src[c:d]) for a, b, c, d, e in attrs], [('href', 'x y'), ('id', '1')])
+		src = '{"k e": [1, "]", {"a": 2}], "b": 3}'
+		j, items = pu.parse_dict(0, src, len(src), offsets=True)
+		self.assertEqual(j, len(src))
+		self.assertEqual([(src[a:b], src[c:d]) for a, b, c, d, e in items], [('k e', '[1, "]", {"a": 2}]'), ('b', '3')])
+		self.assertEqual(pu.parse_dict(0, src, len(src))[1], {'k e': [1, ']', {'a': 2}], 'b': 3})
+
+	def test_csv_index(self):
+		src = 'id,name,score\n1,"a,\nb",1.5\n\n2,\u540d,2\n3,c,\n'
+		with tempfile.TemporaryDirectory() as tmp:
+			path = os.path.join(tmp, 'a.csv')
+			index_path = os.path.join(tmp, 'a.idx')
+			with open(path, 'w', encoding='utf-8', newline='') as f:
+				f.write(src)
+			self.assertEqual(pu.build_csv_index(path, index_path), 3)
+			with pu.open_csv_index(index_path) as idx:
+				self.assertEqual(len(idx), 3)
+				self.assertEqual(idx.columns, ('id', 'name', 'score'))
+				self.assertEqual(idx.dtypes, {'id': 'int', 'name': 'str', 'score': 'float'})
+				self.assertEqual(idx.offset(1), len('id,name,score\n1,"a,\nb",1.5\n\n'))
+				self.assertEqual(idx.rows(1), [[2, '\u540d', 2.0], [3, 'c', None]])
+				self.assertEqual(idx.records(0, 1), [{'id': 1, 'name': 'a,\nb', 'score': 1.5}])
+				offsets = [idx.offset(k) for k in range(4)]
+			self.assertRaises(ValueError, idx.rows)
+			self.assertRaises(ValueError, pu.open_csv_index, path)
+			with open(index_path, 'rb') as f:
+				data = f.read()
+			packed = struct.pack('=4Q', *offsets)
+			self.assertIn(packed, data)
+			o0, o1, o2, o3 = offsets
+			for bad in ((o0, 1 << 40, o2, o3), (o0, o2, o1, o3), (o3 + 1, o1, o2, o3)):
+				with open(index_path, 'wb') as f:
+					f.write(data.replace(packed, struct.pack('=4Q', *bad)))
+				self.assertRaises(ValueError, pu.open_csv_index, index_path)
+			with open(index_path, 'wb') as f:
+				f.write(data)
+			os.utime(path, ns=(0, 0))
+			self.assertRaises(ValueError, pu.open_csv_index, index_path)
+
+	def test_parse_file(self):
+		src = 'id,name\n1,"\u540d ""x""\ny"\r\n\n2,b\n3,c\n'
+		ini = '[a]\nk = "v \u540d"\nbad\n[b]\nx = 1\n'
+		with tempfile.TemporaryDirectory() as tmp:
+			for name, opener in [('a.csv', open), ('a.csv.gz', gzip.open)]:
+				path = os.path.join(tmp, name)
+				with opener(path, 'wt', encoding='utf-8', newline='') as f:
+					f.write(src)
+				for block_size in (1, 5, 1 << 20):
+					for prefetch in (False, True):
+						self.assertEqual(pu.parse_csv_file(path, block_size=block_size, prefetch=prefetch, infer_rows=2),
+							pu.parse_csv_records(src, infer_rows=2))
+			path = os.path.join(tmp, 'a.ini.gz')
+			with gzip.open(path, 'wt', encoding='utf-8') as f:
+				f.write(ini)
+			doc, errors = pu.parse_ini_file(path, block_size=3, on_error='collect')
+			self.assertEqual(doc, {'a': {'k': 'v \u540d'}, 'b': {'x': '1'}})
+			self.assertEqual((errors[0].line, errors[0].offset), (3, 17))
+			with self.assertRaises(pu.ParseError) as cm:
+				pu.parse_ini_file(path, block_size=4)
+			self.assertEqual((cm.exception.line, cm.exception.column), (3, 4))
+			self.assertRaises(ValueError, pu.parse_csv_file, path, block_size=0)
+
+	def test_csv_arrow(self):
+		src = 'id,name,score,ts\n1,"a ""q""",1.5,2024-01-02T03:04:05+01:00\n2,\u540d,,2024-01-02\n,c,3,x\n\n4\n'
+		bad_cells = []
+		batch = pu.parse_csv_arrow(src, bad_cells=bad_cells, infer_rows=2)
+		self.assertEqual(len(batch), 4)
+		self.assertEqual(batch.columns, ('id', 'name', 'score', 'ts'))
+		self.assertEqual(batch.dtypes, {'id': 'int', 'name': 'str', 'score': 'float', 'ts': 'datetime'})
+		self.assertEqual(bad_cells, [(2, 'ts', 'x')])
+
+		class Array(ctypes.Structure):
+			pass
+		Array._fields_ = [('length', ctypes.c_int64), ('null_count', ctypes.c_int64), ('offset', ctypes.c_int64),
+			('n_buffers', ctypes.c_int64), ('n_children', ctypes.c_int64), ('buffers', ctypes.POINTER(ctypes.c_void_p)),
+			('children', ctypes.POINTER(ctypes.POINTER(Array))), ('dictionary', ctypes.c_void_p),
+			('release', ctypes.c_void_p), ('private_data', ctypes.c_void_p)]
+		get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+		get_pointer.restype = ctypes.c_void_p
+		get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+		schema, array = batch.__arrow_c_array__()
+		self.assertIsNotNone(get_pointer(schema, b'arrow_schema'))
+		parent = Array.from_address(get_pointer(array, b'arrow_array'))
+		self.assertEqual((parent.length, parent.n_children), (4, 4))
+		ids = parent.children[0].contents
+		self.assertEqual((ids.length, ids.null_count, ids.n_buffers), (4, 1, 2))
+		self.assertEqual(ctypes.cast(ids.buffers[0], ctypes.POINTER(ctypes.c_uint8))[0], 0b1011)
+		self.assertEqual(ctypes.cast(ids.buffers[1], ctypes.POINTER(ctypes.c_int64))[:4], [1, 2, 0, 4])
+		del schema, array, parent, ids
+
+		if pyarrow:
+			rb = pyarrow.record_batch(batch)
+			rb.validate(full=True)
+			self.assertEqual(str(rb.schema.field('ts').type), 'timestamp[us, tz=UTC]')
+			self.assertEqual(rb.to_pydict()['name'], ['a "q"', '\u540d', 'c', None])
+			self.assertEqual(rb.to_pydict()['score'], [1.5, None, 3.0, None])
+		self.assertEqual(len(pu.parse_csv_arrow('a,b\n1,2\n3,4\n', where=('a', '>', 1), usecols=['b'])), 1)
+
+	def test_documents(self):
+		src = 'top = 1\n[a]\nx = 1\n[b]\ny = 2\noops\n[a]\nz = 3\n'
+		doc = pu.IniDocument(src)
+		self.assertEqual(doc.spans, [('', 0, 8), ('a', 8, 18), ('b', 18, 33), ('a', 33, 43)])
+		self.assertEqual(doc.doc, {'': {'top': '1'}, 'a': {'x': '1', 'z': '3'}, 'b': {'y': '2'}})
+		self.assertEqual([(e.offset, e.line) for e in doc.errors], [(32, 6)])
+		self.assertEqual(doc.edit(28, 32, 'w = 4'), (18, 34))
+		self.assertEqual(doc.spans[-1], ('a', 34, 44))
+		self.assertEqual(doc.errors, [])
+		self.assertEqual(doc.edit(18, 19, ''), (8, 33))  # drops the [b] header
+		self.assertEqual(doc.doc, {'': {'top': '1'}, 'a': {'x': '1', 'y': '2', 'w': '4', 'z': '3'}})
+		self.assertEqual([e.expected for e in doc.errors], ['key/value separator'])
+		self.assertRaises(IndexError, doc.edit, 5, 100, '')
+
+		def check(doc, parse):
+			fresh = type(doc)(doc.text)
+			self.assertEqual(doc.spans, fresh.spans)
+			self.assertEqual(doc.doc, parse(doc.text))
+
+		edits = [(0, 0, '[s]\n'), (3, 4, ''), (0, 4, ' [t] \n'), (5, 5, 'k = "v"\n[u'), (9, 9, '\n')]
+		doc = pu.IniDocument('a = b\n[s]\nc = d\n')
+		for edit in edits:
+			doc.edit(*edit)
+			check(doc, lambda s: pu.parse_ini(s, on_error='skip'))
+
+		src = '@import url(x.css);\na { color: red; }\nb { c: d }\na { margin: 0; p { e: f } }\n'
+		doc = pu.CssDocument(src)
+		self.assertEqual([key for key, beg, end in doc.spans], ['@import', 'a', 'b', 'a', None])
+		self.assertEqual(doc.doc, pu.parse_css_blocks(0, src, len(src))[1])
+		self.assertEqual(doc.edit(45, 46, 'x'), (37, 48))
+		self.assertEqual(doc.doc['b'], {'c': 'x'})
+		edits = [(20, 20, '/* '), (40, 40, ' */'), (0, 0, 'q {'), (2, 3, ''), (30, 31, '}'), (5, 5, '"}"')]
+		for edit in edits:
+			doc.edit(*edit)
+			check(doc, lambda s: pu.parse_css_blocks(0, s, len(s))[1])
+
+	def test_parse_csv_rows(self):
+		src = 'a,b\n1,"x\ny"\n\n2,z\n3,w'
+		starts = pu.csv_row_starts(src)
+		self.assertEqual(list(starts), [0, 4, 13, 17, 20])
+		self.assertEqual(pu.parse_csv_rows(src, 1, 3), [[1, 'x\ny'], [2, 'z']])
+		self.assertEqual(pu.parse_csv_rows(src, 2, row_starts=starts), [[2, 'z'], [3, 'w']])
+		self.assertEqual(pu.parse_csv_rows(src, 9), [])
+		self.assertEqual(pu.parse_csv_rows(src, 1, where=(0, '>', 1)), [[2, 'z'], [3, 'w']])
+		self.assertRaises(TypeError, pu.parse_csv_rows, src, 1, row_starts=b'1234')
+
+	def test_parse_many(self):
+		items = ['k%d = "v\\"%d"' % (i, i) for i in range(5000)] + ['a=b', '', 'x']
+		expect = [pu.parse_key_value(0, s, len(s))[1:] for s in items]
+		self.assertEqual(pu.parse_key_value_many(items), expect)
+		self.assertEqual(pu.parse_key_value_many(items, threads=4), expect)
+		self.assertEqual(pu.parse_key_value_many(['a: 1'], dialect=pu.IniDialect(sep=':')), [('a', '1')])
+		items = ['{"a": %d, "b\\"": [1, "x"], \'c\': w, "d": ""}' % i for i in range(5000)] + ['{}', '{"k": ' + '[' * 100 + ']' * 100 + '}']
+		expect = [pu.parse_dict(0, s, len(s))[1] for s in items]
+		self.assertEqual(pu.parse_dict_many(items), expect)
+		self.assertEqual(pu.parse_dict_many(items, threads=4), expect)
+		self.assertRaises(pu.ParseError, pu.parse_dict_many, ['{"k": "' + 'x' * 1024 + '"}'])
+		self.assertRaises(ValueError, pu.parse_dict_many, ['{1}'])
+		self.assertRaises(TypeError, pu.parse_dict_many, [b'{}'])
+
+	def test_stats(self):
+		pu.reset_stats()
+		src = 'a,"b",99999999999999999999999\n'
+		pu.parse_csv_line(0, src, len(src))
+		stats = pu.stats()
+		if not stats:
+			return  # built without PU_STATS
+		self.assertEqual(stats['csv_rows'], 1)
+		self.assertEqual(stats['csv_fields'], 3)
+		self.assertEqual(stats['csv_quoted_fields'], 1)
+		self.assertEqual(stats['numeric_fallbacks'], 1)
+		pu.reset_stats()
+		self.assertEqual(pu.stats()['csv_rows'], 0)
+
+	def parse_error(self, func, src):
+		with self.assertRaises(pu.ParseError) as cm:
+			func(0, src, len(src))
+		e = cm.exception
+		return e.offset, e.line, e.column, e.expected
+
+	def test_parse_error(self):
+		self.assertTrue(issubclass(pu.ParseError, ValueError))
+		self.assertEqual(self.parse_error(pu.parse_dict, '{"a" 1}'), (5, 1, 6, "':'"))
+		self.assertEqual(self.parse_error(pu.parse_dict, '{\n"a": 1 2}'), (9, 2, 8, "',' or '}'"))
+		self.assertEqual(self.parse_error(pu.parse_dict, '{a: 1}'), (1, 1, 2, 'a quoted key'))
+		self.assertEqual(self.parse_error(pu.parse_list, '[1 2]'), (3, 1, 4, "',' or ']'"))
+		self.assertEqual(self.parse_error(pu.parse_list, '[1,'), (3, 1, 4, 'a value'))
+		self.assertEqual(self.parse_error(pu.parse_key_value, 'a="x'), (4, 1, 5, 'closing quote'))
+		self.assertEqual(self.parse_error(pu.parse_tag, '<a x=1'), (6, 1, 7, "'>'"))
+		self.assertEqual(self.parse_error(pu.parse_section, '[abc'), (4, 1, 5, "']'"))
+		self.assertEqual(pu.parse_dict(0, '{}', 2), (2, {}))
+		self.assertEqual(pu.parse_list(0, '[1, 2,]', 7), (7, [1, 2]))
+		self.assertEqual(pu.parse_tag(0, '<br />', 6), (6, 'br', 'begin', {}))
+		self.assertRaises(ValueError, pu.parse_list, -1, '[]', 2)
+		self.assertRaises(ValueError, pu.parse_css_block, -5, 'b:c', 3)
+		self.assertRaises(ValueError, pu.parse_css_blocks, -5, 'a{b:c}', 6)
+		self.assertRaises(TypeError, pu.parse_list, 0, b'[]', 2)
+
+	def test_on_error(self):
+		csv = 'a,b\n1,2\nx,4\n6,7\n'
+		self.assertRaises(ValueError, pu.parse_csv_records, csv, dtypes={'a': int})
+		self.assertEqual(pu.parse_csv_records(csv, dtypes={'a': int}, on_error='skip'), [{'a': 1, 'b': 2}, {'a': 6, 'b': 7}])
+		records, errors = pu.parse_csv_records(csv, dtypes={'a': int}, on_error='collect')
+		self.assertEqual(len(records), 2)
+		self.assertEqual([(e.line, e.offset) for e in errors], [(3, 8)])
+		ini = 'a = 1\n[s]\nbad\nb = "2"\n[t\nc = 3\n[u]\nd = 4\n'
+		self.assertRaises(pu.ParseError, pu.parse_ini, ini)
+		self.assertEqual(pu.parse_ini(ini, on_error='skip'), {'': {'a': '1'}, 's': {'b': '2'}, 'u': {'d': '4'}})
+		doc, errors = pu.parse_ini(ini, on_error='collect')
+		self.assertEqual([(e.line, e.expected) for e in errors], [(3, 'key/value separator'), (5, 'section end')])
+		html = '<!doctype html><a href="x">t</a><!-- <b> --><p x=">'
+		self.assertRaises(pu.ParseError, pu.parse_tags, html)
+		tags, errors = pu.parse_tags(html, on_error='collect')
+		self.assertEqual(tags, [('a', 'begin', {'href': 'x'}), ('a', 'end', {})])
+		self.assertEqual([e.offset for e in errors], [len(html)])
+		self.assertRaises(ValueError, pu.parse_tags, html, on_error='ignore')
+
+	def test_dump(self):
+		d = {'a': 1, 'b': [1.5, 1e-7, 1e22, 'x"y\\z', [], {}], 'c': {'d': 10 ** 30}}
+		src = pu.dump_dict(d)
+		self.assertEqual(pu.parse_dict(0, src, len(src)), (len(src), d))
+		self.assertEqual(pu.dump_list([1, (2, 'a')]), '[1, [2, "a"]]')
+		self.assertRaises(ValueError, pu.dump_list, [-1])
+		self.assertRaises(TypeError, pu.dump_list, [None])
+		self.assertRaises(TypeError, pu.dump_dict, {1: 2})
+
+		rows = [[1, -2, 1.5, 'x', '12', ' pad', 'a,b', 'q"x', 'l\nb', None], [''], ['x']]
+		src = pu.dump_csv(rows)
+		self.assertEqual(src, '1,-2,1.5,x,"12"," pad","a,b",q"x,"l\nb",\n""\nx\n')
+		parsed, i = [], 0
+		while i < len(src):
+			i, row = pu.parse_csv_line(i, src, len(src))
+			parsed.append(row)
+		self.assertEqual(parsed, [[1, -2, 1.5, 'x', '12', ' pad', 'a,b', 'q"x', 'l\nb', ''], [''], ['x']])
+		self.assertEqual(pu.dump_csv([['a;b', 1]], ';'), '"a;b";1\n')
+
+		ini = {'db': {'host': 'x y', 'port': '5432', 'q': '"a'}, '': {'top': '1'}}
+		src = pu.dump_ini(ini)
+		self.assertEqual(src, 'top = 1\n\n[db]\nhost = "x y"\nport = 5432\nq = "\\"a"\n')
+		self.assertEqual(pu.parse_ini(src), ini)
+		self.assertRaises(ValueError, pu.dump_ini, {'s': {'k': 'a\nb'}})
+		self.assertRaises(ValueError, pu.dump_ini, {'s': {'no key': '1'}})
+
+	def test_threads(self):
+		csv = 'a,b,t\n' + ''.join('%d,"x%d",2020-01-01T00:00:00+0%d:00\n' % (k, k, k % 9) for k in range(200))
+		ini = ''.join('[s%d]\nk = "v%d"\n' % (k, k) for k in range(50))
+		src = '{"a": [1, 2.5, "x"], "b": {"c": "d"}}'
+		jobs = [
+			lambda: pu.parse_csv_records(csv, dtypes={'t': datetime.datetime}),
+			lambda: pu.parse_csv_rows(csv, 10, 20, dialect=pu.CsvDialect(typed=False)),
+			lambda: pu.parse_ini(ini),
+			lambda: pu.parse_tags('<a href="x"><b>t</b></a>' * 50),
+			lambda: pu.parse_dict(0, src, len(src)),
+			lambda: pu.parse_key_value_many(['k%d = v' % k for k in range(3000)], threads=2),
+			lambda: [str(e) for e in pu.parse_ini('[x\ny\n', on_error='collect')[1]],
+		]
+		expected = [job() for job in jobs]
+		with concurrent.futures.ThreadPoolExecutor(8) as pool:
+			for _ in range(20):
+				futures = [pool.submit(job) for job in jobs for _ in range(4)]
+				self.assertEqual([f.result() for f in futures], [e for e in expected for _ in range(4)])
+
+	def test_submit(self):
+		# large enough for the scans to run without the GIL, in several blocks
+		csv = 'a,b\n' + ''.join('%d,"x\n%d"\n' % (k, k) for k in range(60000))
+		ini = ''.join('[s%d]\nk = "v\\"%d"\n' % (k, k) for k in range(30000)) + 'bad\n'
+		futures = [pu.submit(pu.parse_csv_records, csv), pu.submit(pu.parse_csv_rows, csv, 59990),
+			pu.submit(pu.parse_ini, ini, on_error='collect')]
+		records = futures[0].result()
+		self.assertEqual(len(records), 60000)
+		self.assertEqual(records[-1], {'a': 59999, 'b': 'x\n59999'})
+		self.assertEqual(futures[1].result(), [[k, 'x\n%d' % k] for k in range(59989, 60000)])
+		doc, errors = futures[2].result()
+		self.assertEqual((len(doc), doc['s29999'], len(errors)), (30000, {'k': 'v"29999'}, 1))
+		self.assertEqual((errors[0].line, errors[0].offset), (60001, len(ini) - 1))
+		self.assertRaises(pu.ParseError, pu.submit(pu.parse_ini, '[s\n').result)
+		self.assertRaises(TypeError, pu.submit, None)
+
+		async def parse():
+			return await asyncio.wrap_future(pu.submit(pu.parse_ini, '[s]\nk = v\n'))
+		self.assertEqual(asyncio.run(parse()), {'s': {'k': 'v'}})
+
+	def test_adversarial(self):
+		# nesting is bounded by the recursion limit, not the C stack
+		deep = '[' * 100000 + ']' * 100000
+		self.assertRaises(RecursionError, pu.parse_list, 0, deep, len(deep))
+		deep = '{"a":' * 100000 + '1' + '}' * 100000
+		self.assertRaises(RecursionError, pu.parse_dict, 0, deep, len(deep))
+		self.assertRaises(RecursionError, pu.parse_dict, 0, deep, len(deep), offsets=True)
+		# offsets=True and extract() read what parse_dict() reads
+		src = '{"a\\"b": {"c": x"y}, "d": 1}'
+		self.assertEqual(pu.parse_dict(0, src, len(src)), (len(src), {'a"b': {'c': 'x"y'}, 'd': 1}))
+		self.assertEqual(pu.parse_dict(0, src, len(src), offsets=True)[0], len(src))
+		self.assertEqual(pu.extract(src, [('a"b', 'c'), 'd']), ['x"y', 1])
+		self.assertEqual(pu.parse_section(0, 'abc', 3), (3, ''))
+		# a broken tag is resumed after, not rescanned from every '<' in it
+		tags, errors = pu.parse_tags('<a <b x=1>\n<c y="<d>', on_error='collect')
+		self.assertEqual(tags, [('b', 'begin', {'x': '1'})])
+		self.assertEqual([(e.line, e.column, e.expected) for e in errors], [(1, 4, "'>'"), (2, 10, 'closing quote')])
+		html = '<a ' * 20000
+		tags, errors = pu.parse_tags(html, on_error='collect')
+		self.assertEqual((len(tags), len(errors)), (0, 20000))
+		self.assertEqual((errors[-1].offset, errors[-1].column), (len(html), len(html) + 1))
+		ini = 'x\n' * 20000
+		doc, errors = pu.parse_ini(ini, on_error='collect')
+		self.assertEqual([e.line for e in errors], list(range(1, 20001)))
+
+	def test_c_api(self):
+		class Text(ctypes.Structure):
+			_fields_ = [('kind', ctypes.c_int), ('data', ctypes.c_char_p), ('len', ctypes.c_ssize_t)]
+		class Span(ctypes.Structure):
+			_fields_ = [('beg', ctypes.c_ssize_t), ('end', ctypes.c_ssize_t), ('flags', ctypes.c_int)]
+		field_cb = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_ssize_t, ctypes.POINTER(Span))
+		class API(ctypes.Structure):
+			_fields_ = [('version', ctypes.c_uint), ('size', ctypes.c_size_t),
+				('Scanner_New', ctypes.PYFUNCTYPE(ctypes.c_void_p, ctypes.py_object)),
+				('Scanner_Free', ctypes.PYFUNCTYPE(None, ctypes.c_void_p)),
+				('CsvRow', ctypes.PYFUNCTYPE(ctypes.c_ssize_t, ctypes.c_void_p, ctypes.POINTER(Text),
+					ctypes.POINTER(ctypes.c_ssize_t), field_cb, ctypes.c_void_p)),
+				('CsvNextRow', ctypes.PYFUNCTYPE(ctypes.c_ssize_t, ctypes.c_void_p, ctypes.POINTER(Text),
+					ctypes.c_ssize_t, ctypes.POINTER(ctypes.c_int)))]
+
+		get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+		get_pointer.restype = ctypes.c_void_p
+		get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+		api = API.from_address(get_pointer(pu._C_API, b'parseutils._C_API'))
+		self.assertEqual(api.version, 1)
+		self.assertGreaterEqual(api.size, ctypes.sizeof(API))
+
+		data = b'a,"b ""c""",1\n\nx\n'
+		text = Text(1, data, len(data))
+		sc = api.Scanner_New(pu.CsvDialect(sep=';'))
+		api.Scanner_Free(sc)
+		sc = api.Scanner_New(None)
+		fields = []
+		cb = field_cb(lambda ctx, col, span: fields.append((col, span[0].beg, span[0].end, span[0].flags)) or 0)
+		index = ctypes.c_ssize_t(0)
+		self.assertEqual(api.CsvRow(sc, text, ctypes.byref(index), cb, None), 3)
+		self.assertEqual(fields, [(0, 0, 1, 0), (1, 3, 10, 3), (2, 12, 13, 0)])
+		self.assertEqual(index.value, 14)
+		empty = ctypes.c_int()
+		self.assertEqual(api.CsvNextRow(sc, text, 14, ctypes.byref(empty)), 15)
+		self.assertEqual(empty.value, 1)
+		api.Scanner_Free(sc)
+
+	@unittest.skipUnless(subinterpreters, 'no subinterpreters')
+	def test_subinterpreters(self):
+		code = textwrap.dedent('''
+			import sys
+			sys.path.insert(0, %r)
+			import parseutils as pu
+			assert pu.parse_list(0, '[1, "a"]', 8) == (8, [1, 'a'])
+			try:
+				pu.parse_list(0, '[1', 2)
+			except pu.ParseError as e:
+				assert e.offset == 2
+			else:
+				raise AssertionError
+			import datetime
+			records = pu.parse_csv_records('t\\n2024-01-02T03:04:05+01:00\\n', dtypes={'t': datetime.datetime})
+			assert records[0]['t'].utcoffset() == datetime.timedelta(hours=1)
+		''' % os.path.dirname(os.path.abspath(pu.__file__)))
+		for _ in range(3):
+			if sys.version_info >= (3, 13):
+				interp = subinterpreters.create()
+			else:
+				# _datetime needs the GIL of the main interpreter before 3.13
+				interp = subinterpreters.create(isolated=False)
+			self.assertIsNone(subinterpreters.run_string(interp, code))
+			subinterpreters.destroy(interp)
+		self.assertEqual(pu.parse_list(0, '[1]', 3), (3, [1]))
+		self.assertEqual(pu.parse_csv_records('t\n2024-01-02\n', dtypes={'t': datetime.datetime}),
+			[{'t': datetime.datetime(2024, 1, 2)}])
+
 if __name__ == '__main__':
 	unittest.main()